@@ -0,0 +1,237 @@
+#include "analysis.h"
+#include <climits>
+#include <iostream>
+// Graph of the nodes reachable from a root, numbered in discovery order
+// Successors are given by index, with -1 for the end of a path: either a null child,
+// or a child which is already in the current path (a loop)
+struct NodeGraph
+{
+    std::vector<std::shared_ptr<CircuitNode>> nodes;
+    std::unordered_map<CircuitNode*, int> indices;
+    std::vector<std::vector<int>> successors;
+    // Node indices, with every node after all of its successors
+    std::vector<int> postorder;
+    NodeGraph(std::shared_ptr<CircuitNode> root)
+    {
+        if (root == nullptr)
+            return;
+        enum { IN_PATH, DONE };
+        std::vector<uint8_t> state;
+        auto add = [&](std::shared_ptr<CircuitNode> node) {
+            indices[node.get()] = nodes.size();
+            nodes.push_back(node);
+            successors.emplace_back();
+            state.push_back(IN_PATH);
+        };
+        add(root);
+        // Explicit stack of (node, next child), as trees can be deeper than the call stack allows
+        std::vector<std::pair<int, size_t>> stack = {{0, 0}};
+        while (!stack.empty()) {
+            auto &[index, next] = stack.back();
+            CircuitNode &node = *nodes[index];
+            if (next == node.childs.size()) {
+                state[index] = DONE;
+                postorder.push_back(index);
+                stack.pop_back();
+                continue;
+            }
+            auto child = node.get_child(next++);
+            if (child == nullptr) {
+                successors[index].push_back(-1);
+                continue;
+            }
+            auto it = indices.find(child.get());
+            if (it == indices.end()) {
+                int child_index = nodes.size();
+                successors[index].push_back(child_index);
+                add(child);
+                stack.push_back({child_index, 0});
+            } else if (state[it->second] == IN_PATH) {
+                successors[index].push_back(-1);
+            } else {
+                successors[index].push_back(it->second);
+            }
+        }
+    }
+};
+// Number of gates counted by gate_count_distribution() in a single instruction
+static int gate_count(const InstructionRef &inst)
+{
+    switch (inst.type) {
+        case InstructionType::CX:
+        case InstructionType::CY:
+        case InstructionType::CZ:
+        case InstructionType::SXX:
+        case InstructionType::SXXDG:
+        case InstructionType::SZZ:
+        case InstructionType::SZZDG:
+        case InstructionType::DEPOLARIZE2:
+        case InstructionType::PAULI2:
+            return inst.targets.size()/2;
+        case InstructionType::TICK:
+            return 1;
+        default:
+            return inst.targets.size();
+    }
+}
+// Path counts saturate instead of overflowing, as they grow exponentially with the number of branch points
+static uint64_t add_paths(uint64_t a, uint64_t b)
+{
+    return a > UINT64_MAX-b ? UINT64_MAX : a+b;
+}
+uint64_t PathDistribution::num_paths() const
+{
+    uint64_t count = 0;
+    for (auto &[value, paths] : histogram)
+        count = add_paths(count, paths);
+    return count;
+}
+// Number of predecessors of each node, to release per node results once they are no longer needed
+static std::vector<int> predecessor_count(const NodeGraph &graph)
+{
+    std::vector<int> count(graph.nodes.size());
+    for (auto &succs : graph.successors) {
+        for (int succ : succs) {
+            if (succ >= 0)
+                count[succ]++;
+        }
+    }
+    return count;
+}
+std::vector<std::shared_ptr<CircuitNode>> reachable_nodes(std::shared_ptr<CircuitNode> node0)
+{
+    return NodeGraph(node0).nodes;
+}
+PathDistribution gate_count_distribution(std::shared_ptr<CircuitNode> node0, std::set<InstructionType> types)
+{
+    NodeGraph graph(node0);
+    if (graph.nodes.empty())
+        return PathDistribution();
+    auto uses = predecessor_count(graph);
+    // Histogram of the paths starting at each node, as counts for values min, min+1...
+    struct Histogram
+    {
+        int min=0;
+        std::vector<uint64_t> paths;
+        void add(int value, uint64_t count)
+        {
+            if (paths.empty())
+                min = value;
+            if (value < min) {
+                paths.insert(paths.begin(), min-value, 0);
+                min = value;
+            }
+            if (value-min >= paths.size())
+                paths.resize(value-min+1);
+            paths[value-min] = add_paths(paths[value-min], count);
+        }
+    };
+    std::vector<Histogram> hists(graph.nodes.size());
+    for (int index : graph.postorder) {
+        int count = 0;
+        for (auto inst : graph.nodes[index]->circuit->instructions) {
+            if (types.count(inst.type))
+                count += gate_count(inst);
+        }
+        auto &hist = hists[index];
+        if (graph.successors[index].empty())
+            hist.add(count, 1);
+        for (int succ : graph.successors[index]) {
+            if (succ < 0) {
+                hist.add(count, 1);
+                continue;
+            }
+            auto &other = hists[succ];
+            for (int i=0; i<other.paths.size(); i++) {
+                if (other.paths[i] != 0)
+                    hist.add(other.min+i+count, other.paths[i]);
+            }
+            if (--uses[succ] == 0)
+                other = Histogram();
+        }
+    }
+    PathDistribution dist;
+    for (int i=0; i<hists[0].paths.size(); i++) {
+        if (hists[0].paths[i] != 0)
+            dist.histogram[hists[0].min+i] = hists[0].paths[i];
+    }
+    return dist;
+}
+std::vector<uint64_t> depth_profile(std::shared_ptr<CircuitNode> node0)
+{
+    NodeGraph graph(node0);
+    if (graph.nodes.empty())
+        return {};
+    auto uses = predecessor_count(graph);
+    std::vector<std::vector<uint64_t>> depths(graph.nodes.size());
+    for (int index : graph.postorder) {
+        auto &depth0 = depths[index];
+        depth0 = {0};
+        for (int succ : graph.successors[index]) {
+            if (succ < 0)
+                continue;
+            auto &depth = depths[succ];
+            if (depth0.size() < depth.size()+1)
+                depth0.resize(depth.size()+1);
+            for (int j=0; j<depth.size(); j++)
+                depth0[j+1] = add_paths(depth0[j+1], depth[j]);
+            depth0[0] += 1;
+            if (--uses[succ] == 0)
+                std::vector<uint64_t>().swap(depth);
+        }
+    }
+    return std::move(depths[0]);
+}
+// Writes every node of a tree once, with the node followed by each of its branches
+void print_nodes(std::shared_ptr<CircuitNode> node)
+{
+    NodeGraph graph(node);
+    for (int i=0; i<graph.nodes.size(); i++) {
+        auto &n = *graph.nodes[i];
+        std::cout<<"Node "<<i<<" - "<<n.name<<"\n"<<*n.circuit;
+        for (int j=0; j<n.childs.size(); j++) {
+            auto child = n.get_child(j);
+            std::cout<<"Branch "<<j<<" - ";
+            if (child == nullptr)
+                std::cout<<"END\n";
+            else
+                std::cout<<"go to "<<graph.indices[child.get()]<<" ("<<child->name<<")\n";
+        }
+        std::cout<<std::endl;
+    }
+}
+static int saturate_int(uint64_t value)
+{
+    return value > INT_MAX ? INT_MAX : value;
+}
+std::vector<int> node_depth(std::shared_ptr<CircuitNode> node0)
+{
+    std::vector<int> depth;
+    for (uint64_t count : depth_profile(node0))
+        depth.push_back(saturate_int(count));
+    return depth;
+}
+int node_count(std::shared_ptr<CircuitNode> node0)
+{
+    NodeGraph graph(node0);
+    if (graph.nodes.empty())
+        return 0;
+    // Nodes in the paths starting at each node, counting shared nodes once for every path
+    std::vector<uint64_t> counts(graph.nodes.size());
+    for (int index : graph.postorder) {
+        uint64_t count = 1;
+        for (int succ : graph.successors[index]) {
+            if (succ >= 0)
+                count = add_paths(count, counts[succ]);
+        }
+        counts[index] = count;
+    }
+    return saturate_int(counts[0]);
+}
+// Writes the number of paths for each CNOT count
+void cnot_count(std::shared_ptr<CircuitNode> node)
+{
+    auto dist = gate_count_distribution(node, {InstructionType::CX});
+    for (auto &[count, paths] : dist.histogram)
+        std::cout<<count<<" CNOTs: "<<paths<<" paths"<<std::endl;
+}
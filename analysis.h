@@ -0,0 +1,35 @@
+#pragma once
+#include "circuit.h"
+// Tree analysis in time linear in the number of distinct nodes
+// Every node is visited once, so subtrees shared between several branches are only processed once.
+// Quantities defined over paths are computed by dynamic programming over the node graph.
+// Loops are followed once: a path ends when it reaches a node already in that path,
+// without counting that node again
+// Results are computed once per node, with loops cut at the edges that reach a node of the path of a
+// depth-first search from node0 taking childs in order. For nodes in several loops the result then depends
+// on that order: a node first reached through one loop keeps the paths cut there when reached through another
+
+// Distribution of a quantity over all root-to-leaf paths
+// Path counts saturate at UINT64_MAX
+struct PathDistribution
+{
+    // Number of paths with each value
+    std::map<int, uint64_t> histogram;
+    uint64_t num_paths() const;
+    int min() const
+    {
+        return histogram.empty() ? 0 : histogram.begin()->first;
+    }
+    int max() const
+    {
+        return histogram.empty() ? 0 : histogram.rbegin()->first;
+    }
+};
+// Reachable nodes, in the order they are first found by a depth-first search from node0
+std::vector<std::shared_ptr<CircuitNode>> reachable_nodes(std::shared_ptr<CircuitNode> node0);
+// Distribution over root-to-leaf paths of the number of gates of the given types
+// Two qubit gates count as one gate for every pair of targets
+PathDistribution gate_count_distribution(std::shared_ptr<CircuitNode> node0, std::set<InstructionType> types);
+// Number of nodes at each depth, counting a shared node once for every path reaching it
+// Element i is the number of nodes at distance i+1 from node0, as node_depth()
+std::vector<uint64_t> depth_profile(std::shared_ptr<CircuitNode> node0);
@@ -0,0 +1,124 @@
+#pragma once
+#include "circuit.h"
+#include <iostream>
+// Memo of the results of a pure callback (see CircuitNode::pure_callbacks) for shots with the same outcomes
+// The measurements read by a pure callback only depend on the outcomes of its previous reads, so all its
+// evaluations form a decision tree of calls to MeasurementResults. Shots walk down the tree, making the same
+// calls as the callback, flips and resets included, until they reach a stored result. The callback is
+// only evaluated for shots leaving the known part of the tree, and the calls it makes are added to it
+template<typename T>
+class CallbackMemo
+{
+    enum struct Call
+    {
+        IS_FLIPPED,
+        RESET_FLIPPED,
+        FLIP,
+        RESULT,
+    };
+    struct Step
+    {
+        Call call;
+        MeasurementRef ref;
+        // Next step for each outcome of the call (flips only use the first one), -1 if unknown
+        // For results, index in results
+        int next[2] = {-1, -1};
+    };
+    std::vector<Step> steps;
+    std::vector<T> results;
+    // Result of the last evaluation not added to the tree
+    T unrecorded;
+    // Step and outcome of the calls of a shot
+    std::vector<std::pair<int, bool>> path;
+    // Forwards the calls of a callback to the results of a shot, adding them to the tree.
+    // The calls already made by the shot in the tree are answered from its path
+    class Recorder final : public MeasurementResults
+    {
+        CallbackMemo &memo;
+        MeasurementResults &results;
+        // Whether new calls are added to the tree
+        bool record;
+        size_t num_calls=0;
+        bool call(Call type, int qubit, const MeasurementTag &tag)
+        {
+            auto &path = memo.path;
+            if (num_calls < path.size()) {
+                auto &step = memo.steps[path[num_calls].first];
+                if (step.call != type || step.ref.qubit != qubit || !(step.ref.tag == tag)) {
+                    std::cerr<<"Callback declared pure makes different calls for the same outcomes"<<std::endl;
+                    abort();
+                }
+                return path[num_calls++].second;
+            }
+            bool outcome = false;
+            if (type == Call::IS_FLIPPED)
+                outcome = results.is_flipped(qubit, tag);
+            else if (type == Call::RESET_FLIPPED)
+                outcome = results.reset_flipped(qubit, tag);
+            else
+                results.flip(qubit, tag);
+            if (!record)
+                return outcome;
+            memo.add_step({type, {qubit, tag}});
+            path.emplace_back(memo.steps.size()-1, outcome);
+            num_calls++;
+            return outcome;
+        }
+        public:
+        Recorder(CallbackMemo &memo, MeasurementResults &results, bool record) : memo(memo), results(results), record(record) {}
+        bool is_flipped(int qubit, const MeasurementTag &tag) override
+        {
+            return call(Call::IS_FLIPPED, qubit, tag);
+        }
+        bool reset_flipped(int qubit, const MeasurementTag &tag) override
+        {
+            return call(Call::RESET_FLIPPED, qubit, tag);
+        }
+        void flip(int qubit, const MeasurementTag &tag) override
+        {
+            call(Call::FLIP, qubit, tag);
+        }
+    };
+    // Links a new step to the last step of the path
+    void add_step(Step step)
+    {
+        if (!path.empty())
+            steps[path.back().first].next[path.back().second] = steps.size();
+        steps.push_back(std::move(step));
+    }
+    public:
+    // Trees beyond this number of steps are not extended, and the callback is evaluated for new outcomes
+    static constexpr size_t MAX_STEPS = 1<<20;
+    // Result of the callback for the results of a shot, which are modified as the callback would do
+    // The reference is valid until the next call
+    const T &get(MeasurementResults &res, const std::function<T(MeasurementResults&)> &callback)
+    {
+        path.clear();
+        int index = steps.empty() ? -1 : 0;
+        while (index >= 0) {
+            auto &step = steps[index];
+            if (step.call == Call::RESULT)
+                return results[step.next[0]];
+            bool outcome = false;
+            if (step.call == Call::IS_FLIPPED)
+                outcome = res.is_flipped(step.ref.qubit, step.ref.tag);
+            else if (step.call == Call::RESET_FLIPPED)
+                outcome = res.reset_flipped(step.ref.qubit, step.ref.tag);
+            else
+                res.flip(step.ref.qubit, step.ref.tag);
+            path.emplace_back(index, outcome);
+            index = step.next[outcome];
+        }
+        // Calls of the path have been made already, so the recorder answers them from the path
+        if (steps.size() >= MAX_STEPS) {
+            Recorder recorder(*this, res, false);
+            unrecorded = callback(recorder);
+            return unrecorded;
+        }
+        Recorder recorder(*this, res, true);
+        T result = callback(recorder);
+        add_step({Call::RESULT, {}, {(int)results.size(), -1}});
+        results.push_back(std::move(result));
+        return results.back();
+    }
+};
@@ -0,0 +1,176 @@
+#include "checkpoint.h"
+#include "analysis.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <typeinfo>
+// File layout:
+//   header: "FSIMCKPT", u32 version, simulator class name
+//   number of nodes in reachable_nodes(root)
+//   simulator state, as written by save_state()
+static const char FILE_MAGIC[8] = {'F','S','I','M','C','K','P','T'};
+static const uint32_t FILE_VERSION = 3;
+void StateWriter::set_nodes(const std::vector<std::shared_ptr<CircuitNode>> &nodes)
+{
+    node_indices.clear();
+    for (size_t i=0; i<nodes.size(); i++)
+        node_indices[nodes[i].get()] = i;
+}
+void StateWriter::put_node(const CircuitNode *node)
+{
+    if (node == nullptr) {
+        put(0);
+        return;
+    }
+    auto it = node_indices.find(node);
+    if (it == node_indices.end()) {
+        std::cerr<<"Node "<<node->name<<" of the simulator state is not reachable from the root"<<std::endl;
+        abort();
+    }
+    put(it->second+1);
+}
+void StateWriter::put_tag(const MeasurementTag &tag)
+{
+    put_signed(tag.current_round);
+    auto [it, inserted] = names.try_emplace(tag.name, names.size());
+    // New names are written after their index
+    put(it->second);
+    if (inserted)
+        put_string(tag.name);
+}
+void StateWriter::put_set(const std::set<int> &values)
+{
+    put(values.size());
+    int64_t last = 0;
+    for (int value : values) {
+        put_signed(value-last);
+        last = value;
+    }
+}
+void StateReader::check()
+{
+    if (!is) {
+        std::cerr<<"Truncated simulator state"<<std::endl;
+        abort();
+    }
+}
+MeasurementTag StateReader::get_tag()
+{
+    MeasurementTag tag;
+    tag.current_round = get_signed();
+    uint64_t index = get();
+    if (index == names.size()) {
+        names.push_back(get_string());
+    } else if (index > names.size()) {
+        std::cerr<<"Invalid measurement tag in simulator state"<<std::endl;
+        abort();
+    }
+    tag.name = names[index];
+    return tag;
+}
+std::shared_ptr<CircuitNode> StateReader::get_node()
+{
+    uint64_t index = get();
+    if (index > nodes.size()) {
+        std::cerr<<"Invalid node in simulator state"<<std::endl;
+        abort();
+    }
+    return index == 0 ? nullptr : nodes[index-1];
+}
+std::set<int> StateReader::get_set()
+{
+    std::set<int> values;
+    size_t count = get();
+    int64_t value = 0;
+    for (size_t i=0; i<count; i++) {
+        value += get_signed();
+        values.insert(values.end(), value);
+    }
+    return values;
+}
+static void save_checkpoint(const std::string &path, const BaseFrameSimulator &sim, const std::vector<std::shared_ptr<CircuitNode>> &nodes)
+{
+    std::string tmp = path+".tmp";
+    {
+        // Large buffer, so that the state is streamed to disk in few writes
+        std::vector<char> buffer(1<<20);
+        std::ofstream file;
+        file.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+        file.open(tmp, std::ios::binary | std::ios::trunc);
+        if (!file) {
+            std::cerr<<"Cannot open "<<tmp<<" for writing"<<std::endl;
+            abort();
+        }
+        file.write(FILE_MAGIC, sizeof(FILE_MAGIC));
+        StateWriter w(file);
+        w.put_u32(FILE_VERSION);
+        w.put_string(typeid(sim).name());
+        w.put(nodes.size());
+        w.set_nodes(nodes);
+        sim.save_state(w);
+        file.flush();
+        if (!file) {
+            std::cerr<<"Error writing checkpoint "<<tmp<<std::endl;
+            abort();
+        }
+    }
+    if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+        std::cerr<<"Cannot rename "<<tmp<<" to "<<path<<std::endl;
+        abort();
+    }
+}
+static void load_checkpoint(const std::string &path, BaseFrameSimulator &sim, const std::vector<std::shared_ptr<CircuitNode>> &nodes)
+{
+    std::vector<char> buffer(1<<20);
+    std::ifstream file;
+    file.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+    file.open(path, std::ios::binary);
+    if (!file) {
+        std::cerr<<"Cannot open checkpoint "<<path<<std::endl;
+        abort();
+    }
+    char magic[sizeof(FILE_MAGIC)];
+    file.read(magic, sizeof(magic));
+    StateReader r(file);
+    if (!file || !std::equal(magic, magic+sizeof(magic), FILE_MAGIC) || r.get_u32() != FILE_VERSION) {
+        std::cerr<<path<<" is not a FrameSim checkpoint of version "<<FILE_VERSION<<std::endl;
+        abort();
+    }
+    if (r.get_string() != typeid(sim).name()) {
+        std::cerr<<"Checkpoint "<<path<<" was saved by a different simulator class"<<std::endl;
+        abort();
+    }
+    if (r.get() != nodes.size()) {
+        std::cerr<<"Checkpoint "<<path<<" was saved for a different tree"<<std::endl;
+        abort();
+    }
+    r.set_nodes(nodes);
+    sim.load_state(r);
+}
+void save_checkpoint(const std::string &path, const BaseFrameSimulator &sim, std::shared_ptr<CircuitNode> root)
+{
+    save_checkpoint(path, sim, reachable_nodes(root));
+}
+void load_checkpoint(const std::string &path, BaseFrameSimulator &sim, std::shared_ptr<CircuitNode> root)
+{
+    load_checkpoint(path, sim, reachable_nodes(root));
+}
+void run_checkpointed(BaseFrameSimulator &sim, std::shared_ptr<CircuitNode> root, const std::string &path, double interval)
+{
+    auto nodes = reachable_nodes(root);
+    if (std::ifstream(path).good())
+        load_checkpoint(path, sim, nodes);
+    else
+        sim.start(root);
+    auto last_save = std::chrono::steady_clock::now();
+    while (sim.step()) {
+        auto now = std::chrono::steady_clock::now();
+        if (std::chrono::duration<double>(now-last_save).count() >= interval) {
+            save_checkpoint(path, sim, nodes);
+            last_save = now;
+        }
+    }
+    save_checkpoint(path, sim, nodes);
+}
@@ -0,0 +1,173 @@
+#pragma once
+#include "simulator_base.h"
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <string>
+// Binary streams for simulator states
+// Integers are written as variable length (LEB128) values, so that shot and qubit indices,
+// which are stored as differences from the previous one, take one or two bytes each.
+// Fixed size values are little-endian, so files can be read on hosts with another byte order.
+// Measurement tag names are written once, and referred to by index afterwards.
+// Nodes are written by their position in a list of nodes, see set_nodes()
+class StateWriter
+{
+    std::ostream &os;
+    std::map<std::string, uint64_t> names;
+    std::map<const CircuitNode*, uint64_t> node_indices;
+    public:
+    StateWriter(std::ostream &os) : os(os) {}
+    // Nodes which can be written, usually reachable_nodes(root)
+    void set_nodes(const std::vector<std::shared_ptr<CircuitNode>> &nodes);
+    void put_u32(uint32_t value)
+    {
+        char buf[4];
+        for (int i=0; i<4; i++)
+            buf[i] = value>>(8*i);
+        os.write(buf, 4);
+    }
+    void put(uint64_t value)
+    {
+        char buf[10];
+        int n = 0;
+        do {
+            buf[n++] = (value & 0x7F) | (value >= 0x80 ? 0x80 : 0);
+            value >>= 7;
+        } while (value != 0);
+        os.write(buf, n);
+    }
+    void put_signed(int64_t value)
+    {
+        put(((uint64_t)value<<1) ^ (uint64_t)(value>>63));
+    }
+    void put_double(double value)
+    {
+        uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        char buf[8];
+        for (int i=0; i<8; i++)
+            buf[i] = bits>>(8*i);
+        os.write(buf, 8);
+    }
+    void put_words(const std::vector<uint64_t> &words)
+    {
+        put(words.size());
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        os.write((const char*)words.data(), words.size()*sizeof(uint64_t));
+#else
+        for (uint64_t word : words) {
+            char buf[8];
+            for (int i=0; i<8; i++)
+                buf[i] = word>>(8*i);
+            os.write(buf, 8);
+        }
+#endif
+    }
+    void put_string(const std::string &str)
+    {
+        put(str.size());
+        os.write(str.data(), str.size());
+    }
+    void put_tag(const MeasurementTag &tag);
+    // Sorted set of integers, as differences between consecutive values
+    void put_set(const std::set<int> &values);
+    // Position of the node plus one, 0 for nullptr
+    void put_node(const CircuitNode *node);
+    void put_node(const std::shared_ptr<CircuitNode> &node)
+    {
+        put_node(node.get());
+    }
+};
+class StateReader
+{
+    std::istream &is;
+    std::vector<std::string> names;
+    std::vector<std::shared_ptr<CircuitNode>> nodes;
+    public:
+    StateReader(std::istream &is) : is(is) {}
+    // Nodes of the writer, see StateWriter::set_nodes()
+    void set_nodes(std::vector<std::shared_ptr<CircuitNode>> nodes)
+    {
+        this->nodes = std::move(nodes);
+    }
+    // Aborts if the stream ends before the expected data
+    void check();
+    uint32_t get_u32()
+    {
+        unsigned char buf[4];
+        is.read((char*)buf, 4);
+        check();
+        uint32_t value = 0;
+        for (int i=0; i<4; i++)
+            value |= (uint32_t)buf[i]<<(8*i);
+        return value;
+    }
+    uint64_t get()
+    {
+        uint64_t value = 0;
+        for (int shift=0; shift<64; shift+=7) {
+            int byte = is.get();
+            if (byte == EOF)
+                check();
+            value |= (uint64_t)(byte & 0x7F)<<shift;
+            if (!(byte & 0x80))
+                break;
+        }
+        return value;
+    }
+    int64_t get_signed()
+    {
+        uint64_t value = get();
+        return (int64_t)(value>>1) ^ -(int64_t)(value & 1);
+    }
+    double get_double()
+    {
+        unsigned char buf[8];
+        is.read((char*)buf, 8);
+        check();
+        uint64_t bits = 0;
+        for (int i=0; i<8; i++)
+            bits |= (uint64_t)buf[i]<<(8*i);
+        double value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+    void get_words(std::vector<uint64_t> &words)
+    {
+        words.resize(get());
+        is.read((char*)words.data(), words.size()*sizeof(uint64_t));
+        check();
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+        for (auto &word : words) {
+            auto *bytes = (const unsigned char*)&word;
+            uint64_t value = 0;
+            for (int i=0; i<8; i++)
+                value |= (uint64_t)bytes[i]<<(8*i);
+            word = value;
+        }
+#endif
+    }
+    std::string get_string()
+    {
+        std::string str(get(), '\0');
+        is.read(str.data(), str.size());
+        check();
+        return str;
+    }
+    MeasurementTag get_tag();
+    std::set<int> get_set();
+    std::shared_ptr<CircuitNode> get_node();
+};
+// Checkpoints of a simulation at node boundaries, to resume runs after the process is stopped
+// A checkpoint holds the state of the simulator, including the simulators of the branches being run,
+// the node each one has to run next, and the fault counts, fault enumeration and node visits of the run. Nodes are identified by their position in reachable_nodes(root),
+// so the same tree has to be provided on load.
+// Files are written to path.tmp and renamed, so an interrupted save leaves the previous checkpoint
+void save_checkpoint(const std::string &path, const BaseFrameSimulator &sim, std::shared_ptr<CircuitNode> root);
+// Restores the state of a simulator, including the random generator, so that the run continues with
+// sim.step(). The simulator must be of the same class, and set up as the one which saved the checkpoint
+// (e.g. with enable_fault_tables())
+void load_checkpoint(const std::string &path, BaseFrameSimulator &sim, std::shared_ptr<CircuitNode> root);
+// Runs a tree, saving a checkpoint every interval seconds and when the run ends
+// If path holds a checkpoint, the run is resumed from it, and the results are the same as without interruption
+void run_checkpointed(BaseFrameSimulator &sim, std::shared_ptr<CircuitNode> root, const std::string &path, double interval);
@@ -0,0 +1,139 @@
+// Runs resumed from a checkpoint must give the same results and statistics as uninterrupted runs
+#include "simulator.h"
+#include "checkpoint.h"
+#include <cstdio>
+#include <iostream>
+#include <sstream>
+static int failures = 0;
+static void check(bool ok, const std::string &name)
+{
+    std::cout<<(ok ? "ok   " : "FAIL ")<<name<<std::endl;
+    if (!ok)
+        failures++;
+}
+static const std::string path = "checkpoint_test.ckpt";
+// Noisy tree which splits the shots by a measurement, and discards some of them
+static std::shared_ptr<CircuitNode> branching_tree()
+{
+    auto root = std::make_shared<CircuitNode>("root");
+    auto left = std::make_shared<CircuitNode>("left");
+    auto right = std::make_shared<CircuitNode>("right");
+    root->circuit.append(Instruction(InstructionType::H, {0}));
+    root->circuit.append(Instruction(InstructionType::CX, {0, 1}));
+    root->circuit.append(Instruction(InstructionType::DEPOLARIZE2, {0, 1}, 0.05));
+    root->circuit.append(Instruction(InstructionType::MZ, {1}, {}, MeasurementTag{0, "m"}));
+    root->childs = {left, right};
+    root->next_node_index = [](MeasurementResults &res) { return res.is_flipped(1, MeasurementTag{0, "m"}) ? 1 : 0; };
+    left->circuit.append(Instruction(InstructionType::X_ERROR, {2}, 0.1));
+    left->circuit.append(Instruction(InstructionType::MZ, {2}, {}, MeasurementTag{0, "l"}));
+    left->next_node_index = [](MeasurementResults &res) { return res.is_flipped(2, MeasurementTag{0, "l"}) ? -1 : 0; };
+    right->circuit.append(Instruction(InstructionType::PAULI1, {0}, {0.01, 0.02, 0.03}));
+    right->circuit.append(Instruction(InstructionType::MX, {0}, {}, MeasurementTag{0, "r"}));
+    return root;
+}
+// Flipped measurements of every shot, and the statistics of the run
+static std::string results(const FrameSimulator &sim)
+{
+    std::ostringstream os;
+    std::map<uint64_t, std::string> shots;
+    auto &ids = sim.get_shot_ids();
+    for (size_t shot=0; shot<ids.size(); shot++)
+        shots[ids.global(shot)];
+    sim.for_each_flip([&](size_t shot, int qubit, const MeasurementTag &tag) {
+        shots[ids.global(shot)] += std::to_string(qubit)+tag.name+" ";
+    });
+    for (auto &[id, flips] : shots)
+        os<<id<<":"<<flips<<"\n";
+    for (auto &[node, visits] : sim.get_node_visits())
+        os<<node->name<<" visited "<<visits<<"\n";
+    return os.str();
+}
+static std::string fault_counts(const FrameSimulator &sim)
+{
+    std::ostringstream os;
+    auto &counts = sim.get_fault_counts();
+    os<<counts.total_shots<<" shots\n";
+    for (auto &[type, p] : counts.classes)
+        os<<(int)type<<" "<<p<<"\n";
+    for (auto &[shot, faults] : counts.shot_faults) {
+        os<<shot<<":";
+        for (uint32_t count : faults)
+            os<<" "<<count;
+        os<<"\n";
+    }
+    for (auto &group : counts.groups) {
+        for (auto &range : group.ids.get_ranges())
+            os<<range.first<<"+"<<range.count<<" ";
+        for (uint64_t count : group.locations)
+            os<<count<<" ";
+        os<<group.discarded<<"\n";
+    }
+    return os.str();
+}
+// Runs the tree with fault counts, stopping after the given number of steps and resuming
+// in another simulator from a checkpoint. Negative steps run without interruption
+static std::string counted_run(std::shared_ptr<CircuitNode> tree, int steps)
+{
+    std::mt19937_64 rng(1);
+    auto setup = [&](FrameSimulator &sim) {
+        sim.use_counter_rng(7);
+        sim.enable_fault_counts();
+        sim.enable_node_visits();
+    };
+    FrameSimulator sim(2000, rng);
+    setup(sim);
+    sim.start(tree);
+    for (int i=0; i!=steps && sim.step(); i++);
+    if (steps < 0)
+        return results(sim)+fault_counts(sim);
+    save_checkpoint(path, sim, tree);
+    FrameSimulator resumed(0, rng);
+    setup(resumed);
+    load_checkpoint(path, resumed, tree);
+    while (resumed.step());
+    return results(resumed)+fault_counts(resumed);
+}
+static std::string enumerated_run(std::shared_ptr<CircuitNode> tree, int steps)
+{
+    std::mt19937_64 rng;
+    auto state = std::make_shared<FaultEnumeration>();
+    state->max_weight = 2;
+    state->shard = 0;
+    state->num_shards = 1;
+    FrameSimulator sim(1, rng);
+    sim.enumerate_faults(state);
+    sim.enable_node_visits();
+    sim.start(tree);
+    for (int i=0; i!=steps && sim.step(); i++);
+    std::ostringstream os;
+    if (steps >= 0) {
+        save_checkpoint(path, sim, tree);
+        state = std::make_shared<FaultEnumeration>();
+        FrameSimulator resumed(1, rng);
+        resumed.enumerate_faults(state);
+        resumed.enable_node_visits();
+        load_checkpoint(path, resumed, tree);
+        while (resumed.step());
+        os<<results(resumed);
+    } else {
+        os<<results(sim);
+    }
+    for (auto &faults : state->shot_faults) {
+        for (auto &fault : faults)
+            os<<fault<<", ";
+        os<<"\n";
+    }
+    return os.str();
+}
+int main()
+{
+    auto tree = branching_tree();
+    auto counted = counted_run(tree, -1);
+    auto enumerated = enumerated_run(tree, -1);
+    for (int steps : {1, 2, 3}) {
+        check(counted_run(tree, steps) == counted, "fault counts and node visits, resumed after "+std::to_string(steps)+" steps");
+        check(enumerated_run(tree, steps) == enumerated, "fault enumeration, resumed after "+std::to_string(steps)+" steps");
+    }
+    std::remove(path.c_str());
+    return failures > 0;
+}
@@ -1,8 +1,10 @@
 #include "circuit.h"
+#include <charconv>
 #include <string>
 #include <iostream>
+#include <cstring>
 // String representation of the InstructionType enum
-std::string InstructionNames[] = {
+std::string InstructionNames[NUM_INSTRUCTION_TYPES] = {
     "I",
     "X",
     "Y",
@@ -38,34 +40,281 @@ std::string InstructionNames[] = {
     "DELAY",
     "TICK",
 };
-// Prints a circuit instruction to the stream
-std::ostream &operator<<(std::ostream &os, const Instruction &instr)
+std::vector<double> pauli_channel(const InstructionRef &inst)
+{
+    auto &p = inst.p;
+    switch (inst.type) {
+        case InstructionType::X_ERROR:
+            return {1-p[0], p[0], 0, 0};
+        case InstructionType::Z_ERROR:
+            return {1-p[0], 0, p[0], 0};
+        case InstructionType::Y_ERROR:
+            return {1-p[0], 0, 0, p[0]};
+        case InstructionType::DEPOLARIZE1:
+            return {1-p[0], p[0]/3, p[0]/3, p[0]/3};
+        case InstructionType::PAULI1:
+            return {1-p[0]-p[1]-p[2], p[0], p[1], p[2]};
+        case InstructionType::DEPOLARIZE2:
+        {
+            std::vector<double> errors(16, p[0]/15);
+            errors[0] = 1-p[0];
+            return errors;
+        }
+        case InstructionType::PAULI2:
+        {
+            std::vector<double> errors(16);
+            errors[0] = 1;
+            for (int i=1; i<16; i++) {
+                errors[i] = p[i-1];
+                errors[0] -= p[i-1];
+            }
+            return errors;
+        }
+        case InstructionType::DEPOLARIZE:
+        {
+            size_t n = size_t(1)<<(2*inst.targets.size());
+            std::vector<double> errors(n, p[0]/(n-1));
+            errors[0] = 1-p[0];
+            return errors;
+        }
+        default:
+            return {1};
+    }
+}
+// Prints a probability with the shortest representation that reads back exactly
+static void print_param(std::ostream &os, double p)
+{
+    char buf[32];
+    auto res = std::to_chars(buf, buf+sizeof(buf), p, std::chars_format::general);
+    os.write(buf, res.ptr-buf);
+}
+// Prints a circuit instruction to the stream, in the format read by parse_circuit()
+std::ostream &operator<<(std::ostream &os, const InstructionRef &instr)
 {
     os << InstructionNames[(int)instr.type];
     if (!instr.p.empty()) {
         os << '(';
-        os << instr.p[0];
+        print_param(os, instr.p[0]);
         for (int i=1; i<instr.p.size(); i++) {
             os << ',';
-            os << instr.p[i];
+            print_param(os, instr.p[i]);
         }
         os << ')';
     }
-    if (instr.label)
+    if (instr.measurement_tag)
+        os << '[' << instr.measurement_tag->name << ':' << instr.measurement_tag->current_round << ']';
+    if (instr.label && !instr.label->empty())
         os << ' ' << *instr.label;
     for (int t : instr.targets) {
         os << ' ' << t;
     }
     return os;
 }
+std::ostream &operator<<(std::ostream &os, const Instruction &instr)
+{
+    return os << InstructionRef(instr);
+}
 // Prints a circuit to the stream
 std::ostream &operator<<(std::ostream &os, const Circuit &circ)
 {
-    for (auto &instr : circ.instructions) {
+    for (auto instr : circ.instructions) {
         os << instr << '\n';
     }
     return os;
 }
+void InstructionList::push_back(InstructionType type, Span<int> inst_targets, Span<double> p, const MeasurementTag *tag, const std::string *label)
+{
+    Header h;
+    h.type = type;
+    h.targets_offset = targets.size();
+    h.num_targets = inst_targets.size();
+    h.p_offset = params.size();
+    h.num_p = p.size();
+    h.tag = -1;
+    h.label = -1;
+    // The source may point into this list's own pools, which can be reallocated
+    if (inst_targets.begin() >= targets.data() && inst_targets.begin() < targets.data()+targets.size()) {
+        std::vector<int> copy(inst_targets.begin(), inst_targets.end());
+        targets.insert(targets.end(), copy.begin(), copy.end());
+    } else {
+        targets.insert(targets.end(), inst_targets.begin(), inst_targets.end());
+    }
+    if (p.begin() >= params.data() && p.begin() < params.data()+params.size()) {
+        std::vector<double> copy(p.begin(), p.end());
+        params.insert(params.end(), copy.begin(), copy.end());
+    } else {
+        params.insert(params.end(), p.begin(), p.end());
+    }
+    if (tag != nullptr) {
+        h.tag = tags.size();
+        MeasurementTag copy = *tag;
+        tags.push_back(std::move(copy));
+    }
+    if (label != nullptr) {
+        h.label = labels.size();
+        std::string copy = *label;
+        labels.push_back(std::move(copy));
+    }
+    headers.push_back(h);
+}
+void InstructionList::append(const InstructionList &o)
+{
+    if (&o == this) {
+        InstructionList copy = o;
+        append(std::move(copy));
+        return;
+    }
+    uint32_t targets_offset = targets.size();
+    uint32_t p_offset = params.size();
+    int32_t tag_offset = tags.size();
+    int32_t label_offset = labels.size();
+    headers.reserve(headers.size()+o.headers.size());
+    for (auto h : o.headers) {
+        h.targets_offset += targets_offset;
+        h.p_offset += p_offset;
+        if (h.tag >= 0)
+            h.tag += tag_offset;
+        if (h.label >= 0)
+            h.label += label_offset;
+        headers.push_back(h);
+    }
+    targets.insert(targets.end(), o.targets.begin(), o.targets.end());
+    params.insert(params.end(), o.params.begin(), o.params.end());
+    tags.insert(tags.end(), o.tags.begin(), o.tags.end());
+    labels.insert(labels.end(), o.labels.begin(), o.labels.end());
+}
+void InstructionList::append(InstructionList &&o)
+{
+    if (headers.empty()) {
+        *this = std::move(o);
+        return;
+    }
+    append(o);
+}
+void InstructionList::reserve(size_t num_instructions, size_t num_targets)
+{
+    headers.reserve(num_instructions);
+    targets.reserve(num_targets);
+}
+void InstructionList::clear()
+{
+    headers.clear();
+    targets.clear();
+    params.clear();
+    tags.clear();
+    labels.clear();
+}
+bool InstructionList::operator==(const InstructionList &o) const
+{
+    if (headers.size() != o.headers.size())
+        return false;
+    for (size_t i=0; i<headers.size(); i++) {
+        if ((*this)[i] != o[i])
+            return false;
+    }
+    return true;
+}
+// Mixes a value into a hash (FNV-1a over 64-bit words, with a final avalanche step)
+static inline uint64_t hash_combine(uint64_t h, uint64_t v)
+{
+    h ^= v;
+    h *= UINT64_C(0x100000001b3);
+    return h ^ (h>>29);
+}
+static inline uint64_t hash_string(uint64_t h, const std::string &str)
+{
+    for (char c : str) {
+        h = hash_combine(h, (unsigned char)c);
+    }
+    return hash_combine(h, str.size());
+}
+uint64_t circuit_hash(const Circuit &circ)
+{
+    uint64_t h = UINT64_C(0xcbf29ce484222325);
+    h = hash_combine(h, circ.num_qubits);
+    for (auto inst : circ.instructions) {
+        h = hash_combine(h, (uint64_t)inst.type);
+        h = hash_combine(h, inst.targets.size());
+        for (int t : inst.targets) {
+            h = hash_combine(h, (uint32_t)t);
+        }
+        h = hash_combine(h, inst.p.size());
+        for (double p : inst.p) {
+            uint64_t bits = 0;
+            // +0 and -0 compare equal, so they must have the same hash
+            if (p != 0)
+                std::memcpy(&bits, &p, sizeof(bits));
+            h = hash_combine(h, bits);
+        }
+        if (inst.measurement_tag) {
+            h = hash_combine(h, (uint32_t)inst.measurement_tag->current_round);
+            h = hash_string(h, inst.measurement_tag->name);
+        }
+        if (inst.label)
+            h = hash_string(h, *inst.label);
+    }
+    return h;
+}
+std::shared_ptr<const Circuit> CircuitStore::find(const Circuit &circ, uint64_t hash) const
+{
+    auto range = circuits.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (*it->second == circ)
+            return it->second;
+    }
+    return nullptr;
+}
+std::shared_ptr<const Circuit> CircuitStore::intern(const Circuit &circ)
+{
+    uint64_t hash = circuit_hash(circ);
+    auto stored = find(circ, hash);
+    if (stored == nullptr) {
+        stored = std::make_shared<Circuit>(circ);
+        circuits.emplace(hash, stored);
+    }
+    return stored;
+}
+std::shared_ptr<const Circuit> CircuitStore::intern(Circuit &&circ)
+{
+    uint64_t hash = circuit_hash(circ);
+    auto stored = find(circ, hash);
+    if (stored == nullptr) {
+        stored = std::make_shared<Circuit>(std::move(circ));
+        circuits.emplace(hash, stored);
+    }
+    return stored;
+}
+std::shared_ptr<const Circuit> CircuitStore::intern(std::shared_ptr<const Circuit> circ)
+{
+    uint64_t hash = circuit_hash(*circ);
+    auto stored = find(*circ, hash);
+    if (stored == nullptr) {
+        stored = circ;
+        circuits.emplace(hash, stored);
+    }
+    return stored;
+}
+SyndromeMeasurements::SyndromeMeasurements(std::vector<MeasurementRef> syndrome) : syndrome(syndrome)
+{
+    check_size();
+}
+void SyndromeMeasurements::check_size() const
+{
+    if (syndrome.size() > MAX_SIZE) {
+        std::cerr<<"Syndromes of "<<syndrome.size()<<" measurements are not supported, the maximum is "<<MAX_SIZE<<std::endl;
+        abort();
+    }
+}
+void CorrectionTable::add_entry(uint64_t syndrome_value, std::vector<int> x, std::vector<int> z)
+{
+    if (syndrome_value == 0)
+        abort();
+    table[syndrome_value] = {x, z};
+}
+void CorrectionTable::add_parity_rule(uint64_t mask, std::vector<int> x, std::vector<int> z)
+{
+    parity_rules.push_back({mask, {x, z}});
+}
 // Combines the operations from two circuits, keeping instructions in
 // the original timestep, as specified by TICK instructions
 Circuit merge_circuits(Circuit c1, Circuit c2)
@@ -94,114 +343,193 @@ Circuit merge_circuits(Circuit c1, Circuit c2)
         }
         c.append(InstructionType::TICK);
     }
-    return std::move(c);
+    return c;
 }
 // Utility to partially merge two independent nodes, given a starting point
-std::shared_ptr<CircuitNode> merge_nodes(std::shared_ptr<CircuitNode> nodea, std::shared_ptr<CircuitNode> nodeb, std::list<Instruction>::iterator indexa, std::list<Instruction>::iterator indexb)
+std::function<int(MeasurementResults&)> merged_next_node_index(std::shared_ptr<CircuitNode> nodea, std::shared_ptr<CircuitNode> nodeb)
 {
-    auto node0 = std::make_shared<CircuitNode>((nodea != nullptr ? nodea->name : "")+" + "+(nodeb != nullptr ? nodeb->name : ""));
+    return [nodea, nodeb](MeasurementResults &results) {
+        int i = nodea->get_next_node_index(results);
+        int j = nodeb->get_next_node_index(results);
+        if (i < 0 || j < 0)
+            return -1;
+        return (int)(i*nodeb->childs.size()+j);
+    };
+}
+std::function<std::pair<std::set<int>,std::set<int>>(MeasurementResults&)> merged_error_corrections(std::shared_ptr<CircuitNode> nodea, std::shared_ptr<CircuitNode> nodeb)
+{
+    return [nodea, nodeb](MeasurementResults &results) {
+        auto errors = nodea->error_corrections(results);
+        auto errb = nodeb->error_corrections(results);
+        for (int err : errb.first) {
+            if (!errors.first.erase(err))
+                errors.first.insert(err);
+        }
+        for (int err : errb.second) {
+            if (!errors.second.erase(err))
+                errors.second.insert(err);
+        }
+        return errors;
+    };
+}
+MergedCircuitNode::MergedCircuitNode(std::shared_ptr<Context> context, std::shared_ptr<CircuitNode> nodea, std::shared_ptr<CircuitNode> nodeb, size_t indexa, size_t indexb)
+    : CircuitNode((nodea != nullptr ? nodea->name : "")+" + "+(nodeb != nullptr ? nodeb->name : "")), context(context)
+{
+    // Interleave both circuits tick by tick, until one of them reaches a branching point
+    Circuit merged;
+    size_t enda_index = nodea != nullptr ? nodea->circuit->instructions.size() : 0;
+    size_t endb_index = nodeb != nullptr ? nodeb->circuit->instructions.size() : 0;
     while (nodea != nullptr || nodeb != nullptr)
     {
-        while (nodea != nullptr && indexa != nodea->circuit.instructions.end()) {
-            if (indexa->type == InstructionType::TICK) {
-                ++indexa;
+        while (nodea != nullptr && indexa != enda_index) {
+            auto inst = nodea->circuit->instructions[indexa++];
+            if (inst.type == InstructionType::TICK)
                 break;
-            }
-            node0->circuit.append(*indexa);
-            ++indexa;
+            merged.append(inst);
         }
-        while (nodeb != nullptr && indexb != nodeb->circuit.instructions.end()) {
-            if (indexb->type == InstructionType::TICK) {
-                ++indexb;
+        while (nodeb != nullptr && indexb != endb_index) {
+            auto inst = nodeb->circuit->instructions[indexb++];
+            if (inst.type == InstructionType::TICK)
                 break;
-            }
-            node0->circuit.append(*indexb);
-            ++indexb;
+            merged.append(inst);
         }
-        bool enda = nodea != nullptr && indexa == nodea->circuit.instructions.end();
-        bool endb = nodeb != nullptr && indexb == nodeb->circuit.instructions.end();
+        bool enda = nodea != nullptr && indexa == enda_index;
+        bool endb = nodeb != nullptr && indexb == endb_index;
         if (enda && endb) {
             if (!nodea->childs.empty() && !nodeb->childs.empty()) {
-                for (int i=0; i<nodea->childs.size(); i++) {
-                    for (int j=0; j<nodeb->childs.size(); j++) {
-                        node0->childs.push_back(merge_nodes(nodea->childs[i], nodeb->childs[j], nodea->childs[i] == nullptr ? std::list<Instruction>::iterator() : nodea->childs[i]->circuit.instructions.begin(), nodeb->childs[j] == nullptr ? std::list<Instruction>::iterator() : nodeb->childs[j]->circuit.instructions.begin()));
+                for (size_t i=0; i<nodea->childs.size(); i++) {
+                    for (size_t j=0; j<nodeb->childs.size(); j++) {
+                        add_pending_child({nodea->get_child(i), nodeb->get_child(j), 0, 0});
                     }
                 }
-                node0->next_node_index = [nodea, nodeb](MeasurementResults &results) {
-                    int i = nodea->next_node_index != nullptr ? nodea->next_node_index(results) : 0;
-                    int j = nodeb->next_node_index != nullptr ? nodeb->next_node_index(results) : 0;
-                    if (i < 0 || j < 0)
-                        return -1;
-                    return (int)(i*nodeb->childs.size()+j);
-                };
+                next_node_index = merged_next_node_index(nodea, nodeb);
+                next_node_index_source = {"", nodea, nodeb};
             } else if (!nodea->childs.empty()) {
-                node0->childs = nodea->childs;
-                node0->next_node_index = nodea->next_node_index;
+                copy_childs(*nodea);
+                next_node_index = nodea->next_node_index;
+                next_node_index_source = nodea->next_node_index_source;
+                branch_condition = nodea->branch_condition;
             } else if (!nodeb->childs.empty()) {
-                node0->childs = nodeb->childs;
-                node0->next_node_index = nodeb->next_node_index;
+                copy_childs(*nodeb);
+                next_node_index = nodeb->next_node_index;
+                next_node_index_source = nodeb->next_node_index_source;
+                branch_condition = nodeb->branch_condition;
             }
             if (nodea->error_corrections && nodeb->error_corrections) {
-                node0->error_corrections = [nodea, nodeb](MeasurementResults &results) {
-                    auto errors = nodea->error_corrections(results);
-                    auto errb = nodeb->error_corrections(results);
-                    for (int err : errb.first) {
-                        if (!errors.first.erase(err))
-                            errors.first.insert(err);
-                    }
-                    for (int err : errb.second) {
-                        if (!errors.second.erase(err))
-                            errors.second.insert(err);
-                    }
-                    return errors;
-                };
+                error_corrections = merged_error_corrections(nodea, nodeb);
+                error_corrections_source = {"", nodea, nodeb};
             } else if (nodea->error_corrections) {
-                node0->error_corrections = nodea->error_corrections;
+                error_corrections = nodea->error_corrections;
+                error_corrections_source = nodea->error_corrections_source;
             } else {
-                node0->error_corrections = nodeb->error_corrections;
+                error_corrections = nodeb->error_corrections;
+                error_corrections_source = nodeb->error_corrections_source;
             }
+            pure_callbacks = nodea->pure_callbacks && nodeb->pure_callbacks;
+            correction_tables = nodea->correction_tables;
+            correction_tables.insert(correction_tables.end(), nodeb->correction_tables.begin(), nodeb->correction_tables.end());
             break;
         } else if (enda && !nodea->childs.empty()) {
             if (nodeb == nullptr) {
-                node0->childs = nodea->childs;
+                copy_childs(*nodea);
             } else {
-                for (auto node : nodea->childs) {
-                    node0->childs.push_back(merge_nodes(node, nodeb, node == nullptr ? std::list<Instruction>::iterator() : node->circuit.instructions.begin(), indexb));
+                for (size_t i=0; i<nodea->childs.size(); i++) {
+                    add_pending_child({nodea->get_child(i), nodeb, 0, indexb});
                 }
             }
-            node0->next_node_index = nodea->next_node_index;
-            node0->error_corrections = nodea->error_corrections;
+            copy_callbacks(*nodea);
             break;
         } else if (endb && !nodeb->childs.empty()) {
             if (nodea == nullptr) {
-                node0->childs = nodeb->childs;
+                copy_childs(*nodeb);
             } else {
-                for (auto node : nodeb->childs) {
-                    node0->childs.push_back(merge_nodes(nodea, node, indexa, node == nullptr ? std::list<Instruction>::iterator() : node->circuit.instructions.begin()));
+                for (size_t i=0; i<nodeb->childs.size(); i++) {
+                    add_pending_child({nodea, nodeb->get_child(i), indexa, 0});
                 }
             }
-            node0->next_node_index = nodeb->next_node_index;
-            node0->error_corrections = nodeb->error_corrections;
+            copy_callbacks(*nodeb);
             break;
         } else if (enda && nodeb == nullptr) {
-            node0->circuit.append(InstructionType::TICK);
-            node0->next_node_index = nodea->next_node_index;
-            node0->error_corrections = nodea->error_corrections;
+            merged.append(InstructionType::TICK);
+            copy_callbacks(*nodea);
             break;
         } else if (endb && nodea == nullptr) {
-            node0->circuit.append(InstructionType::TICK);
-            node0->next_node_index = nodeb->next_node_index;
-            node0->error_corrections = nodeb->error_corrections;
+            merged.append(InstructionType::TICK);
+            copy_callbacks(*nodeb);
             break;
         }
-        node0->circuit.append(InstructionType::TICK);
+        merged.append(InstructionType::TICK);
     }
-    return node0;
+    circuit = std::move(merged);
+}
+void MergedCircuitNode::add_pending_child(const Key &key)
+{
+    pending.resize(childs.size());
+    weak_childs.resize(childs.size());
+    pending.push_back(key);
+    weak_childs.emplace_back();
+    childs.push_back(nullptr);
+}
+void MergedCircuitNode::copy_childs(CircuitNode &node)
+{
+    for (size_t i=0; i<node.childs.size(); i++)
+        childs.push_back(node.get_child(i));
 }
-// Combine two trees into a single one. Not working if the tree contains a loop
+void MergedCircuitNode::copy_callbacks(const CircuitNode &node)
+{
+    next_node_index = node.next_node_index;
+    next_node_index_source = node.next_node_index_source;
+    branch_condition = node.branch_condition;
+    error_corrections = node.error_corrections;
+    error_corrections_source = node.error_corrections_source;
+    pure_callbacks = node.pure_callbacks;
+    correction_tables = node.correction_tables;
+}
+std::shared_ptr<CircuitNode> MergedCircuitNode::get(std::shared_ptr<Context> context, const Key &key, bool &built)
+{
+    auto index = std::make_tuple(key.nodea.get(), key.nodeb.get(), key.indexa, key.indexb);
+    auto it = context->nodes.find(index);
+    if (it != context->nodes.end()) {
+        auto node = it->second.lock();
+        built = node == nullptr;
+        if (node != nullptr)
+            return node;
+    }
+    built = true;
+    auto node = std::make_shared<MergedCircuitNode>(context, key.nodea, key.nodeb, key.indexa, key.indexb);
+    context->nodes[index] = node;
+    return node;
+}
+std::shared_ptr<CircuitNode> MergedCircuitNode::get_child(size_t i)
+{
+    if (i >= pending.size())
+        return childs[i];
+    std::lock_guard<std::mutex> lock(context->mutex);
+    if (!pending[i].has_value())
+        return childs[i];
+    auto node = weak_childs[i].lock();
+    if (node != nullptr)
+        return node;
+    // A node built now cannot be an ancestor, so it is owned. Nodes built before are
+    // only referenced, as they can be ancestors, and owning them would leak loops
+    bool built;
+    node = get(context, *pending[i], built);
+    if (built) {
+        childs[i] = node;
+        pending[i].reset();
+    } else {
+        weak_childs[i] = node;
+    }
+    return node;
+}
+// Combine two trees into a single one
+// Nodes of the combined tree are built when first accessed through get_child()
 std::shared_ptr<CircuitNode> merge_nodes(std::shared_ptr<CircuitNode> nodea, std::shared_ptr<CircuitNode> nodeb)
 {
-    return merge_nodes(nodea, nodeb, nodea->circuit.instructions.begin(), nodeb->circuit.instructions.begin());
+    auto context = std::make_shared<MergedCircuitNode::Context>();
+    std::lock_guard<std::mutex> lock(context->mutex);
+    bool built;
+    return MergedCircuitNode::get(context, {nodea, nodeb, 0, 0}, built);
 }
 // Not directly called, called from the main apply_node_to_end to properly handle tree loops
 void apply_node_to_end(std::shared_ptr<CircuitNode> node0, std::shared_ptr<CircuitNode> node, std::set<std::shared_ptr<CircuitNode>> &visited, std::shared_ptr<CircuitNode> ft_node)
@@ -216,10 +544,11 @@ void apply_node_to_end(std::shared_ptr<CircuitNode> node0, std::shared_ptr<Circu
         for (int i=0; i<node0->childs.size(); ++i) {
             if (i > 0)
                 ft_node = node;
-            if (node0->childs[i] == nullptr) {
+            auto child = node0->get_child(i);
+            if (child == nullptr) {
                 node0->childs[i] = ft_node;
             } else {
-                apply_node_to_end(node0->childs[i], node, visited, ft_node);
+                apply_node_to_end(child, node, visited, ft_node);
             }
         }
     }
@@ -232,78 +561,3 @@ void apply_node_to_end(std::shared_ptr<CircuitNode> node0, std::shared_ptr<Circu
     std::set<std::shared_ptr<CircuitNode>> visited;
     apply_node_to_end(node0, node, visited, ft_node);
 }
-#include <sstream>
-// Writes all possible circuit paths that a tree can contain
-void print_nodes(std::shared_ptr<CircuitNode> node, std::set<std::shared_ptr<CircuitNode>> &&visited, std::string printed)
-{
-    if (printed.empty()) printed += "Branch 0 - ";
-    printed += node->name+"\n";
-    std::stringstream s;
-    s<<node->circuit;
-    printed += s.str();
-    if (node->childs.empty()) {
-        std::cout<<printed<<std::endl;
-        return;
-    }
-    for (int i=0; i<node->childs.size(); i++) {
-        if (node->childs[i]) {
-            if (visited.find(node->childs[i]) == visited.end()) {
-                std::set<std::shared_ptr<CircuitNode>> v = visited;
-                v.insert(node->childs[i]);
-                print_nodes(node->childs[i], std::move(v), printed+"Branch "+std::to_string(i)+" - ");
-            } else {
-                printed += "Branch "+std::to_string(i)+" - go back to "+node->childs[i]->name;
-            }
-        } else {
-            //std::cout<<printed+std::to_string(i)<<" - END\n"<<std::endl;
-        }
-    }
-}
-std::vector<int> node_depth(std::shared_ptr<CircuitNode> node0)
-{
-    std::vector<int> depth0 = {0};
-    for (int i=0; i<node0->childs.size(); i++) {
-        if (node0->childs[i]) {
-            auto depth = node_depth(node0->childs[i]);
-            for (int j=0; j<depth.size(); j++) {
-                if (j+1<depth0.size())
-                    depth0[j+1] += depth[j];
-                else
-                    depth0.push_back(depth[j]);
-            }
-            depth0[0] += 1;
-        }
-    }
-    return depth0;
-}
-std::set<CircuitNode*> visited;
-int node_count(std::shared_ptr<CircuitNode> node0)
-{
-    visited.insert(node0.get());
-    int count = 1;
-    for (auto node : node0->childs) {
-        if (node != nullptr)
-            count += node_count(node);
-    }
-    return count;
-}
-void cnot_count(std::shared_ptr<CircuitNode> node, std::set<std::shared_ptr<CircuitNode>> &&visited, int current_count)
-{
-    for (auto &inst : node->circuit.instructions) {
-        if (inst.type == InstructionType::CX)
-            current_count += inst.targets.size()/2;
-    }
-    if (node->childs.empty()) {
-        std::cout<<current_count<<std::endl;
-        return;
-    }
-    for (int i=0; i<node->childs.size(); i++) {
-        if (node->childs[i]) {
-            if (visited.find(node->childs[i]) == visited.end()) {
-                std::set<std::shared_ptr<CircuitNode>> v = visited;
-                v.insert(node->childs[i]);
-                cnot_count(node->childs[i], std::move(v), current_count);
-            }
-        }
-    }
-}
\ No newline at end of file
@@ -1,12 +1,17 @@
 #pragma once
 #include <vector>
 #include <memory>
-#include <list>
+#include <iterator>
 #include <set>
 #include <functional>
 #include <map>
 #include <ostream>
 #include <optional>
+#include <unordered_map>
+#include <cstdint>
+#include <bitset>
+#include <tuple>
+#include <mutex>
 enum struct InstructionType
 {
     I,
@@ -44,6 +49,13 @@ enum struct InstructionType
     DELAY,
     TICK,
 };
+constexpr int NUM_INSTRUCTION_TYPES = (int)InstructionType::TICK+1;
+extern std::string InstructionNames[NUM_INSTRUCTION_TYPES];
+// Whether the instruction is a noise channel
+inline bool is_noise(InstructionType type)
+{
+    return type >= InstructionType::DEPOLARIZE && type <= InstructionType::PAULI2;
+}
 // Measurement tag: allows identifying a measurement by its name and round
 // A measurement tag must be provided for all measurements in a circuit,
 // to properly identify it
@@ -56,6 +68,10 @@ struct MeasurementTag
         if (current_round != o.current_round) return current_round < o.current_round;
         return name < o.name;
     }
+    bool operator==(const MeasurementTag &o) const
+    {
+        return current_round == o.current_round && name == o.name;
+    }
 };
 // Contains measurement results from a specific shot, indicating whether it
 // has been flipped with respect to the noiseless expected outcome due to an error
@@ -65,7 +81,187 @@ struct MeasurementResults
     virtual bool reset_flipped(int qubit, const MeasurementTag &tag) = 0;
     virtual void flip(int qubit, const MeasurementTag &tag) = 0;
 };
+// Identifies a specific measurement by the measured qubit and its tag
+struct MeasurementRef
+{
+    int qubit;
+    MeasurementTag tag;
+};
+// Parity of the set bits of a word
+inline bool parity(uint64_t word)
+{
+    return std::bitset<64>(word).count() & 1;
+}
+// List of measurements forming a syndrome: bit i of the syndrome value is set
+// if measurement i has been flipped. Up to 64 measurements are supported
+struct SyndromeMeasurements
+{
+    static constexpr size_t MAX_SIZE = 64;
+    std::vector<MeasurementRef> syndrome;
+    SyndromeMeasurements() = default;
+    SyndromeMeasurements(std::vector<MeasurementRef> syndrome);
+    // Aborts if there are more than MAX_SIZE measurements
+    void check_size() const;
+    // Syndrome value of a given shot
+    template<typename Results>
+    uint64_t get_syndrome(Results &results) const
+    {
+        uint64_t value = 0;
+        for (int i=0; i<syndrome.size(); i++) {
+            if (results.is_flipped(syndrome[i].qubit, syndrome[i].tag))
+                value |= UINT64_C(1)<<i;
+        }
+        return value;
+    }
+};
+// Declarative error correction, as an alternative to error_corrections()
+// Corrections are obtained from a lookup table and/or from parity rules over the syndrome bits
+// As it does not depend on user code, the simulators can evaluate it without allocations,
+// 64 shots at a time in the dense simulator
+// A zero syndrome never triggers a correction
+struct CorrectionTable : SyndromeMeasurements
+{
+    // Qubits for which X errors (x) and Z errors (z) have to be applied to recover
+    struct Correction
+    {
+        std::vector<int> x;
+        std::vector<int> z;
+    };
+    // Correction applied if the parity of the syndrome bits selected by mask is odd
+    struct ParityRule
+    {
+        uint64_t mask;
+        Correction correction;
+    };
+    std::unordered_map<uint64_t, Correction> table;
+    std::vector<ParityRule> parity_rules;
+    CorrectionTable() = default;
+    CorrectionTable(std::vector<MeasurementRef> syndrome) : SyndromeMeasurements(syndrome) {}
+    void add_entry(uint64_t syndrome_value, std::vector<int> x, std::vector<int> z);
+    void add_parity_rule(uint64_t mask, std::vector<int> x, std::vector<int> z);
+    // Returns the table entry for a syndrome, nullptr if there is none
+    const Correction *lookup(uint64_t syndrome_value) const
+    {
+        if (syndrome_value == 0 || table.empty())
+            return nullptr;
+        auto it = table.find(syndrome_value);
+        return it != table.end() ? &it->second : nullptr;
+    }
+};
+// Declarative next node selection, as an alternative to next_node_index()
+// Rules are checked in order, and the first one matching the syndrome selects the branch
+// If no rule matches, the branch is taken from the lookup table, or default_branch
+// if the syndrome is not in the table
+// Branch -1 discards the shot, as in next_node_index()
+struct BranchCondition : SyndromeMeasurements
+{
+    struct Rule
+    {
+        enum struct Type
+        {
+            // Parity of the bits selected by mask equals value
+            PARITY,
+            // Bits selected by mask are equal to those of value
+            EQUAL,
+        };
+        Type type;
+        uint64_t mask;
+        uint64_t value;
+        int branch;
+        bool matches(uint64_t syndrome_value) const
+        {
+            if (type == Type::PARITY)
+                return parity(syndrome_value & mask) == (value & 1);
+            return (syndrome_value & mask) == (value & mask);
+        }
+    };
+    std::vector<Rule> rules;
+    std::unordered_map<uint64_t, int> table;
+    int default_branch=0;
+    BranchCondition() = default;
+    BranchCondition(std::vector<MeasurementRef> syndrome, int default_branch=0) : SyndromeMeasurements(syndrome), default_branch(default_branch) {}
+    // Go to branch if the parity of the syndrome bits in mask is odd (or even)
+    void add_parity_rule(uint64_t mask, int branch, bool odd=true)
+    {
+        rules.push_back({Rule::Type::PARITY, mask, odd ? UINT64_C(1) : UINT64_C(0), branch});
+    }
+    // Go to branch if (syndrome & mask) == value
+    void add_comparison(uint64_t mask, uint64_t value, int branch)
+    {
+        rules.push_back({Rule::Type::EQUAL, mask, value, branch});
+    }
+    void add_entry(uint64_t syndrome_value, int branch)
+    {
+        table[syndrome_value] = branch;
+    }
+    // Branch for syndromes not matching any rule
+    int lookup(uint64_t syndrome_value) const
+    {
+        if (table.empty())
+            return default_branch;
+        auto it = table.find(syndrome_value);
+        return it != table.end() ? it->second : default_branch;
+    }
+    int get_branch(uint64_t syndrome_value) const
+    {
+        for (auto &rule : rules) {
+            if (rule.matches(syndrome_value))
+                return rule.branch;
+        }
+        return lookup(syndrome_value);
+    }
+    template<typename Results>
+    int get_branch(Results &results) const
+    {
+        return get_branch(get_syndrome(results));
+    }
+};
+// Non-owning view of a contiguous array
+template<typename T>
+struct Span
+{
+    const T *ptr=nullptr;
+    size_t count=0;
+    Span() = default;
+    Span(const T *ptr, size_t count) : ptr(ptr), count(count) {}
+    Span(const std::vector<T> &v) : ptr(v.data()), count(v.size()) {}
+    const T *begin() const
+    {
+        return ptr;
+    }
+    const T *end() const
+    {
+        return ptr+count;
+    }
+    size_t size() const
+    {
+        return count;
+    }
+    bool empty() const
+    {
+        return count == 0;
+    }
+    const T &operator[](size_t i) const
+    {
+        return ptr[i];
+    }
+    operator std::vector<T>() const
+    {
+        return std::vector<T>(begin(), end());
+    }
+    bool operator==(const Span<T> &o) const
+    {
+        if (count != o.count)
+            return false;
+        for (size_t i=0; i<count; i++) {
+            if (!(ptr[i] == o.ptr[i]))
+                return false;
+        }
+        return true;
+    }
+};
 // Instruction: corresponds to one or several gates of the same type applied to a set of qubits
+// Used to build circuits. Circuits store instructions in a compact form, see InstructionRef
 struct Instruction
 {
     InstructionType type;
@@ -82,53 +278,330 @@ struct Instruction
     {
 
     }
-    Instruction(InstructionType type, std::vector<int> targets, std::vector<double> p, std::optional<MeasurementTag> tag=std::nullopt, std::string label="") : type(type), targets(targets), p(p), measurement_tag(tag), label(label)
+    Instruction(InstructionType type, std::vector<int> targets, std::vector<double> p, std::optional<MeasurementTag> tag=std::nullopt, std::optional<std::string> label=std::nullopt) : type(type), targets(targets), p(p), measurement_tag(tag), label(label)
     {
 
     }
+    bool operator==(const Instruction &o) const
+    {
+        return type == o.type && targets == o.targets && p == o.p && measurement_tag == o.measurement_tag && label == o.label;
+    }
+};
+// Read-only view of an instruction stored in a circuit, or of an Instruction
+// measurement_tag and label are nullptr if not present
+// Views into a circuit are invalidated when instructions are added to it
+struct InstructionRef
+{
+    InstructionType type;
+    Span<int> targets;
+    Span<double> p;
+    const MeasurementTag *measurement_tag=nullptr;
+    const std::string *label=nullptr;
+    InstructionRef() = default;
+    InstructionRef(InstructionType type, Span<int> targets, Span<double> p, const MeasurementTag *tag, const std::string *label) : type(type), targets(targets), p(p), measurement_tag(tag), label(label) {}
+    InstructionRef(const Instruction &inst) : type(inst.type), targets(inst.targets), p(inst.p), measurement_tag(inst.measurement_tag ? &*inst.measurement_tag : nullptr), label(inst.label ? &*inst.label : nullptr) {}
+    operator Instruction() const
+    {
+        Instruction inst(type, targets, p);
+        if (measurement_tag)
+            inst.measurement_tag = *measurement_tag;
+        if (label)
+            inst.label = *label;
+        return inst;
+    }
+    bool operator==(const InstructionRef &o) const
+    {
+        return type == o.type && targets == o.targets && p == o.p
+            && (measurement_tag == nullptr ? o.measurement_tag == nullptr : o.measurement_tag != nullptr && *measurement_tag == *o.measurement_tag)
+            && (label == nullptr ? o.label == nullptr : o.label != nullptr && *label == *o.label);
+    }
+    bool operator!=(const InstructionRef &o) const
+    {
+        return !(*this == o);
+    }
+};
+// Probability of every Pauli error of a noise instruction on one target, or on a pair of targets for
+// DEPOLARIZE2 and PAULI2 (all targets for DEPOLARIZE). Errors are indexed with the error types of every
+// qubit, 2 bits per qubit, and index 0 is the probability of no error. {1} for other instructions
+std::vector<double> pauli_channel(const InstructionRef &inst);
+// Instruction storage of a circuit
+// Instructions are stored as fixed-size headers with offsets into shared target,
+// parameter, tag and label pools, so that a circuit uses a handful of allocations
+// regardless of its size
+class InstructionList
+{
+    struct Header
+    {
+        InstructionType type;
+        uint32_t targets_offset;
+        uint32_t num_targets;
+        uint32_t p_offset;
+        uint32_t num_p;
+        int32_t tag;
+        int32_t label;
+    };
+    std::vector<Header> headers;
+    std::vector<int> targets;
+    std::vector<double> params;
+    std::vector<MeasurementTag> tags;
+    std::vector<std::string> labels;
+    public:
+    class const_iterator
+    {
+        const InstructionList *list=nullptr;
+        size_t index=0;
+        public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = InstructionRef;
+        using difference_type = std::ptrdiff_t;
+        using reference = InstructionRef;
+        struct pointer
+        {
+            InstructionRef ref;
+            const InstructionRef *operator->() const
+            {
+                return &ref;
+            }
+        };
+        const_iterator() = default;
+        const_iterator(const InstructionList *list, size_t index) : list(list), index(index) {}
+        InstructionRef operator*() const
+        {
+            return (*list)[index];
+        }
+        pointer operator->() const
+        {
+            return {(*list)[index]};
+        }
+        const_iterator &operator++()
+        {
+            ++index;
+            return *this;
+        }
+        const_iterator operator++(int)
+        {
+            return const_iterator(list, index++);
+        }
+        const_iterator &operator--()
+        {
+            --index;
+            return *this;
+        }
+        const_iterator operator+(difference_type n) const
+        {
+            return const_iterator(list, index+n);
+        }
+        difference_type operator-(const const_iterator &o) const
+        {
+            return (difference_type)index-(difference_type)o.index;
+        }
+        bool operator==(const const_iterator &o) const
+        {
+            return list == o.list && index == o.index;
+        }
+        bool operator!=(const const_iterator &o) const
+        {
+            return !(*this == o);
+        }
+        size_t position() const
+        {
+            return index;
+        }
+    };
+    using iterator = const_iterator;
+    InstructionRef operator[](size_t i) const
+    {
+        auto &h = headers[i];
+        return InstructionRef(h.type, Span<int>(targets.data()+h.targets_offset, h.num_targets), Span<double>(params.data()+h.p_offset, h.num_p), h.tag < 0 ? nullptr : &tags[h.tag], h.label < 0 ? nullptr : &labels[h.label]);
+    }
+    const_iterator begin() const
+    {
+        return const_iterator(this, 0);
+    }
+    const_iterator end() const
+    {
+        return const_iterator(this, headers.size());
+    }
+    size_t size() const
+    {
+        return headers.size();
+    }
+    bool empty() const
+    {
+        return headers.empty();
+    }
+    InstructionRef front() const
+    {
+        return (*this)[0];
+    }
+    InstructionRef back() const
+    {
+        return (*this)[headers.size()-1];
+    }
+    // Adds an instruction, copying its targets and parameters into the pools
+    void push_back(InstructionType type, Span<int> targets, Span<double> p, const MeasurementTag *tag, const std::string *label);
+    void push_back(const InstructionRef &inst)
+    {
+        push_back(inst.type, inst.targets, inst.p, inst.measurement_tag, inst.label);
+    }
+    // Adds all instructions from another list
+    void append(const InstructionList &o);
+    void append(InstructionList &&o);
+    void reserve(size_t num_instructions, size_t num_targets);
+    void clear();
+    bool operator==(const InstructionList &o) const;
 };
 // Represents a set of different quantum gates
 class Circuit
 {
     public:
     Circuit() : num_qubits(0) {}
-    std::list<Instruction> instructions;
+    InstructionList instructions;
     int num_qubits;
     Circuit &operator += (const Circuit &o)
     {
         if (o.num_qubits > num_qubits)
             num_qubits = o.num_qubits;
-        instructions.insert(instructions.end(), o.instructions.begin(), o.instructions.end());
+        instructions.append(o.instructions);
+        return *this;
+    }
+    Circuit &operator += (Circuit &&o)
+    {
+        if (o.num_qubits > num_qubits)
+            num_qubits = o.num_qubits;
+        instructions.append(std::move(o.instructions));
         return *this;
     }
-    Circuit operator+(const Circuit &o) const
+    Circuit operator+(const Circuit &o) const &
     {
         Circuit c = *this;
         c += o;
-        return std::move(c);
+        return c;
+    }
+    Circuit operator+(const Circuit &o) &&
+    {
+        *this += o;
+        return std::move(*this);
     }
     Circuit &append(InstructionType type)
     {
-        return append(Instruction(type, {}));
+        instructions.push_back(type, Span<int>(), Span<double>(), nullptr, nullptr);
+        return *this;
     }
     Circuit &append(InstructionType type, int target1)
     {
-        return append(Instruction(type, {target1}));
+        return append(type, Span<int>(&target1, 1));
     }
     Circuit &append(InstructionType type, int target1, int target2)
     {
-        return append(Instruction(type, {target1, target2}));
+        int targets[2] = {target1, target2};
+        return append(type, Span<int>(targets, 2));
     }
-    Circuit &append(Instruction inst)
+    Circuit &append(InstructionType type, Span<int> targets, Span<double> p=Span<double>(), const MeasurementTag *tag=nullptr, const std::string *label=nullptr)
     {
-        for (auto t : inst.targets) {
+        for (auto t : targets) {
             if (t+1 > num_qubits)
                 num_qubits = t+1;
         }
-        instructions.push_back(inst);
+        instructions.push_back(type, targets, p, tag, label);
         return *this;
     }
-
+    Circuit &append(InstructionType type, Span<int> targets, double p)
+    {
+        return append(type, targets, Span<double>(&p, 1));
+    }
+    Circuit &append(const InstructionRef &inst)
+    {
+        return append(inst.type, inst.targets, inst.p, inst.measurement_tag, inst.label);
+    }
+    Circuit &append(const Instruction &inst)
+    {
+        return append(InstructionRef(inst));
+    }
+    bool operator==(const Circuit &o) const
+    {
+        return num_qubits == o.num_qubits && instructions == o.instructions;
+    }
+    bool operator!=(const Circuit &o) const
+    {
+        return !(*this == o);
+    }
+};
+// Structural hash of the circuit contents, stable across runs
+uint64_t circuit_hash(const Circuit &circ);
+// Stores a single immutable copy of every distinct circuit, so that identical
+// circuits (e.g. the same syndrome extraction round in different branches) can
+// share memory and any processing done on them
+class CircuitStore
+{
+    std::unordered_multimap<uint64_t, std::shared_ptr<const Circuit>> circuits;
+    public:
+    // Returns the stored circuit equal to circ, adding it if not present
+    std::shared_ptr<const Circuit> intern(const Circuit &circ);
+    std::shared_ptr<const Circuit> intern(Circuit &&circ);
+    // Same as above, but storing the given circuit without copying it if not present
+    std::shared_ptr<const Circuit> intern(std::shared_ptr<const Circuit> circ);
+    // Returns the stored circuit equal to circ, nullptr if not present
+    std::shared_ptr<const Circuit> find(const Circuit &circ, uint64_t hash) const;
+    size_t size() const
+    {
+        return circuits.size();
+    }
+};
+// Handle to an immutable circuit, shared between copies of the handle
+// Copy-on-write: edit() returns a modifiable circuit, copying it first if it is shared,
+// so copying trees or handles never copies instructions
+class SharedCircuit
+{
+    std::shared_ptr<const Circuit> circ;
+    // Whether circ was created by a handle, and can be modified once it is no longer shared
+    bool owned;
+    static const std::shared_ptr<const Circuit> &empty_circuit()
+    {
+        static const std::shared_ptr<const Circuit> empty = std::make_shared<const Circuit>();
+        return empty;
+    }
+    public:
+    SharedCircuit() : circ(empty_circuit()), owned(false) {}
+    SharedCircuit(const Circuit &c) : circ(std::make_shared<Circuit>(c)), owned(true) {}
+    SharedCircuit(Circuit &&c) : circ(std::make_shared<Circuit>(std::move(c))), owned(true) {}
+    // Shares a circuit, e.g. one from a CircuitStore. It is never modified in place
+    SharedCircuit(std::shared_ptr<const Circuit> c) : circ(c != nullptr ? c : empty_circuit()), owned(false) {}
+    const Circuit &operator*() const
+    {
+        return *circ;
+    }
+    const Circuit *operator->() const
+    {
+        return circ.get();
+    }
+    operator const Circuit&() const
+    {
+        return *circ;
+    }
+    const std::shared_ptr<const Circuit> &share() const
+    {
+        return circ;
+    }
+    // Returns the circuit for modification. References are invalidated when the handle is copied
+    Circuit &edit()
+    {
+        if (!owned || circ.use_count() != 1) {
+            circ = std::make_shared<Circuit>(*circ);
+            owned = true;
+        }
+        return const_cast<Circuit&>(*circ);
+    }
+    template<typename... Args>
+    SharedCircuit &append(Args&&... args)
+    {
+        edit().append(std::forward<Args>(args)...);
+        return *this;
+    }
+    bool operator==(const SharedCircuit &o) const
+    {
+        return circ == o.circ || *circ == *o.circ;
+    }
 };
 // Represents a circuit which is followed by different circuits depending on previous measurement outcomes
 // Used for in-sequence logic
@@ -141,25 +614,78 @@ class Circuit
 class CircuitNode : public std::enable_shared_from_this<CircuitNode>
 {
     public:
+    // Records where a callback comes from, so that trees can be serialized and the callback rebuilt:
+    // either a function registered by name in a CallbackRegistry (see serialize.h),
+    // or the combination made by merge_nodes() of the callbacks of nodea and nodeb
+    struct CallbackSource
+    {
+        std::string name;
+        std::shared_ptr<CircuitNode> nodea;
+        std::shared_ptr<CircuitNode> nodeb;
+        bool empty() const
+        {
+            return name.empty() && nodea == nullptr;
+        }
+    };
     std::string name;
     std::vector<std::shared_ptr<CircuitNode>> childs;
-    Circuit circuit;
+    // Shared between copies of the node, use circuit.edit() to modify it
+    SharedCircuit circuit;
     // Determines next node depending on measurement outcomes
     // Parameter: list of flipped measurements, ordered by qubit
     // Must return index of next circuit, -1 if shot discarded by postselection
     std::function<int(MeasurementResults&)> next_node_index;
+    // Declarative alternative to next_node_index(). If present, it is used instead of the function
+    std::optional<BranchCondition> branch_condition;
     // Applies error correction depending on measurement outcomes
     // Parameter: list of flipped measurements, ordered by qubit
     // Must return a qubits for which X errors (pair.first) and Z errors (pair.second) have to be applied to recover
     std::function<std::pair<std::set<int>,std::set<int>>(MeasurementResults&)> error_corrections;
+    // Declarative error corrections, applied after error_corrections()
+    // Corrections from different tables are combined
+    std::vector<CorrectionTable> correction_tables;
+    // Declares next_node_index and error_corrections pure: their results only depend on the outcomes of the
+    // measurements they read, and calls with the same outcomes make the same flips and resets. Simulators then
+    // evaluate them once for every distinct set of outcomes read (see CallbackMemo)
+    bool pure_callbacks=false;
+    // Sources of next_node_index and error_corrections, empty for unnamed functions
+    CallbackSource next_node_index_source;
+    CallbackSource error_corrections_source;
     CircuitNode(std::string name) : name(name) {}
+    virtual ~CircuitNode() = default;
+    // Returns successor i. Use instead of accessing childs directly, as nodes built
+    // lazily (see merge_nodes()) only create their successors when first accessed
+    virtual std::shared_ptr<CircuitNode> get_child(size_t i)
+    {
+        return childs[i];
+    }
+    // Whether the next node depends on measurement outcomes
+    bool has_branching() const
+    {
+        return branch_condition || next_node_index;
+    }
+    // Index of the next node for a given shot, using either the branch condition or next_node_index()
+    int get_next_node_index(MeasurementResults &results) const
+    {
+        if (branch_condition)
+            return branch_condition->get_branch(results);
+        if (next_node_index)
+            return next_node_index(results);
+        return 0;
+    }
     std::shared_ptr<CircuitNode> deep_copy()
     {
         auto node = std::make_shared<CircuitNode>(name);
         node->circuit = circuit;
         node->next_node_index = next_node_index;
+        node->branch_condition = branch_condition;
         node->error_corrections = error_corrections;
-        for (auto &child : childs) {
+        node->pure_callbacks = pure_callbacks;
+        node->correction_tables = correction_tables;
+        node->next_node_index_source = next_node_index_source;
+        node->error_corrections_source = error_corrections_source;
+        for (size_t i=0; i<childs.size(); i++) {
+            auto child = get_child(i);
             if (child)
                 node->childs.push_back(child->deep_copy());
             else
@@ -168,13 +694,60 @@ class CircuitNode : public std::enable_shared_from_this<CircuitNode>
         return node;
     }
 };
+// Node of the combination of two trees made by merge_nodes(), starting at the given
+// instruction positions of nodea and nodeb
+// The circuit is built on construction, but successors are only built when accessed through get_child().
+// Nodes are memoized by (nodea, nodeb, indexa, indexb), so that combinations reached
+// through different paths are built once and loops in the original trees are preserved
+// A node only owns the successors it built: those built before, such as the start of a loop, are held
+// by weak references, and built again if they have been freed. get_child() can be called from several threads
+class MergedCircuitNode : public CircuitNode
+{
+    public:
+    struct Key
+    {
+        std::shared_ptr<CircuitNode> nodea;
+        std::shared_ptr<CircuitNode> nodeb;
+        size_t indexa;
+        size_t indexb;
+    };
+    // Nodes already built for a merge_nodes() call
+    struct Context
+    {
+        std::map<std::tuple<CircuitNode*, CircuitNode*, size_t, size_t>, std::weak_ptr<CircuitNode>> nodes;
+        // Guards nodes and the successors of the nodes
+        std::mutex mutex;
+    };
+    MergedCircuitNode(std::shared_ptr<Context> context, std::shared_ptr<CircuitNode> nodea, std::shared_ptr<CircuitNode> nodeb, size_t indexa, size_t indexb);
+    // Returns the node for key, building it if needed. The context must be locked
+    static std::shared_ptr<CircuitNode> get(std::shared_ptr<Context> context, const Key &key, bool &built);
+    std::shared_ptr<CircuitNode> get_child(size_t i) override;
+    private:
+    std::shared_ptr<Context> context;
+    // Successors not owned by the node, built lazily, and the nodes found for them
+    std::vector<std::optional<Key>> pending;
+    std::vector<std::weak_ptr<CircuitNode>> weak_childs;
+    void add_pending_child(const Key &key);
+    void copy_childs(CircuitNode &node);
+    void copy_callbacks(const CircuitNode &node);
+};
+std::ostream &operator<<(std::ostream &os, const InstructionRef &instr);
 std::ostream &operator<<(std::ostream &os, const Instruction &instr);
 std::ostream &operator<<(std::ostream &os, const Circuit &m);
 
 Circuit merge_circuits(Circuit c1, Circuit c2);
 std::shared_ptr<CircuitNode> merge_nodes(std::shared_ptr<CircuitNode> nodea, std::shared_ptr<CircuitNode> nodeb);
+// Callbacks of a node merged from nodea and nodeb, as built by merge_nodes()
+// The next node index enumerates all combinations of the childs of nodea and nodeb,
+// and the corrections of both nodes are combined
+std::function<int(MeasurementResults&)> merged_next_node_index(std::shared_ptr<CircuitNode> nodea, std::shared_ptr<CircuitNode> nodeb);
+std::function<std::pair<std::set<int>,std::set<int>>(MeasurementResults&)> merged_error_corrections(std::shared_ptr<CircuitNode> nodea, std::shared_ptr<CircuitNode> nodeb);
 void apply_node_to_end(std::shared_ptr<CircuitNode> node0, std::shared_ptr<CircuitNode> node, std::shared_ptr<CircuitNode> ft_node);
-void print_nodes(std::shared_ptr<CircuitNode> node, std::set<std::shared_ptr<CircuitNode>> &&visited = std::set<std::shared_ptr<CircuitNode>>(), std::string printed="");
+// Tree summaries, implemented in analysis.cpp (see analysis.h for the full analysis API)
+void print_nodes(std::shared_ptr<CircuitNode> node);
+// Number of nodes at each depth, as depth_profile(), saturating at INT_MAX
 std::vector<int> node_depth(std::shared_ptr<CircuitNode> node0);
+// Number of nodes of the tree, counting shared nodes once for every path reaching them,
+// saturating at INT_MAX. The number of distinct nodes is reachable_nodes(node0).size()
 int node_count(std::shared_ptr<CircuitNode> node0);
-void cnot_count(std::shared_ptr<CircuitNode> node, std::set<std::shared_ptr<CircuitNode>> &&visited = std::set<std::shared_ptr<CircuitNode>>(), int current_count=0);
\ No newline at end of file
+void cnot_count(std::shared_ptr<CircuitNode> node);
\ No newline at end of file
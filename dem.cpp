@@ -0,0 +1,166 @@
+#include "dem.h"
+#include "fault_table.h"
+#include <charconv>
+#include <cmath>
+#include <iostream>
+std::ostream &operator<<(std::ostream &os, const DetectorErrorModel &dem)
+{
+    int last_detector = -1;
+    for (auto &error : dem.errors) {
+        char buf[32];
+        auto res = std::to_chars(buf, buf+sizeof(buf), error.p, std::chars_format::general);
+        os << "error(";
+        os.write(buf, res.ptr-buf);
+        os << ')';
+        for (int d : error.detectors) {
+            os << " D" << d;
+            last_detector = std::max(last_detector, d);
+        }
+        for (int l : error.observables)
+            os << " L" << l;
+        os << '\n';
+    }
+    // Declare the last detector, so that the number of detectors is preserved
+    if (dem.num_detectors > 0 && last_detector < dem.num_detectors-1)
+        os << "detector D" << dem.num_detectors-1 << '\n';
+    return os;
+}
+// In-place Walsh-Hadamard transform: f(x) -> sum over y of f(y)*(-1)^|x&y|
+static void walsh_hadamard(std::vector<double> &f)
+{
+    for (size_t h=1; h<f.size(); h<<=1) {
+        for (size_t i=0; i<f.size(); i+=2*h) {
+            for (size_t j=i; j<i+h; j++) {
+                double a = f[j], b = f[j+h];
+                f[j] = a+b;
+                f[j+h] = a-b;
+            }
+        }
+    }
+}
+// Splits a Pauli channel, given as the probability of every error, into independent mechanisms
+// Returns the probability of every mechanism, so that applying them all gives the same channel
+// Independent mechanisms multiply the characteristic function of the channel, so their
+// probabilities are found from the logarithm of its Walsh-Hadamard transform
+// If the channel can't be decomposed (error rates above 1/2), the error probabilities are used instead
+static std::vector<double> independent_mechanisms(std::vector<double> p)
+{
+    std::vector<double> f = p;
+    walsh_hadamard(f);
+    for (double &x : f) {
+        if (x <= 0)
+            return p;
+        x = std::log(x);
+    }
+    walsh_hadamard(f);
+    std::vector<double> q(p.size());
+    for (size_t m=1; m<p.size(); m++)
+        q[m] = -std::expm1(-2*f[m]/p.size())/2;
+    return q;
+}
+// Number of qubits on which each channel of an instruction acts
+static int channel_size(const InstructionRef &inst)
+{
+    switch (inst.type) {
+        case InstructionType::DEPOLARIZE2:
+        case InstructionType::PAULI2:
+            return 2;
+        case InstructionType::DEPOLARIZE:
+            return inst.targets.size();
+        default:
+            return 1;
+    }
+}
+DetectorErrorModel detector_error_model(const Circuit &circ, const std::vector<std::vector<MeasurementRef>> &detectors,
+    const std::vector<std::vector<MeasurementRef>> &observables)
+{
+    DetectorErrorModel dem;
+    dem.num_detectors = detectors.size();
+    dem.num_observables = observables.size();
+    int num_qubits = circ.num_qubits;
+    std::map<std::pair<int, MeasurementTag>, std::vector<int>> measurement_indices;
+    int num_measurements = 0;
+    for (auto inst : circ.instructions) {
+        for (int q : inst.targets)
+            num_qubits = std::max(num_qubits, q+1);
+        if (inst.type == InstructionType::MX || inst.type == InstructionType::MY || inst.type == InstructionType::MZ) {
+            for (int q : inst.targets)
+                measurement_indices[{q, *inst.measurement_tag}].push_back(num_measurements++);
+        }
+    }
+    // Detectors (0 to num_detectors-1) and observables (from num_detectors) flipped by every measurement
+    std::vector<FaultTable::Row> measurement_rows(num_measurements);
+    auto add_parity = [&](const std::vector<MeasurementRef> &refs, int output) {
+        for (auto &ref : refs) {
+            auto it = measurement_indices.find({ref.qubit, ref.tag});
+            if (it == measurement_indices.end()) {
+                std::cerr<<"Measurement "<<ref.tag.name<<":"<<ref.tag.current_round<<" of qubit "<<ref.qubit<<" not found in circuit"<<std::endl;
+                abort();
+            }
+            for (int m : it->second)
+                xor_row(measurement_rows[m], {output});
+        }
+    };
+    for (int d=0; d<detectors.size(); d++)
+        add_parity(detectors[d], d);
+    for (int l=0; l<observables.size(); l++)
+        add_parity(observables[l], dem.num_detectors+l);
+    std::map<FaultTable::Row, double> mechanisms;
+    std::vector<FaultTable::QubitRows> rows(num_qubits);
+    propagate_back(circ, rows, [&](int m) { return measurement_rows[m]; },
+        [&](int instruction, int, const std::vector<FaultTable::QubitRows> &rows) {
+            auto inst = circ.instructions[instruction];
+            if (inst.type == InstructionType::DEPOLARIZE && inst.targets.size() > 4) {
+                std::cerr<<"DEPOLARIZE on more than 4 qubits is not supported in detector error models"<<std::endl;
+                abort();
+            }
+            auto q = independent_mechanisms(pauli_channel(inst));
+            int size = channel_size(inst);
+            for (int i=0; i+size<=inst.targets.size(); i+=size) {
+                for (size_t m=1; m<q.size(); m++) {
+                    if (!(q[m] > 0))
+                        continue;
+                    FaultTable::Row row;
+                    for (int j=0; j<size; j++) {
+                        auto &qubit_rows = rows[inst.targets[i+j]];
+                        if ((m>>(2*j)) & 1)
+                            xor_row(row, qubit_rows[0]);
+                        if ((m>>(2*j)) & 2)
+                            xor_row(row, qubit_rows[1]);
+                    }
+                    if (row.empty())
+                        continue;
+                    // Two independent mechanisms with the same effect flip it if only one of them happens
+                    auto [it, inserted] = mechanisms.try_emplace(std::move(row), q[m]);
+                    if (!inserted)
+                        it->second = it->second*(1-q[m]) + q[m]*(1-it->second);
+                }
+            }
+        });
+    for (auto &[row, p] : mechanisms) {
+        DetectorErrorModel::Mechanism mechanism{p, {}, {}};
+        for (int output : row) {
+            if (output < dem.num_detectors)
+                mechanism.detectors.push_back(output);
+            else
+                mechanism.observables.push_back(output-dem.num_detectors);
+        }
+        dem.errors.push_back(std::move(mechanism));
+    }
+    return dem;
+}
+DetectorErrorModel detector_error_model(std::shared_ptr<CircuitNode> node0, const std::vector<int> &path,
+    const std::vector<std::vector<MeasurementRef>> &detectors, const std::vector<std::vector<MeasurementRef>> &observables)
+{
+    Circuit circ = *node0->circuit;
+    auto node = node0;
+    for (int index : path) {
+        node = index < node->childs.size() ? node->get_child(index) : nullptr;
+        if (node == nullptr) {
+            std::cerr<<"Path of the detector error model reaches the end of the tree"<<std::endl;
+            abort();
+        }
+        circ += *node->circuit;
+    }
+    return detector_error_model(circ, detectors, observables);
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include "circuit.h"
+#include <ostream>
+// Detector error model: independent error mechanisms, each flipping a set of detectors and observables
+// Detectors and observables are parities of measurements
+struct DetectorErrorModel
+{
+    struct Mechanism
+    {
+        double p;
+        std::vector<int> detectors;
+        std::vector<int> observables;
+    };
+    int num_detectors=0;
+    int num_observables=0;
+    // Mechanisms with different detectors and observables, ordered by them
+    std::vector<Mechanism> errors;
+};
+// Writes the model in Stim's .dem format: one line per mechanism, as `error(p) D0 D3 L0`
+std::ostream &operator<<(std::ostream &os, const DetectorErrorModel &dem);
+// Builds the model of a noisy circuit
+// Every Pauli channel is split into independent mechanisms, which are propagated to the measurements
+// at once by a backwards pass through the circuit. Mechanisms with the same effect are merged
+DetectorErrorModel detector_error_model(const Circuit &circ, const std::vector<std::vector<MeasurementRef>> &detectors,
+    const std::vector<std::vector<MeasurementRef>> &observables);
+// Builds the model of a single path of a tree, starting from node0 and following the given child
+// indices. Error correction functions and tables of the nodes are not applied
+DetectorErrorModel detector_error_model(std::shared_ptr<CircuitNode> node0, const std::vector<int> &path,
+    const std::vector<std::vector<MeasurementRef>> &detectors, const std::vector<std::vector<MeasurementRef>> &observables);
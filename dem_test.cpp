@@ -0,0 +1,70 @@
+// Detector error models of small circuits with known mechanisms
+#include "dem.h"
+#include <cmath>
+#include <iostream>
+#include <sstream>
+static int failures = 0;
+static void check(bool ok, const std::string &name)
+{
+    std::cout<<(ok ? "ok   " : "FAIL ")<<name<<std::endl;
+    if (!ok)
+        failures++;
+}
+// One round of a distance 3 repetition code, with data qubits 0, 2, 4 and ancillas 1, 3
+static Circuit repetition_code(const Circuit &noise)
+{
+    Circuit circ;
+    circ.append(Instruction(InstructionType::RZ, {0, 1, 2, 3, 4}));
+    for (auto inst : noise.instructions)
+        circ.append(inst);
+    circ.append(Instruction(InstructionType::CX, {0, 1, 2, 3}));
+    circ.append(Instruction(InstructionType::CX, {2, 1, 4, 3}));
+    circ.append(Instruction(InstructionType::MZ, {1, 3}, {}, MeasurementTag{0, "s"}));
+    circ.append(Instruction(InstructionType::MZ, {0, 2, 4}, {}, MeasurementTag{0, "d"}));
+    return circ;
+}
+static DetectorErrorModel model(const Circuit &noise)
+{
+    std::vector<std::vector<MeasurementRef>> detectors = {{{1, MeasurementTag{0, "s"}}}, {{3, MeasurementTag{0, "s"}}}};
+    std::vector<std::vector<MeasurementRef>> observables = {{{0, MeasurementTag{0, "d"}}}};
+    return detector_error_model(repetition_code(noise), detectors, observables);
+}
+// Whether the model has exactly the expected mechanisms, in order, as lines of the .dem format
+static bool has_mechanisms(const DetectorErrorModel &dem, const std::vector<std::pair<double, std::string>> &expected)
+{
+    std::ostringstream os;
+    os<<dem;
+    std::istringstream lines(os.str());
+    std::string line;
+    for (auto &[p, targets] : expected) {
+        if (!std::getline(lines, line) || line.compare(0, 6, "error(") != 0)
+            return false;
+        size_t close = line.find(')');
+        if (close == std::string::npos || line.substr(close+1) != " "+targets)
+            return false;
+        if (std::abs(std::stod(line.substr(6, close-6))-p) > 1e-12)
+            return false;
+    }
+    return !std::getline(lines, line);
+}
+int main()
+{
+    // Errors on the middle data qubit flip both detectors, and Z errors flip nothing
+    Circuit flips;
+    flips.append(Instruction(InstructionType::X_ERROR, {2}, 0.125));
+    flips.append(Instruction(InstructionType::X_ERROR, {0}, 0.0625));
+    flips.append(Instruction(InstructionType::Z_ERROR, {4}, 0.25));
+    auto dem = model(flips);
+    check(dem.num_detectors == 2 && dem.num_observables == 1, "detector and observable counts");
+    check(has_mechanisms(dem, {{0.125, "D0 D1"}, {0.0625, "D0 L0"}}), "repetition code with bit flips");
+    // X and Y errors flip the detector, so their mechanisms add up to 2p/3
+    Circuit depolarizing;
+    depolarizing.append(Instruction(InstructionType::DEPOLARIZE1, {4}, 0.03));
+    check(has_mechanisms(model(depolarizing), {{0.02, "D1"}}), "repetition code with depolarizing noise");
+    // Two channels on the same qubit combine as independent flips
+    Circuit repeated;
+    repeated.append(Instruction(InstructionType::X_ERROR, {2}, 0.1));
+    repeated.append(Instruction(InstructionType::Y_ERROR, {2}, 0.2));
+    check(has_mechanisms(model(repeated), {{0.1*0.8+0.9*0.2, "D0 D1"}}), "merged mechanisms");
+    return failures > 0;
+}
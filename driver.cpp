@@ -0,0 +1,30 @@
+#include "driver.h"
+#include <algorithm>
+// Shots of the first chunk, used to measure the memory per shot
+static const size_t FIRST_CHUNK = 64;
+// Memory is measured at the end of a chunk. Frames and records of a branching node are copied
+// while they are moved to the simulators of the branches, so the peak is taken as twice as much
+static const double PEAK_FACTOR = 2;
+// Maximum growth of the chunk size between consecutive chunks, in case the shots of the last
+// chunk were cheaper than average (e.g. no faults happened)
+static const size_t MAX_GROWTH = 8;
+void run_chunked(std::shared_ptr<CircuitNode> root, uint64_t total_shots, size_t memory_budget,
+    SimulatorFactory make_simulator, std::function<void(BaseFrameSimulator &sim, uint64_t first_shot)> on_chunk)
+{
+    size_t chunk = std::min<uint64_t>(total_shots, FIRST_CHUNK);
+    for (uint64_t first_shot = 0; first_shot < total_shots; ) {
+        chunk = std::min<uint64_t>(chunk, total_shots-first_shot);
+        auto sim = make_simulator(chunk, first_shot);
+        sim->run(root);
+        // Small chunks overestimate the memory per shot of the dense simulator, which
+        // uses whole words, so the last chunk is the most representative
+        double bytes_per_shot = (double)sim->memory_usage()/chunk;
+        on_chunk(*sim, first_shot);
+        sim.reset();
+        first_shot += chunk;
+        size_t next = MAX_GROWTH*chunk;
+        if (bytes_per_shot > 0)
+            next = std::min<double>(next, memory_budget/(PEAK_FACTOR*bytes_per_shot));
+        chunk = std::max<size_t>(next, 64);
+    }
+}
@@ -0,0 +1,13 @@
+#pragma once
+#include "simulator_base.h"
+#include <functional>
+#include <memory>
+// Builds the simulator of the shots first_shot to first_shot+num_shots-1 of a run
+// With use_counter_rng(seed, first_shot), the results don't depend on how the run is split
+typedef std::function<std::unique_ptr<BaseFrameSimulator>(size_t num_shots, uint64_t first_shot)> SimulatorFactory;
+// Runs total_shots shots of a tree in chunks, so that the memory used by the simulator stays within
+// memory_budget bytes. The first chunk is small, and every following one is sized from the
+// memory per shot of the previous one. on_chunk(sim, first_shot) is called after every chunk, to aggregate
+// its results before the simulator is freed
+void run_chunked(std::shared_ptr<CircuitNode> root, uint64_t total_shots, size_t memory_budget,
+    SimulatorFactory make_simulator, std::function<void(BaseFrameSimulator &sim, uint64_t first_shot)> on_chunk);
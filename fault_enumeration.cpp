@@ -0,0 +1,66 @@
+#include "fault_enumeration.h"
+#include "analysis.h"
+#include <algorithm>
+#ifndef NO_THREADS
+#include <thread>
+#endif
+// Runs the configurations whose first fault is assigned to the shard
+static FaultEnumerationResult enumerate_shard(std::shared_ptr<CircuitNode> root, int max_weight,
+    std::function<bool(MeasurementResults&)> logical_error, int shard, int num_shards)
+{
+    // Noise is not sampled, so the generator is not used
+    std::mt19937_64 rng;
+    FrameSimulator sim(1, rng);
+    auto state = std::make_shared<FaultEnumeration>();
+    state->max_weight = max_weight;
+    state->shard = shard;
+    state->num_shards = num_shards;
+    sim.enumerate_faults(state);
+    sim.run(root);
+    FaultEnumerationResult result;
+    // Configurations discarded by post-selection are counted too
+    result.configurations = state->shot_faults.size();
+    auto &ids = sim.get_shot_ids();
+    for (size_t shot=0; shot<sim.get_num_shots(); shot++) {
+        auto &faults = state->shot_faults[ids.global(shot)];
+        // The fault-free shot is run by every shard
+        if (faults.empty() && shard != 0)
+            continue;
+        auto it = sim.qubit_measurement_results.find(shot);
+        MeasurementResultsSparse res;
+        if (it != sim.qubit_measurement_results.end())
+            res = it->second;
+        if (logical_error(res))
+            result.logical_errors.push_back(faults);
+    }
+    if (shard != 0)
+        result.configurations--;
+    return result;
+}
+FaultEnumerationResult enumerate_logical_errors(std::shared_ptr<CircuitNode> root, int max_weight,
+    std::function<bool(MeasurementResults&)> logical_error, int num_threads)
+{
+    std::vector<FaultEnumerationResult> shards(std::max(num_threads, 1));
+#ifndef NO_THREADS
+    // Lazily built nodes are built before the threads share the tree
+    reachable_nodes(root);
+    std::vector<std::thread> threads;
+    for (int i=0; i<shards.size(); i++) {
+        threads.emplace_back([&, i]() {
+            shards[i] = enumerate_shard(root, max_weight, logical_error, i, shards.size());
+        });
+    }
+    for (auto &thread : threads)
+        thread.join();
+#else
+    for (int i=0; i<shards.size(); i++)
+        shards[i] = enumerate_shard(root, max_weight, logical_error, i, shards.size());
+#endif
+    FaultEnumerationResult result;
+    for (auto &shard : shards) {
+        result.configurations += shard.configurations;
+        result.logical_errors.insert(result.logical_errors.end(), shard.logical_errors.begin(), shard.logical_errors.end());
+    }
+    std::sort(result.logical_errors.begin(), result.logical_errors.end());
+    return result;
+}
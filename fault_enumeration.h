@@ -0,0 +1,22 @@
+#pragma once
+#include "simulator.h"
+// Exhaustive verification of fault tolerance
+// Every fault of every noise instruction of a tree, or every combination of up to max_weight faults,
+// is run as its own shot of a single FrameSimulator run: a shot is copied at every noise instruction,
+// once for each Pauli the instruction can apply, and the fault is injected in the copy.
+// Faults after a branching are enumerated in every branch that the faulty shots follow.
+// Shots without flipped measurements are stored implicitly, so the cost grows with the number of
+// fault configurations, instead of requiring many random shots to find the rare failing ones
+struct FaultEnumerationResult
+{
+    // Number of fault configurations run, including the fault-free one
+    uint64_t configurations=0;
+    // Configurations leading to a logical error, sorted
+    std::vector<std::vector<Fault>> logical_errors;
+};
+// Runs every configuration of up to max_weight faults, and returns those for which logical_error()
+// is true, given the flipped measurements at the end of the shot. Shots discarded by post-selection
+// are not logical errors. The first faults are split among num_threads threads, so logical_error()
+// and the callbacks of the nodes must be thread-safe
+FaultEnumerationResult enumerate_logical_errors(std::shared_ptr<CircuitNode> root, int max_weight,
+    std::function<bool(MeasurementResults&)> logical_error, int num_threads=1);
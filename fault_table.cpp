@@ -0,0 +1,144 @@
+#include "fault_table.h"
+#include <algorithm>
+void xor_row(FaultTable::Row &a, const FaultTable::Row &b)
+{
+    if (b.empty())
+        return;
+    FaultTable::Row c;
+    c.reserve(a.size()+b.size());
+    std::set_symmetric_difference(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(c));
+    a = std::move(c);
+}
+// Rows before a Clifford gate, from the rows after it
+// An error E before the gate flips the same outputs as its image after the gate
+static void propagate_back(FaultTable::QubitRows &a, const CliffordTable &table)
+{
+    FaultTable::QubitRows after = a;
+    for (int i=0; i<2; i++) {
+        a[i].clear();
+        for (int j=0; j<2; j++) {
+            if (table.generator(i) & (1<<j))
+                xor_row(a[i], after[j]);
+        }
+    }
+}
+static void propagate_back(FaultTable::QubitRows &a, FaultTable::QubitRows &b, const CliffordTable &table)
+{
+    const FaultTable::Row after[4] = {a[0], a[1], b[0], b[1]};
+    FaultTable::Row *before[4] = {&a[0], &a[1], &b[0], &b[1]};
+    for (int i=0; i<4; i++) {
+        before[i]->clear();
+        for (int j=0; j<4; j++) {
+            if (table.generator(i) & (1<<j))
+                xor_row(*before[i], after[j]);
+        }
+    }
+}
+void propagate_back(const Circuit &circ, std::vector<FaultTable::QubitRows> &rows,
+    std::function<FaultTable::Row(int)> measurement_row,
+    std::function<void(int, int, const std::vector<FaultTable::QubitRows>&)> on_noise)
+{
+    auto &instructions = circ.instructions;
+    int measurement = 0;
+    int tick = 0;
+    for (auto inst : instructions) {
+        if (inst.type == InstructionType::MX || inst.type == InstructionType::MY || inst.type == InstructionType::MZ)
+            measurement += inst.targets.size();
+        else if (inst.type == InstructionType::TICK)
+            tick++;
+    }
+    for (int k=instructions.size()-1; k>=0; k--) {
+        auto inst = instructions[k];
+        auto &targets = inst.targets;
+        switch (inst.type) {
+            case InstructionType::MX:
+            case InstructionType::MY:
+            case InstructionType::MZ:
+                for (int i=targets.size()-1; i>=0; i--) {
+                    auto row = measurement_row(--measurement);
+                    if (inst.type != InstructionType::MX)
+                        xor_row(rows[targets[i]][0], row);
+                    if (inst.type != InstructionType::MZ)
+                        xor_row(rows[targets[i]][1], row);
+                }
+                break;
+            case InstructionType::RX:
+            case InstructionType::RY:
+            case InstructionType::RZ:
+                for (int q : targets) {
+                    if (inst.type != InstructionType::RX)
+                        rows[q][0].clear();
+                    if (inst.type != InstructionType::RZ)
+                        rows[q][1].clear();
+                }
+                break;
+            case InstructionType::DEPOLARIZE:
+            case InstructionType::DEPOLARIZE1:
+            case InstructionType::DEPOLARIZE2:
+            case InstructionType::X_ERROR:
+            case InstructionType::Y_ERROR:
+            case InstructionType::Z_ERROR:
+            case InstructionType::PAULI1:
+            case InstructionType::PAULI2:
+                on_noise(k, tick, rows);
+                break;
+            case InstructionType::TICK:
+                tick--;
+                break;
+            case InstructionType::SXX:
+            case InstructionType::SXXDG:
+            case InstructionType::SZZ:
+            case InstructionType::SZZDG:
+                for (int j=targets.size()-1; j>=1; j--) {
+                    for (int i=j-1; i>=0; i--)
+                        propagate_back(rows[targets[i]], rows[targets[j]], *clifford_table(inst.type));
+                }
+                break;
+            default:
+            {
+                auto *table = clifford_table(inst.type);
+                // Pauli gates don't change frames
+                if (table == nullptr || table->image == clifford_table(InstructionType::I)->image)
+                    break;
+                if (table->num_qubits == 1) {
+                    for (int q : targets)
+                        propagate_back(rows[q], *table);
+                } else {
+                    for (int i=(int)targets.size()/2*2-2; i>=0; i-=2)
+                        propagate_back(rows[targets[i]], rows[targets[i+1]], *table);
+                }
+                break;
+            }
+        }
+    }
+}
+FaultTable::FaultTable(const Circuit &circ)
+{
+    num_qubits = circ.num_qubits;
+    num_ticks = 0;
+    for (auto inst : circ.instructions) {
+        for (int q : inst.targets)
+            num_qubits = std::max(num_qubits, q+1);
+        if (inst.type == InstructionType::MX || inst.type == InstructionType::MY || inst.type == InstructionType::MZ) {
+            for (int q : inst.targets)
+                measurements.emplace_back(q, *inst.measurement_tag);
+        } else if (inst.type == InstructionType::TICK) {
+            num_ticks++;
+        }
+    }
+    int num_measurements = measurements.size();
+    // Errors at the end of the circuit flip the outgoing frame
+    inputs.resize(num_qubits);
+    for (int q=0; q<num_qubits; q++) {
+        inputs[q][0] = {num_measurements+2*q};
+        inputs[q][1] = {num_measurements+2*q+1};
+    }
+    propagate_back(circ, inputs, [](int m) { return Row{m}; },
+        [&](int instruction, int tick, const std::vector<QubitRows> &rows) {
+            Location location{instruction, tick, {}};
+            for (int q : circ.instructions[instruction].targets)
+                location.rows[q] = rows[q];
+            locations.push_back(std::move(location));
+        });
+    std::reverse(locations.begin(), locations.end());
+}
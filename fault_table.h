@@ -0,0 +1,43 @@
+#pragma once
+#include "simulator_base.h"
+#include <functional>
+// Effect of every possible fault of a circuit on its measurements and its outgoing frame
+// The table is built by propagating error sensitivities backwards through the circuit once.
+// Running the circuit then only requires sampling its noise instructions and xoring the rows
+// of the sampled faults, instead of propagating every faulty shot gate by gate
+struct FaultTable
+{
+    // Outputs flipped by an error, as sorted indices: measurements first, in circuit order,
+    // followed by the X and Z components of the outgoing frame (num_measurements+2*qubit, +1 for Z)
+    typedef std::vector<int> Row;
+    // Rows of an X error (first) and a Z error (second) on a qubit
+    typedef std::array<Row, 2> QubitRows;
+    struct Location
+    {
+        // Index of the noise instruction in the circuit
+        int instruction;
+        // Number of TICKs before the instruction
+        int tick;
+        // Rows of the errors on every target of the instruction
+        std::map<int, QubitRows> rows;
+    };
+    // Qubit and tag of every measurement
+    std::vector<std::pair<int, MeasurementTag>> measurements;
+    int num_qubits;
+    int num_ticks;
+    // Rows of the errors present at the start of the circuit
+    std::vector<QubitRows> inputs;
+    // Noise instructions, in circuit order
+    std::vector<Location> locations;
+    FaultTable(const Circuit &circ);
+};
+// Symmetric difference of two rows, stored in the first one
+void xor_row(FaultTable::Row &a, const FaultTable::Row &b);
+// Propagates the rows of errors backwards through a circuit: an error before an instruction flips
+// the same outputs as its image after the instruction. rows holds the rows of the errors at the end
+// of the circuit, and is left with the rows at its start. Measurement m (in circuit order) flips the
+// outputs in measurement_row(m). on_noise(instruction, tick, rows) is called for every noise instruction,
+// from the last to the first, with the rows just before it
+void propagate_back(const Circuit &circ, std::vector<FaultTable::QubitRows> &rows,
+    std::function<FaultTable::Row(int)> measurement_row,
+    std::function<void(int, int, const std::vector<FaultTable::QubitRows>&)> on_noise);
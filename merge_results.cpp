@@ -0,0 +1,12 @@
+#include "shard.h"
+#include <iostream>
+// Merges the result files written by the shards of a run
+int main(int argc, char **argv)
+{
+    if (argc < 3) {
+        std::cerr<<"Usage: "<<argv[0]<<" output input..."<<std::endl;
+        return 1;
+    }
+    merge_result_files(std::vector<std::string>(argv+2, argv+argc), argv[1]);
+    return 0;
+}
@@ -1,125 +1,162 @@
 #include "noise.h"
-#include <set>
-std::set<InstructionType> inst1q({InstructionType::H, InstructionType::X, InstructionType::Y, InstructionType::Z, InstructionType::I, InstructionType::SX, InstructionType::SXDG, InstructionType::SY, InstructionType::SYDG, InstructionType::S, InstructionType::SDG});
-std::set<InstructionType> inst2q({InstructionType::CX, InstructionType::CZ, InstructionType::SXX, InstructionType::SXXDG, InstructionType::SZZ, InstructionType::SZZDG});
-std::set<InstructionType> instm({InstructionType::MX, InstructionType::MY, InstructionType::MZ, InstructionType::RX, InstructionType::RY, InstructionType::RZ});
-std::set<InstructionType> instreset({InstructionType::RX, InstructionType::RY, InstructionType::RZ});
-std::set<InstructionType> instnoise({InstructionType::DEPOLARIZE1, InstructionType::DEPOLARIZE2, InstructionType::DEPOLARIZE, InstructionType::X_ERROR, InstructionType::Y_ERROR, InstructionType::Z_ERROR});
-Circuit DepolarizingModel::noisy_circuit(Circuit &circ)
+#include <array>
+// Gate classes, as used by the noise models to determine idle qubits
+#define GATE_1Q 1
+#define GATE_2Q 2
+#define GATE_MEASUREMENT 4
+#define GATE_RESET 8
+#define GATE_NOISE 16
+constexpr InstructionType inst1q[] = {InstructionType::I, InstructionType::X, InstructionType::Y, InstructionType::Z, InstructionType::H, InstructionType::S, InstructionType::SDG, InstructionType::SX, InstructionType::SXDG, InstructionType::SY, InstructionType::SYDG};
+constexpr InstructionType inst2q[] = {InstructionType::CX, InstructionType::CY, InstructionType::CZ, InstructionType::SXX, InstructionType::SXXDG, InstructionType::SZZ, InstructionType::SZZDG};
+constexpr InstructionType instm[] = {InstructionType::MX, InstructionType::MY, InstructionType::MZ, InstructionType::RX, InstructionType::RY, InstructionType::RZ};
+constexpr InstructionType instreset[] = {InstructionType::RX, InstructionType::RY, InstructionType::RZ};
+constexpr InstructionType instnoise[] = {InstructionType::DEPOLARIZE, InstructionType::DEPOLARIZE1, InstructionType::DEPOLARIZE2, InstructionType::X_ERROR, InstructionType::Y_ERROR, InstructionType::Z_ERROR};
+// Gate classes of every instruction type, indexed by InstructionType
+constexpr std::array<uint8_t, NUM_INSTRUCTION_TYPES> gate_classes = [] {
+    std::array<uint8_t, NUM_INSTRUCTION_TYPES> classes{};
+    for (auto type : inst1q)
+        classes[(int)type] |= GATE_1Q;
+    for (auto type : inst2q)
+        classes[(int)type] |= GATE_2Q;
+    for (auto type : instm)
+        classes[(int)type] |= GATE_MEASUREMENT;
+    for (auto type : instreset)
+        classes[(int)type] |= GATE_RESET;
+    for (auto type : instnoise)
+        classes[(int)type] |= GATE_NOISE;
+    return classes;
+}();
+inline bool is_gate_class(InstructionType type, uint8_t gate_class)
+{
+    return gate_classes[(int)type] & gate_class;
+}
+#define QUBIT_GATED 1
+#define QUBIT_ENTANGLED 2
+#define QUBIT_MEASURED 4
+// Tracks the qubits used in the current timestep, to determine which ones are idle
+// Only the qubits used since the last TICK have to be cleared
+struct QubitOccupancy
+{
+    std::vector<uint8_t> flags;
+    std::vector<int> used;
+    uint8_t used_flags=0;
+    QubitOccupancy(int num_qubits) : flags(num_qubits) {}
+    bool any(uint8_t flag)
+    {
+        return used_flags & flag;
+    }
+    bool is(int qubit, uint8_t flag)
+    {
+        return qubit < flags.size() && (flags[qubit] & flag);
+    }
+    void set(int qubit, uint8_t flag)
+    {
+        if (qubit >= flags.size())
+            flags.resize(qubit+1);
+        if (flags[qubit] == 0)
+            used.push_back(qubit);
+        flags[qubit] |= flag;
+        used_flags |= flag;
+    }
+    // Qubits without the given flag, in ascending order
+    std::vector<int> idle(uint8_t flag, int num_qubits)
+    {
+        std::vector<int> qubits;
+        for (int q=0; q<num_qubits; q++) {
+            if (!is(q, flag))
+                qubits.push_back(q);
+        }
+        return qubits;
+    }
+    void clear()
+    {
+        for (int q : used) {
+            flags[q] = 0;
+        }
+        used.clear();
+        used_flags = 0;
+    }
+};
+// Noise models write directly into the output circuit: noise which goes before an instruction
+// is appended first, followed by the instruction itself and the noise that goes after it
+Circuit DepolarizingModel::noisy_circuit(const Circuit &circ)
 {
     Circuit newcirc;
-    std::set<int> gated_qubits;
-    std::set<int> entangled_qubits;
-    std::set<int> measured_qubits;
-    for (auto it = circ.instructions.begin(); it != circ.instructions.end(); ++it) {
-        Circuit pre;
-        Circuit mid;
-        Circuit post;
-        auto &inst = *it;
-        mid.append(inst);
+    QubitOccupancy occupancy(circ.num_qubits);
+    for (auto inst : circ.instructions) {
+        std::optional<Instruction> post;
         if (inst.type == InstructionType::TICK) {
-            std::vector<int> idle1_qubits;
-            std::vector<int> idle2_qubits;
-            std::vector<int> idlem_qubits;
-            if (!gated_qubits.empty()) {
-                int start1 = 0;
-                for (auto it2 = gated_qubits.begin(); it2 != gated_qubits.end(); ++it2) {
-                    for (int i=start1; i<*it2; i++)
-                        idle1_qubits.push_back(i);
-                    start1 = *it2+1;
-                }
-                for (int i=start1; i<circ.num_qubits; i++)
-                    idle1_qubits.push_back(i);
-            }
-            if (!entangled_qubits.empty()) {
-                int start2 = 0;
-                for (auto it2 = entangled_qubits.begin(); it2 != entangled_qubits.end(); ++it2) {
-                    for (int i=start2; i<*it2; i++)
-                        idle2_qubits.push_back(i);
-                    start2 = *it2+1;
-                }
-                for (int i=start2; i<circ.num_qubits; i++)
-                    idle2_qubits.push_back(i);
+            if (pidle > 0 && occupancy.any(QUBIT_ENTANGLED)) {
+                auto idle2_qubits = occupancy.idle(QUBIT_ENTANGLED, circ.num_qubits);
+                if (!idle2_qubits.empty())
+                    newcirc.append(Instruction(bias ? InstructionType::Z_ERROR : InstructionType::DEPOLARIZE1, std::move(idle2_qubits), pidle)); // Only decoherence
             }
-            if (!measured_qubits.empty()/* && measured_qubits.size() > 5*/) { // FIXME
-                int startm = 0;
-                for (auto it2 = measured_qubits.begin(); it2 != measured_qubits.end(); ++it2) {
-                    for (int i=startm; i<*it2; i++)
-                        idlem_qubits.push_back(i);
-                    startm = *it2+1;
-                }
-                for (int i=startm; i<circ.num_qubits; i++)
-                    idlem_qubits.push_back(i);
+            if (deltapidle > 0 && occupancy.any(QUBIT_MEASURED)) {
+                auto idlem_qubits = occupancy.idle(QUBIT_MEASURED, circ.num_qubits);
+                if (!idlem_qubits.empty())
+                    newcirc.append(Instruction(InstructionType::DEPOLARIZE1, std::move(idlem_qubits), deltapidle));
             }
-            gated_qubits.clear();
-            entangled_qubits.clear();
-            measured_qubits.clear();
-            /*if (pgate > 0)
-                pre.append(Instruction(InstructionType::DEPOLARIZE1, idle1_qubits, pidle));
-            if (pidle-pgate > 0)
-                pre.append(Instruction(InstructionType::DEPOLARIZE1, idle2_qubits, pidle-pgate));*/
-            /*if (pgate > 0 && pidle > 0 && idle2_qubits.empty() && idlem_qubits.empty() && !idle1_qubits.empty())
-                pre.append(Instruction(InstructionType::DEPOLARIZE1, idle1_qubits, std::min(pidle, pgate)));*/
-            if (pidle > 0 && !idle2_qubits.empty())
-                pre.append(Instruction(bias ? InstructionType::Z_ERROR : InstructionType::DEPOLARIZE1, idle2_qubits, pidle)); // Only decoherence
-            if (deltapidle > 0 && !idlem_qubits.empty())
-                pre.append(Instruction(InstructionType::DEPOLARIZE1, idlem_qubits, deltapidle));
+            occupancy.clear();
         } else if (inst.type == InstructionType::MX || inst.type == InstructionType::MY || inst.type == InstructionType::MZ) {
             if (pm > 0)
-                pre.append(Instruction(inst.type == InstructionType::MX ? InstructionType::Z_ERROR : InstructionType::X_ERROR, inst.targets, pm));
+                newcirc.append(Instruction(inst.type == InstructionType::MX ? InstructionType::Z_ERROR : InstructionType::X_ERROR, inst.targets, pm));
         } else if (inst.type == InstructionType::RX || inst.type == InstructionType::RY || inst.type == InstructionType::RZ) {
             if (pm > 0)
-                post.append(Instruction(inst.type == InstructionType::RX ? InstructionType::Z_ERROR : InstructionType::X_ERROR, inst.targets, pm));
+                post = Instruction(inst.type == InstructionType::RX ? InstructionType::Z_ERROR : InstructionType::X_ERROR, inst.targets, pm);
         } else if (inst.type == InstructionType::CX || inst.type == InstructionType::CY || inst.type == InstructionType::CZ) {
             if (pcnot > 0)
-                post.append(Instruction(InstructionType::DEPOLARIZE2, inst.targets, pcnot));
+                post = Instruction(InstructionType::DEPOLARIZE2, inst.targets, pcnot);
         } else if (inst.type == InstructionType::SXX || inst.type == InstructionType::SXXDG || inst.type == InstructionType::SZZ || inst.type == InstructionType::SZZDG) {
             if (pcnot > 0)
-                post.append(Instruction(InstructionType::DEPOLARIZE, inst.targets, pcnot));
-        } else if (inst1q.find(inst.type) != inst1q.end()) {
+                post = Instruction(InstructionType::DEPOLARIZE, inst.targets, pcnot);
+        } else if (is_gate_class(inst.type, GATE_1Q)) {
             if (pgate > 0)
-                post.append(Instruction(InstructionType::DEPOLARIZE1, inst.targets, pgate));
+                post = Instruction(InstructionType::DEPOLARIZE1, inst.targets, pgate);
         }
-        for (int q : inst.targets) {
-            if (instnoise.find(inst.type) != instnoise.end())
-                break;
-            if (entangled_qubits.find(q) != entangled_qubits.end() || measured_qubits.find(q) != measured_qubits.end()) {
-                abort();
-            }
-            if (instm.find(inst.type) != instm.end()) {
-                measured_qubits.insert(q);
-                entangled_qubits.insert(q);
-                gated_qubits.insert(q);
-            } else if (inst2q.find(inst.type) != inst2q.end()) {
-                entangled_qubits.insert(q);
-                gated_qubits.insert(q);
-            } else if (inst1q.find(inst.type) != inst1q.end()) {
-                gated_qubits.insert(q);
+        if (!is_gate_class(inst.type, GATE_NOISE)) {
+            for (int q : inst.targets) {
+                if (occupancy.is(q, QUBIT_ENTANGLED|QUBIT_MEASURED)) {
+                    abort();
+                }
+                if (is_gate_class(inst.type, GATE_MEASUREMENT)) {
+                    occupancy.set(q, QUBIT_MEASURED|QUBIT_ENTANGLED|QUBIT_GATED);
+                } else if (is_gate_class(inst.type, GATE_2Q)) {
+                    occupancy.set(q, QUBIT_ENTANGLED|QUBIT_GATED);
+                } else if (is_gate_class(inst.type, GATE_1Q)) {
+                    occupancy.set(q, QUBIT_GATED);
+                }
             }
         }
-        newcirc += pre + mid + post;
+        newcirc.append(inst);
+        if (post)
+            newcirc.append(std::move(*post));
     }
-    return std::move(newcirc);
+    return newcirc;
 }
-Circuit GeneralDepolarizingModel::noisy_circuit(Circuit &circ)
+Circuit GeneralDepolarizingModel::noisy_circuit(const Circuit &circ)
 {
     Circuit newcirc;
-    std::set<int> gated_qubits;
-    std::set<int> entangled_qubits;
-    std::set<int> measured_qubits;
-    std::map<int,double> used_time;
+    QubitOccupancy occupancy(circ.num_qubits);
+    // Rates, durations and cooling times indexed by InstructionType
+    std::array<double, NUM_INSTRUCTION_TYPES> error_rates{};
+    std::array<double, NUM_INSTRUCTION_TYPES> durations{};
+    std::array<std::optional<double>, NUM_INSTRUCTION_TYPES> cooling{};
+    for (auto &[type, p] : errors)
+        error_rates[(int)type] = p;
+    for (auto &[type, t] : times)
+        durations[(int)type] = t;
+    for (auto &[type, t] : cooling_times)
+        cooling[(int)type] = t;
+    std::vector<double> used_time(circ.num_qubits);
+    double delay_time = 0;
     double cooling_time = 0;
-    for (auto it = circ.instructions.begin(); it != circ.instructions.end(); ++it) {
-        Circuit pre;
-        Circuit mid;
-        Circuit post;
-        auto &inst = *it;
-        mid.append(inst);
+    for (auto inst : circ.instructions) {
+        std::optional<Instruction> post;
         if (inst.type == InstructionType::TICK) {
-            double maxtime = 0;
-            for (auto &kvp : used_time) {
-                if (kvp.second > maxtime)
-                    maxtime = kvp.second;
+            double maxtime = delay_time;
+            for (double t : used_time) {
+                if (t > maxtime)
+                    maxtime = t;
             }
             maxtime += cooling_time;
             for (int i=0; i<circ.num_qubits; i++) {
@@ -127,183 +164,167 @@ Circuit GeneralDepolarizingModel::noisy_circuit(Circuit &circ)
                 if (time <= 0 || (T1 == 0 && T2 == 0)) {
                     continue;
                 } else if (T1 == 0) {
-                    pre.append(Instruction(InstructionType::Z_ERROR, {i}, time/2/T2));
+                    newcirc.append(Instruction(InstructionType::Z_ERROR, {i}, time/2/T2));
                 } else if (T1 == T2) {
-                    pre.append(Instruction(InstructionType::DEPOLARIZE1, {i}, time/2*(1/(2*T1)+1/T2)));
+                    newcirc.append(Instruction(InstructionType::DEPOLARIZE1, {i}, time/2*(1/(2*T1)+1/T2)));
                 } else {
                     double px = time/4/T1;
                     double pz = time/2*(1/T2-0.5/T1);
-                    pre.append(Instruction(InstructionType::PAULI1, {i}, {px, px, pz}));
+                    newcirc.append(Instruction(InstructionType::PAULI1, {i}, {px, px, pz}));
                 }
             }
-            used_time.clear();
-            gated_qubits.clear();
-            entangled_qubits.clear();
-            measured_qubits.clear();
+            std::fill(used_time.begin(), used_time.end(), 0);
+            delay_time = 0;
+            occupancy.clear();
             cooling_time = 0;
         } else {
-            double p = errors[inst.type];
+            double p = error_rates[(int)inst.type];
             if (p > 0) {
-                if (inst1q.find(inst.type) != inst1q.end()) {
-                    post.append(Instruction(InstructionType::DEPOLARIZE1, inst.targets, p));
+                if (is_gate_class(inst.type, GATE_1Q)) {
+                    post = Instruction(InstructionType::DEPOLARIZE1, inst.targets, p);
                 } else if (inst.type == InstructionType::MX || inst.type == InstructionType::MY || inst.type == InstructionType::MZ) {
-                    pre.append(Instruction(inst.type == InstructionType::MX ? InstructionType::Z_ERROR : InstructionType::X_ERROR, inst.targets, p));
+                    newcirc.append(Instruction(inst.type == InstructionType::MX ? InstructionType::Z_ERROR : InstructionType::X_ERROR, inst.targets, p));
                 } else if (inst.type == InstructionType::RX || inst.type == InstructionType::RY || inst.type == InstructionType::RZ) {
-                    post.append(Instruction(inst.type == InstructionType::RX ? InstructionType::Z_ERROR : InstructionType::X_ERROR, inst.targets, p));
+                    post = Instruction(inst.type == InstructionType::RX ? InstructionType::Z_ERROR : InstructionType::X_ERROR, inst.targets, p);
                 } else if (inst.type == InstructionType::CX || inst.type == InstructionType::CY || inst.type == InstructionType::CZ) {
-                    post.append(Instruction(InstructionType::DEPOLARIZE2, inst.targets, p));
+                    post = Instruction(InstructionType::DEPOLARIZE2, inst.targets, p);
                 } else if (inst.type == InstructionType::SXX || inst.type == InstructionType::SXXDG || inst.type == InstructionType::SZZ || inst.type == InstructionType::SZZDG) {
-                    post.append(Instruction(InstructionType::DEPOLARIZE, inst.targets, p));
+                    post = Instruction(InstructionType::DEPOLARIZE, inst.targets, p);
                 }
             }
             if (inst.type == InstructionType::DELAY) {
-                auto it = used_time.find(-1);
-                double delay = delay_times[*inst.label];
-                if (it == used_time.end() || it->second < delay)
-                    used_time[-1] = delay;
-                if (delay_cooling_times.find(*inst.label) != delay_cooling_times.end()) {
-                    double cool = delay_cooling_times[*inst.label];
-                    if (cool > cooling_time)
-                        cooling_time = cool;
-                }
-            } else {
-                if (cooling_times.find(inst.type) != cooling_times.end()) {
-                    double cool = cooling_times[inst.type];
-                    if (cool > cooling_time)
-                        cooling_time = cool;
-                }
+                auto it = delay_times.find(*inst.label);
+                double delay = it != delay_times.end() ? it->second : 0;
+                if (delay > delay_time)
+                    delay_time = delay;
+                auto it2 = delay_cooling_times.find(*inst.label);
+                if (it2 != delay_cooling_times.end() && it2->second > cooling_time)
+                    cooling_time = it2->second;
+            } else if (cooling[(int)inst.type] && *cooling[(int)inst.type] > cooling_time) {
+                cooling_time = *cooling[(int)inst.type];
             }
-            for (int q : inst.targets) {
-                if (instnoise.find(inst.type) != instnoise.end())
-                    break;
-                used_time[q] += times[inst.type];
-                if (entangled_qubits.find(q) != entangled_qubits.end() || measured_qubits.find(q) != measured_qubits.end())
-                    abort();
-                else if (instm.find(inst.type) != instm.end()) {
-                    measured_qubits.insert(q);
-                    entangled_qubits.insert(q);
-                    gated_qubits.insert(q);
-                } else if (inst2q.find(inst.type) != inst2q.end()) {
-                    entangled_qubits.insert(q);
-                    gated_qubits.insert(q);
-                } else if (inst1q.find(inst.type) != inst1q.end()) {
-                    gated_qubits.insert(q);
+            if (!is_gate_class(inst.type, GATE_NOISE)) {
+                for (int q : inst.targets) {
+                    if (q >= used_time.size())
+                        used_time.resize(q+1);
+                    used_time[q] += durations[(int)inst.type];
+                    if (occupancy.is(q, QUBIT_ENTANGLED|QUBIT_MEASURED))
+                        abort();
+                    else if (is_gate_class(inst.type, GATE_MEASUREMENT))
+                        occupancy.set(q, QUBIT_MEASURED|QUBIT_ENTANGLED|QUBIT_GATED);
+                    else if (is_gate_class(inst.type, GATE_2Q))
+                        occupancy.set(q, QUBIT_ENTANGLED|QUBIT_GATED);
+                    else if (is_gate_class(inst.type, GATE_1Q))
+                        occupancy.set(q, QUBIT_GATED);
                 }
             }
         }
-        newcirc += pre + mid + post;
+        newcirc.append(inst);
+        if (post)
+            newcirc.append(std::move(*post));
     }
-    return std::move(newcirc);
+    return newcirc;
 }
-Circuit MidCircuitNoiseModel::noisy_circuit(Circuit &circ)
+Circuit MidCircuitNoiseModel::noisy_circuit(const Circuit &circ)
 {
     Circuit newcirc;
-    std::set<int> gated_qubits;
-    std::set<int> entangled_qubits;
-    std::set<int> measured_qubits;
-    for (auto it = circ.instructions.begin(); it != circ.instructions.end(); ++it) {
-        Circuit pre;
-        Circuit mid;
-        Circuit post;
-        auto &inst = *it;
-        mid.append(inst);
+    QubitOccupancy occupancy(circ.num_qubits);
+    Error idle1_error = Error::DelayError(t_1q, 0, T2);
+    Error idle2_error = Error::DelayError(t_2q-t_1q, 0, T2);
+    int num_measured = 0;
+    for (auto inst : circ.instructions) {
+        std::optional<Instruction> post;
         if (inst.type == InstructionType::TICK) {
-            std::vector<int> idle1_qubits;
-            std::vector<int> idle2_qubits;
-            std::vector<int> idlem_qubits;
-            if (!gated_qubits.empty()) {
-                int start1 = 0;
-                for (auto it2 = gated_qubits.begin(); it2 != gated_qubits.end(); ++it2) {
-                    for (int i=start1; i<*it2; i++)
-                        idle1_qubits.push_back(i);
-                    start1 = *it2+1;
+            if (occupancy.any(QUBIT_MEASURED)) {
+                if (num_measured > 1) {
+                    auto idlem_qubits = occupancy.idle(QUBIT_MEASURED, circ.num_qubits);
+                    if (!idlem_qubits.empty())
+                        newcirc.append(err_midcirc.get_instruction(std::move(idlem_qubits)));
                 }
-                for (int i=start1; i<circ.num_qubits; i++)
-                    idle1_qubits.push_back(i);
-            }
-            if (!entangled_qubits.empty()) {
-                int start2 = 0;
-                for (auto it2 = entangled_qubits.begin(); it2 != entangled_qubits.end(); ++it2) {
-                    for (int i=start2; i<*it2; i++)
-                        idle2_qubits.push_back(i);
-                    start2 = *it2+1;
+            } else {
+                if (occupancy.any(QUBIT_GATED)) {
+                    auto idle1_qubits = occupancy.idle(QUBIT_GATED, circ.num_qubits);
+                    if (!idle1_qubits.empty())
+                        newcirc.append(idle1_error.get_instruction(std::move(idle1_qubits)));
                 }
-                for (int i=start2; i<circ.num_qubits; i++)
-                    idle2_qubits.push_back(i);
-            }
-            if (!measured_qubits.empty()) {
-                int startm = 0;
-                for (auto it2 = measured_qubits.begin(); it2 != measured_qubits.end(); ++it2) {
-                    for (int i=startm; i<*it2; i++)
-                        idlem_qubits.push_back(i);
-                    startm = *it2+1;
+                if (occupancy.any(QUBIT_ENTANGLED)) {
+                    auto idle2_qubits = occupancy.idle(QUBIT_ENTANGLED, circ.num_qubits);
+                    if (!idle2_qubits.empty())
+                        newcirc.append(idle2_error.get_instruction(std::move(idle2_qubits)));
                 }
-                for (int i=startm; i<circ.num_qubits; i++)
-                    idlem_qubits.push_back(i);
             }
-            if (!idlem_qubits.empty()) {
-                if (measured_qubits.size() > 1)
-                    pre.append(err_midcirc.get_instruction(idlem_qubits));
-                //else
-                    //pre.append(Error::DelayError(t_1q, 0, T2).get_instruction(idlem_qubits));
-            } else {
-                if (!idle1_qubits.empty())
-                    pre.append(Error::DelayError(t_1q, 0, T2).get_instruction(idle1_qubits));
-                if (!idle2_qubits.empty())
-                    pre.append(Error::DelayError(t_2q-t_1q, 0, T2).get_instruction(idle2_qubits));
-            }
-            gated_qubits.clear();
-            entangled_qubits.clear();
-            measured_qubits.clear();
+            occupancy.clear();
+            num_measured = 0;
         } else if (inst.type == InstructionType::MX || inst.type == InstructionType::MY || inst.type == InstructionType::MZ) {
             if (err_m > 0)
-                pre.append(Instruction(inst.type == InstructionType::MX ? InstructionType::Z_ERROR : InstructionType::X_ERROR, inst.targets, err_m));
+                newcirc.append(Instruction(inst.type == InstructionType::MX ? InstructionType::Z_ERROR : InstructionType::X_ERROR, inst.targets, err_m));
         } else if (inst.type == InstructionType::RX || inst.type == InstructionType::RY || inst.type == InstructionType::RZ) {
             if (err_m > 0)
-                post.append(Instruction(inst.type == InstructionType::RX ? InstructionType::Z_ERROR : InstructionType::X_ERROR, inst.targets, err_m));
+                post = Instruction(inst.type == InstructionType::RX ? InstructionType::Z_ERROR : InstructionType::X_ERROR, inst.targets, err_m);
         } else if (inst.type == InstructionType::CX || inst.type == InstructionType::CY || inst.type == InstructionType::CZ) {
             if (err_2q > 0)
-                post.append(Instruction(InstructionType::DEPOLARIZE2, inst.targets, err_2q));
+                post = Instruction(InstructionType::DEPOLARIZE2, inst.targets, err_2q);
         } else if (inst.type == InstructionType::SXX || inst.type == InstructionType::SXXDG || inst.type == InstructionType::SZZ || inst.type == InstructionType::SZZDG) {
             if (err_2q > 0)
-                post.append(Instruction(InstructionType::DEPOLARIZE, inst.targets, err_2q));
-        } else if (inst1q.find(inst.type) != inst1q.end()) {
+                post = Instruction(InstructionType::DEPOLARIZE, inst.targets, err_2q);
+        } else if (is_gate_class(inst.type, GATE_1Q)) {
             if (err_1q > 0)
-                post.append(Instruction(InstructionType::DEPOLARIZE1, inst.targets, err_1q));
+                post = Instruction(InstructionType::DEPOLARIZE1, inst.targets, err_1q);
         }
-        for (int q : inst.targets) {
-            if (instnoise.find(inst.type) != instnoise.end())
-                break;
-            if (entangled_qubits.find(q) != entangled_qubits.end() || measured_qubits.find(q) != measured_qubits.end())
-                abort();
-            if (instm.find(inst.type) != instm.end()) {
-                if (instreset.find(inst.type) == instreset.end())
-                    measured_qubits.insert(q);
-                //entangled_qubits.insert(q);
-                gated_qubits.insert(q);
-            } else if (inst2q.find(inst.type) != inst2q.end()) {
-                entangled_qubits.insert(q);
-                gated_qubits.insert(q);
-            } else if (inst1q.find(inst.type) != inst1q.end()) {
-                gated_qubits.insert(q);
+        if (!is_gate_class(inst.type, GATE_NOISE)) {
+            for (int q : inst.targets) {
+                if (occupancy.is(q, QUBIT_ENTANGLED|QUBIT_MEASURED))
+                    abort();
+                if (is_gate_class(inst.type, GATE_MEASUREMENT)) {
+                    if (!is_gate_class(inst.type, GATE_RESET)) {
+                        if (!occupancy.is(q, QUBIT_MEASURED))
+                            num_measured++;
+                        occupancy.set(q, QUBIT_MEASURED);
+                    }
+                    occupancy.set(q, QUBIT_GATED);
+                } else if (is_gate_class(inst.type, GATE_2Q)) {
+                    occupancy.set(q, QUBIT_ENTANGLED|QUBIT_GATED);
+                } else if (is_gate_class(inst.type, GATE_1Q)) {
+                    occupancy.set(q, QUBIT_GATED);
+                }
             }
         }
-        newcirc += pre + mid + post;
+        newcirc.append(inst);
+        if (post)
+            newcirc.append(std::move(*post));
     }
-    return std::move(newcirc);
+    return newcirc;
 }
-void apply_noise_to_nodes(std::shared_ptr<CircuitNode> node0, NoiseModel &noise, std::set<std::shared_ptr<CircuitNode>> &visited)
+// Noisy version of every distinct circuit, so that the noise model is only applied
+// once to identical circuits appearing in several nodes
+struct NoisyCircuitCache
+{
+    CircuitStore noiseless;
+    std::map<const Circuit*, SharedCircuit> noisy;
+};
+static void apply_noise_to_nodes(std::shared_ptr<CircuitNode> node0, NoiseModel &noise, std::set<std::shared_ptr<CircuitNode>> &visited, NoisyCircuitCache &cache)
 {
     if (visited.find(node0) != visited.end())
         return;
     visited.insert(node0);
-    node0->circuit = noise.noisy_circuit(node0->circuit);
-    for (auto node : node0->childs) {
+    auto circ = cache.noiseless.intern(node0->circuit.share());
+    auto it = cache.noisy.find(circ.get());
+    if (it == cache.noisy.end())
+        it = cache.noisy.emplace(circ.get(), noise.noisy_circuit(*circ)).first;
+    node0->circuit = it->second;
+    for (size_t i=0; i<node0->childs.size(); i++) {
+        auto node = node0->get_child(i);
         if (node != nullptr)
-            apply_noise_to_nodes(node, noise, visited);
+            apply_noise_to_nodes(node, noise, visited, cache);
     }
 }
+void apply_noise_to_nodes(std::shared_ptr<CircuitNode> node0, NoiseModel &noise, std::set<std::shared_ptr<CircuitNode>> &visited)
+{
+    NoisyCircuitCache cache;
+    apply_noise_to_nodes(node0, noise, visited, cache);
+}
 // Applies the specified noise model to all circuits in a tree
+// The noise model is applied once for every distinct circuit
 void apply_noise_to_nodes(std::shared_ptr<CircuitNode> node0, NoiseModel &noise)
 {
     std::set<std::shared_ptr<CircuitNode>> visited;
@@ -328,7 +349,7 @@ GeneralDepolarizingModel::GeneralDepolarizingModel(double alpha, double T2) : T1
     {
         errors[instr] = 3e-3*alpha + 1e-4*beta;
         times[instr] = 400e-6*alpha+30e-6*beta;
-        if (instreset.find(instr) == instreset.end())
+        if (!is_gate_class(instr, GATE_RESET))
             cooling_times[instr] = 100e-6*alpha+50e-6*alpha;
     }
     for (auto &instr : instreset)
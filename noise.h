@@ -8,7 +8,7 @@ class NoiseModel
     public:
     double pcrosstalk=0;
     double pmidcirc=0;
-    virtual Circuit noisy_circuit(Circuit &circ)
+    virtual Circuit noisy_circuit(const Circuit &circ)
     {
         return circ;
     }
@@ -49,7 +49,7 @@ class DepolarizingModel : public NoiseModel
     {
         
     }
-    Circuit noisy_circuit(Circuit &circ) override;
+    Circuit noisy_circuit(const Circuit &circ) override;
 };
 // General error channel definition, that provides an error instruction to
 // the specified qubits according to the channel
@@ -95,7 +95,7 @@ class MidCircuitNoiseModel : public NoiseModel
     {
         this->err_midcirc = Error(InstructionType::PAULI1, err_midcirc);
     }
-    Circuit noisy_circuit(Circuit &circ) override;
+    Circuit noisy_circuit(const Circuit &circ) override;
 };
 // Generic noise model with custom depolarizing instructions for each gate
 // Timings of operations, as well as required cooling times can be provided
@@ -120,7 +120,7 @@ class GeneralDepolarizingModel : public NoiseModel
         if (T1 > 0 && T2 > 2*T1) abort();
     }
     GeneralDepolarizingModel(double alpha, double T2=50e-3);
-    Circuit noisy_circuit(Circuit &circ) override;
+    Circuit noisy_circuit(const Circuit &circ) override;
 };
 void apply_noise_to_nodes(std::shared_ptr<CircuitNode> node0, NoiseModel &noise, std::set<std::shared_ptr<CircuitNode>> &visited);
 void apply_noise_to_nodes(std::shared_ptr<CircuitNode> node0, NoiseModel &noise);
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include "nonsparsesim.h"
+#include "checkpoint.h"
 #define RANDOMIZE_FLIPS
 void DenseFrameSimulator::flip_error(size_t shot, int qubit, int type)
 {
@@ -64,25 +65,74 @@ void DenseFrameSimulator::szz(int q1, int q2)
     errs1.second ^= tmp;
     errs2.second ^= tmp;
 }
+// Masks selecting the input bits of every output bit of a Clifford table
+// Output and input bits are X1, Z1, X2, Z2, so that bit j of the image is the xor of input i & masks[j][i]
+static std::array<std::array<uint64_t, 4>, 4> clifford_masks(const CliffordTable &table)
+{
+    std::array<std::array<uint64_t, 4>, 4> masks;
+    for (int j=0; j<4; j++) {
+        for (int i=0; i<4; i++)
+            masks[j][i] = -(uint64_t)((table.generator(i)>>j) & 1);
+    }
+    return masks;
+}
+// Generic Clifford gates
+// The image of the errors is computed for 64 shots at a time
+void DenseFrameSimulator::clifford1(int qubit, const CliffordTable &table)
+{
+    auto masks = clifford_masks(table);
+    auto &errs = errors[qubit];
+    for (size_t w=0; w<errs.first.shots.size(); w++) {
+        uint64_t x = errs.first.shots[w], z = errs.second.shots[w];
+        errs.first.shots[w] = (x & masks[0][0]) ^ (z & masks[0][1]);
+        errs.second.shots[w] = (x & masks[1][0]) ^ (z & masks[1][1]);
+    }
+}
+void DenseFrameSimulator::clifford2(int q1, int q2, const CliffordTable &table)
+{
+    auto masks = clifford_masks(table);
+    auto &errs1 = errors[q1];
+    auto &errs2 = errors[q2];
+    uint64_t *out[4] = {errs1.first.shots.data(), errs1.second.shots.data(), errs2.first.shots.data(), errs2.second.shots.data()};
+    for (size_t w=0; w<errs1.first.shots.size(); w++) {
+        uint64_t in[4] = {out[0][w], out[1][w], out[2][w], out[3][w]};
+        for (int j=0; j<4; j++)
+            out[j][w] = (in[0] & masks[j][0]) ^ (in[1] & masks[j][1]) ^ (in[2] & masks[j][2]) ^ (in[3] & masks[j][3]);
+    }
+}
 // Measurement in the X basis
 // Flipped if there is a Z error in the qubit
 void DenseFrameSimulator::mx(int qubit, MeasurementTag tag)
 {
     auto &errs = errors[qubit];
 #ifdef RANDOMIZE_FLIPS
-    for (int i=0; i<errs.first.shots.size(); i++) {
+    for (size_t i=0; i<errs.first.shots.size(); i++) {
         errs.first.shots[i] = rng();
     }
 #endif
     qubit_measurement_results[qubit][tag] = errs.second;
 }
+// Measurement in the Y basis
+// Flipped if there is a X or a Z error in the qubit, but not both
+void DenseFrameSimulator::my(int qubit, MeasurementTag tag)
+{
+    auto &errs = errors[qubit];
+#ifdef RANDOMIZE_FLIPS
+    for (size_t i=0; i<errs.first.shots.size(); i++) {
+        uint64_t r = rng();
+        errs.first.shots[i] ^= r;
+        errs.second.shots[i] ^= r;
+    }
+#endif
+    qubit_measurement_results[qubit][tag] = errs.first ^ errs.second;
+}
 // Measurement in the Z basis
 // Flipped if there is a X error in the qubit
 void DenseFrameSimulator::mz(int qubit, MeasurementTag tag)
 {
     auto &errs = errors[qubit];
 #ifdef RANDOMIZE_FLIPS
-    for (int i=0; i<errs.second.shots.size(); i++) {
+    for (size_t i=0; i<errs.second.shots.size(); i++) {
         errs.second.shots[i] = rng();
     }
 #endif
@@ -94,26 +144,41 @@ void DenseFrameSimulator::rx(int qubit)
 {
     auto &errs = errors[qubit];
 #ifdef RANDOMIZE_FLIPS
-    for (int i=0; i<errs.first.shots.size(); i++) {
+    for (size_t i=0; i<errs.first.shots.size(); i++) {
         errs.first.shots[i] = rng();
     }
 #endif
     errs.second.reset();
 }
+// Qubit preparation in |+i>
+// Resets all errors in the qubit, as a Y error doesn't change the state
+void DenseFrameSimulator::ry(int qubit)
+{
+    auto &errs = errors[qubit];
+    errs.first.reset();
+    errs.second.reset();
+#ifdef RANDOMIZE_FLIPS
+    for (size_t i=0; i<errs.first.shots.size(); i++) {
+        uint64_t r = rng();
+        errs.first.shots[i] = r;
+        errs.second.shots[i] = r;
+    }
+#endif
+}
 // Qubit preparation in |0>
 // Resets X errors in the qubit
 void DenseFrameSimulator::rz(int qubit)
 {
     auto &errs = errors[qubit];
 #ifdef RANDOMIZE_FLIPS
-    for (int i=0; i<errs.second.shots.size(); i++) {
+    for (size_t i=0; i<errs.second.shots.size(); i++) {
         errs.second.shots[i] = rng();
     }
 #endif
     errs.first.reset();
 }
 // Runs a deterministic circuit
-void DenseFrameSimulator::run(Circuit &circuit)
+void DenseFrameSimulator::run(const Circuit &circuit)
 {
     uint64_t sz = ((num_shots-1)>>6)+1;
     for (int i=0; i<circuit.num_qubits; i++) {
@@ -121,11 +186,11 @@ void DenseFrameSimulator::run(Circuit &circuit)
         err.first.shots.resize(sz);
         err.first.nshots = num_shots;
         if (err.second.shots.size() < sz) {
-            int old = err.second.shots.size();
+            size_t old = err.second.shots.size();
             err.second.shots.resize(sz);
             err.second.nshots = num_shots;
 #ifdef RANDOMIZE_FLIPS
-            for (int j=old; j<err.second.shots.size(); j++) {
+            for (size_t j=old; j<err.second.shots.size(); j++) {
                 err.second.shots[j] = rng();
             }
 #endif
@@ -133,18 +198,167 @@ void DenseFrameSimulator::run(Circuit &circuit)
     }
     BaseFrameSimulator::run(circuit);
 }
+// Returns the flip tables for each syndrome bit, nullptr if the measurement was never recorded
+std::vector<const ErrorTable*> DenseFrameSimulator::get_syndrome_tables(const SyndromeMeasurements &syndrome)
+{
+    syndrome.check_size();
+    uint64_t sz = ((num_shots-1)>>6)+1;
+    std::vector<const ErrorTable*> bits(syndrome.syndrome.size(), nullptr);
+    for (int i=0; i<syndrome.syndrome.size(); i++) {
+        auto it1 = qubit_measurement_results.find(syndrome.syndrome[i].qubit);
+        if (it1 == qubit_measurement_results.end())
+            continue;
+        auto it2 = it1->second.find(syndrome.syndrome[i].tag);
+        if (it2 != it1->second.end() && it2->second.shots.size() >= sz)
+            bits[i] = &it2->second;
+    }
+    return bits;
+}
+// Evaluates a branch condition for all shots, 64 shots at a time
+std::vector<int> DenseFrameSimulator::get_branches(const BranchCondition &condition)
+{
+    std::vector<int> branches(num_shots);
+    if (num_shots == 0)
+        return branches;
+    uint64_t sz = ((num_shots-1)>>6)+1;
+    auto bits = get_syndrome_tables(condition);
+    auto assign = [&branches](uint64_t w, uint64_t shots, int branch) {
+        for (; shots; shots &= shots-1) {
+            branches[(w<<6)+std::bitset<64>((shots & (~shots+1))-1).count()] = branch;
+        }
+    };
+    for (uint64_t w=0; w<sz; w++) {
+        uint64_t remaining = ~UINT64_C(0);
+        if (w == sz-1 && (num_shots & 63))
+            remaining = (UINT64_C(1)<<(num_shots & 63))-1;
+        uint64_t any = 0;
+        for (auto *tab : bits) {
+            if (tab != nullptr)
+                any |= tab->shots[w];
+        }
+        for (auto &rule : condition.rules) {
+            uint64_t match;
+            if (rule.type == BranchCondition::Rule::Type::PARITY) {
+                match = 0;
+                for (int i=0; i<bits.size(); i++) {
+                    if (bits[i] != nullptr && ((rule.mask>>i)&1))
+                        match ^= bits[i]->shots[w];
+                }
+                if (!(rule.value & 1))
+                    match = ~match;
+            } else {
+                // Bits beyond the syndrome are 0, as in Rule::matches()
+                uint64_t outside = bits.size() < 64 ? ~((UINT64_C(1)<<bits.size())-1) : 0;
+                match = (rule.mask & rule.value & outside) ? 0 : ~UINT64_C(0);
+                for (int i=0; i<bits.size(); i++) {
+                    if ((rule.mask>>i)&1) {
+                        uint64_t bit = bits[i] != nullptr ? bits[i]->shots[w] : 0;
+                        match &= ((rule.value>>i)&1) ? bit : ~bit;
+                    }
+                }
+            }
+            match &= remaining;
+            if (match) {
+                assign(w, match, rule.branch);
+                remaining &= ~match;
+            }
+        }
+        if (remaining == 0)
+            continue;
+        // Shots with zero syndrome all share the same branch
+        assign(w, remaining & ~any, condition.lookup(0));
+        if (condition.table.empty()) {
+            assign(w, remaining & any, condition.default_branch);
+            continue;
+        }
+        for (uint64_t pending = remaining & any; pending; pending &= pending-1) {
+            uint64_t shot_bit = pending & (~pending+1);
+            uint64_t syndrome = 0;
+            for (int i=0; i<bits.size(); i++) {
+                if (bits[i] != nullptr && (bits[i]->shots[w] & shot_bit))
+                    syndrome |= UINT64_C(1)<<i;
+            }
+            assign(w, shot_bit, condition.lookup(syndrome));
+        }
+    }
+    return branches;
+}
+// Applies the corrections of a declarative table, 64 shots at a time
+void DenseFrameSimulator::apply_corrections(const CorrectionTable &table)
+{
+    uint64_t sz = ((num_shots-1)>>6)+1;
+    auto bits = get_syndrome_tables(table);
+    auto errors_for = [this, sz](int qubit) -> std::pair<ErrorTable,ErrorTable>& {
+        auto &err = errors[qubit];
+        if (err.first.shots.size() < sz) {
+            err.first.shots.resize(sz);
+            err.first.nshots = num_shots;
+        }
+        if (err.second.shots.size() < sz) {
+            err.second.shots.resize(sz);
+            err.second.nshots = num_shots;
+        }
+        return err;
+    };
+    auto apply = [&errors_for](const CorrectionTable::Correction &corr, uint64_t w, uint64_t shots) {
+        for (int errx : corr.x) {
+            errors_for(errx).first.shots[w] ^= shots;
+        }
+        for (int errz : corr.z) {
+            errors_for(errz).second.shots[w] ^= shots;
+        }
+    };
+    for (uint64_t w=0; w<sz; w++) {
+        uint64_t any = 0;
+        for (auto *tab : bits) {
+            if (tab != nullptr)
+                any |= tab->shots[w];
+        }
+        // Zero syndrome for all 64 shots: nothing to correct
+        if (any == 0)
+            continue;
+        for (auto &rule : table.parity_rules) {
+            uint64_t odd = 0;
+            for (int i=0; i<bits.size(); i++) {
+                if (bits[i] != nullptr && ((rule.mask>>i)&1))
+                    odd ^= bits[i]->shots[w];
+            }
+            if (odd)
+                apply(rule.correction, w, odd);
+        }
+        if (table.table.empty())
+            continue;
+        // Lookup table: extract the syndrome only for shots with a non-zero one
+        for (uint64_t pending = any; pending; pending &= pending-1) {
+            uint64_t shot_bit = pending & (~pending+1);
+            uint64_t syndrome = 0;
+            for (int i=0; i<bits.size(); i++) {
+                if (bits[i] != nullptr && (bits[i]->shots[w] & shot_bit))
+                    syndrome |= UINT64_C(1)<<i;
+            }
+            auto *corr = table.lookup(syndrome);
+            if (corr != nullptr)
+                apply(*corr, w, shot_bit);
+        }
+    }
+}
 // Recursively runs a circuit node, which consists in a deterministic circuit
 // and a function which determines which circuit goes afterwards
-void DenseFrameSimulator::run(std::shared_ptr<CircuitNode> node)
+std::shared_ptr<CircuitNode> DenseFrameSimulator::run_node(std::shared_ptr<CircuitNode> node)
 {
     // Run the circuit
-    run(node->circuit);
+    run(*node_circuit(*node));
 
+    // Pure callbacks are evaluated once for every distinct set of outcomes they read
+    auto *memos = node_memos(node);
     // Apply error corrections for this round, if any
     if (node->error_corrections) {
+        TraceSpan span("error_corrections", node->name);
+        span.arg("calls", num_shots);
+        std::pair<std::set<int>,std::set<int>> computed;
         for (size_t i=0; i<num_shots; i++) {
             auto res = MeasurementResultsDense(qubit_measurement_results, i, num_shots);
-            auto corr = node->error_corrections(res);
+            auto &corr = memos != nullptr ? memos->error_corrections.get(res, node->error_corrections) : (computed = node->error_corrections(res));
             for (int errx : corr.first) {
                 errors[errx].first.flip(i);
             }
@@ -153,30 +367,45 @@ void DenseFrameSimulator::run(std::shared_ptr<CircuitNode> node)
             }
         }
     }
-    // If only one node, directly run it
-    if (node->childs.size() <= 1 && !node->next_node_index) {
-        if (!node->childs.empty())
-            run(node->childs[0]);
-        return;
+    for (auto &table : node->correction_tables) {
+        apply_corrections(table);
     }
+    // If only one node, it is run next
+    if (node->childs.size() <= 1 && !node->has_branching())
+        return node->childs.empty() ? nullptr : node->get_child(0);
+    TraceSpan split("branch split", node->name);
+    split.arg("shots", num_shots);
+    // Declarative conditions are evaluated for all shots at once
+    std::vector<int> branches;
+    if (node->branch_condition)
+        branches = get_branches(*node->branch_condition);
     // Go over all shots and classify them depending on the measurement outcomes
     auto old_err = std::move(errors);
     auto old_res = std::move(qubit_measurement_results);
     errors.clear();
     qubit_measurement_results.clear();
     std::map<int, DenseFrameSimulator*> sims;
+    ShotIds discarded;
     for (size_t i=0; i<num_shots; i++) {
         auto res = MeasurementResultsDense(old_res, i, num_shots);
         // Get the index of the next circuit for this shot
         int branch = 0;
-        if (node->next_node_index)
+        if (node->branch_condition)
+            branch = branches[i];
+        else if (memos != nullptr && node->next_node_index)
+            branch = memos->next_node_index.get(res, node->next_node_index);
+        else if (node->next_node_index)
             branch = node->next_node_index(res);
-        if (branch < 0) // Shot discarded by post-selection
+        if (branch < 0) { // Shot discarded by post-selection
+            if (fault_counts != nullptr)
+                discarded.push_back(shot_ids.global(i));
             continue;
+        }
         // Build a new simulator for every circuit
         auto it = sims.find(branch);
         if (it == sims.end()) {
             it = sims.insert({branch, new DenseFrameSimulator(0, rng)}).first;
+            copy_sampling_state(*it->second);
         }
         // Copy to the relevant simulator instance the shot data
         auto *sim = it->second;
@@ -190,26 +419,152 @@ void DenseFrameSimulator::run(std::shared_ptr<CircuitNode> node)
             }
         }
         sim->num_shots++;
+        if (track_shot_ids())
+            sim->shot_ids.push_back(shot_ids.global(i));
     }
+    end_shots(discarded, true);
     num_shots = 0;
-    // Run the next circuit for each shot
+    shot_ids = ShotIds();
+    split.end();
+    // The simulators run the next circuit for each shot, in the order of the branches
     for (auto [branch, sim] : sims) {
         sim->error = error;
         sim->current_tick = current_tick;
-        if (node->childs[branch])
-            sim->run(node->childs[branch]);
-        
-        // Copy back the shot data to this instance
-        for (auto &[qub, tab] : sim->errors) {
-            errors[qub].first.append(std::move(tab.first));
-            errors[qub].second.append(std::move(tab.second));
-        }
-        for (auto &[qub, res] : sim->qubit_measurement_results) {
-            for (auto &[tag, tab] : res) {
-                qubit_measurement_results[qub][tag].append(std::move(tab));
+        sim->next_node = branch < node->childs.size() ? node->get_child(branch) : nullptr;
+        sim->finished = false;
+        this->branches.emplace_back(sim);
+    }
+    return nullptr;
+}
+std::unique_ptr<BaseFrameSimulator> DenseFrameSimulator::new_branch()
+{
+    auto sim = std::make_unique<DenseFrameSimulator>(0, rng);
+    copy_sampling_state(*sim);
+    return sim;
+}
+void DenseFrameSimulator::merge_branch(BaseFrameSimulator &branch)
+{
+    auto *sim = static_cast<DenseFrameSimulator*>(&branch);
+    // Copy back the shot data to this instance
+    // Tables which only exist in some branches are padded, so that all of them keep the same shot order
+    for (auto &[qub, tab] : sim->errors) {
+        auto &err = errors[qub];
+        err.first.pad(num_shots);
+        err.second.pad(num_shots);
+        tab.first.pad(sim->num_shots);
+        tab.second.pad(sim->num_shots);
+        err.first.append(std::move(tab.first));
+        err.second.append(std::move(tab.second));
+    }
+    for (auto &[qub, res] : sim->qubit_measurement_results) {
+        for (auto &[tag, tab] : res) {
+            auto &results = qubit_measurement_results[qub][tag];
+            results.pad(num_shots);
+            tab.pad(sim->num_shots);
+            results.append(std::move(tab));
+        }
+    }
+    num_shots += sim->num_shots;
+    shot_ids.append(sim->shot_ids);
+    for (auto &[qub, err] : errors) {
+        err.first.pad(num_shots);
+        err.second.pad(num_shots);
+    }
+    for (auto &[qub, res] : qubit_measurement_results) {
+        for (auto &[tag, tab] : res)
+            tab.pad(num_shots);
+    }
+}
+static void put_table(StateWriter &w, const ErrorTable &tab)
+{
+    w.put(tab.nshots);
+    w.put_words(tab.shots);
+}
+static void get_table(StateReader &r, ErrorTable &tab)
+{
+    tab.nshots = r.get();
+    r.get_words(tab.shots);
+}
+void DenseFrameSimulator::save_shots(StateWriter &w) const
+{
+    w.put(errors.size());
+    for (auto &[qubit, err] : errors) {
+        w.put_signed(qubit);
+        put_table(w, err.first);
+        put_table(w, err.second);
+    }
+    w.put(qubit_measurement_results.size());
+    for (auto &[qubit, res] : qubit_measurement_results) {
+        w.put_signed(qubit);
+        w.put(res.size());
+        for (auto &[tag, tab] : res) {
+            w.put_tag(tag);
+            put_table(w, tab);
+        }
+    }
+}
+void DenseFrameSimulator::load_shots(StateReader &r)
+{
+    errors.clear();
+    size_t count = r.get();
+    for (size_t i=0; i<count; i++) {
+        auto &err = errors[r.get_signed()];
+        get_table(r, err.first);
+        get_table(r, err.second);
+    }
+    qubit_measurement_results.clear();
+    count = r.get();
+    for (size_t i=0; i<count; i++) {
+        auto &res = qubit_measurement_results[r.get_signed()];
+        size_t num_tags = r.get();
+        for (size_t j=0; j<num_tags; j++) {
+            auto tag = r.get_tag();
+            get_table(r, res[tag]);
+        }
+    }
+}
+size_t DenseFrameSimulator::memory_usage() const
+{
+    size_t bytes = 0;
+    for (auto &[qubit, err] : errors)
+        bytes += sizeof(err)+(err.first.shots.capacity()+err.second.shots.capacity())*sizeof(uint64_t);
+    for (auto &[qubit, res] : qubit_measurement_results) {
+        for (auto &[tag, tab] : res)
+            bytes += sizeof(tag)+sizeof(tab)+tab.shots.capacity()*sizeof(uint64_t);
+    }
+    return bytes;
+}
+void DenseFrameSimulator::for_each_flip(std::function<void(size_t, int, const MeasurementTag&)> f) const
+{
+    for (auto &[qubit, res] : qubit_measurement_results) {
+        for (auto &[tag, tab] : res) {
+            size_t words = std::min(tab.shots.size(), (num_shots+63)>>6);
+            for (size_t w=0; w<words; w++) {
+                uint64_t bits = tab.shots[w];
+                if (w == (num_shots>>6))
+                    bits &= (UINT64_C(1)<<(num_shots & 63))-1;
+                for (; bits; bits &= bits-1)
+                    f((w<<6)+std::bitset<64>((bits & (~bits+1))-1).count(), qubit, tag);
             }
         }
-        num_shots += sim->num_shots;
-        delete sim;
     }
-}
\ No newline at end of file
+}
+size_t DenseFrameSimulator::duplicate_shot(size_t shot)
+{
+    size_t copy = num_shots++;
+    auto duplicate = [&](ErrorTable &tab) {
+        bool flipped = (shot>>6) < tab.shots.size() && tab.flipped(shot);
+        tab.shots.resize(((num_shots-1)>>6)+1);
+        tab.nshots = num_shots;
+        tab.reset_flipped(copy, flipped);
+    };
+    for (auto &[qubit, err] : errors) {
+        duplicate(err.first);
+        duplicate(err.second);
+    }
+    for (auto &[qubit, res] : qubit_measurement_results) {
+        for (auto &[tag, tab] : res)
+            duplicate(tab);
+    }
+    return copy;
+}
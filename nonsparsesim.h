@@ -12,7 +12,7 @@ struct ErrorTable
     std::vector<uint64_t> shots;
     ErrorTable& operator^=(const ErrorTable &o)
     {
-        for (int i=0; i<shots.size(); i++) {
+        for (size_t i=0; i<shots.size(); i++) {
             shots[i] ^= o.shots[i];
         }
         return *this;
@@ -20,7 +20,7 @@ struct ErrorTable
     ErrorTable operator^(const ErrorTable &o) const
     {
         ErrorTable t = *this;
-        for (int i=0; i<shots.size(); i++) {
+        for (size_t i=0; i<shots.size(); i++) {
             t.shots[i] ^= o.shots[i];
         }
         return t;
@@ -31,7 +31,7 @@ struct ErrorTable
     }
     void reset()
     {
-        for (int i=0; i<shots.size(); i++) {
+        for (size_t i=0; i<shots.size(); i++) {
             shots[i] = 0;
         }
     }
@@ -47,14 +47,38 @@ struct ErrorTable
         shots[maj] ^= ((uint64_t)(val^was_flipped))<<min;
         return was_flipped;
     }
+    // Adds shots without flips up to a total of n shots
+    void pad(size_t n)
+    {
+        if (n <= nshots)
+            return;
+        ErrorTable zeros;
+        zeros.nshots = n-nshots;
+        zeros.shots.resize((zeros.nshots+63)>>6);
+        append(std::move(zeros));
+    }
+    // Appends the shots of another table, keeping their order
     void append(ErrorTable &&t)
     {
-        while ((nshots & 63) && t.nshots) {
-            reset_flipped(nshots++, t.flipped(--t.nshots));
-            if ((t.nshots & 63) == 0)
-                t.shots.pop_back();
+        // Bits past the last shot may be set, and must not be carried over
+        shots.resize((nshots+63)>>6);
+        t.shots.resize((t.nshots+63)>>6);
+        if (nshots & 63)
+            shots.back() &= (UINT64_C(1)<<(nshots & 63))-1;
+        if (t.nshots & 63)
+            t.shots.back() &= (UINT64_C(1)<<(t.nshots & 63))-1;
+        int shift = nshots & 63;
+        if (shift == 0) {
+            shots.insert(shots.end(), t.shots.begin(), t.shots.end());
+        } else {
+            size_t base = shots.size()-1;
+            shots.resize((nshots+t.nshots+63)>>6);
+            for (size_t i=0; i<t.shots.size(); i++) {
+                shots[base+i] |= t.shots[i]<<shift;
+                if (base+i+1 < shots.size())
+                    shots[base+i+1] |= t.shots[i]>>(64-shift);
+            }
         }
-        shots.insert(shots.end(), t.shots.begin(), t.shots.end());
         nshots += t.nshots;
     }
     void append(bool err)
@@ -77,9 +101,13 @@ class MeasurementResultsDense : public MeasurementResults
     MeasurementResultsDense(std::map<int, std::map<MeasurementTag, ErrorTable>> &results, size_t shot, size_t nshots) : qubit_measurement_results(results), shot(shot), num_shots(nshots) {}
     bool is_flipped(int qubit, const MeasurementTag &tag) override
     {
-        auto &tab = qubit_measurement_results[qubit][tag];
-        tab.shots.resize(((num_shots-1)>>6)+1);
-        return tab.flipped(shot);
+        auto it1 = qubit_measurement_results.find(qubit);
+        if (it1 == qubit_measurement_results.end())
+            return false;
+        auto it2 = it1->second.find(tag);
+        if (it2 == it1->second.end() || (shot>>6) >= it2->second.shots.size())
+            return false;
+        return it2->second.flipped(shot);
     }
     bool reset_flipped(int qubit, const MeasurementTag &tag) override
     {
@@ -113,10 +141,25 @@ class DenseFrameSimulator : public BaseFrameSimulator
     void sxx(int q1, int q2) override;
     void szz(int q1, int q2) override;
     void mx(int qubit, MeasurementTag tag) override;
+    void my(int qubit, MeasurementTag tag) override;
     void mz(int qubit, MeasurementTag tag) override;
     void rx(int qubit) override;
+    void ry(int qubit) override;
     void rz(int qubit) override;
-    void run(Circuit &circ) override;
-    void run(std::shared_ptr<CircuitNode> node) override;
+    void clifford1(int qubit, const CliffordTable &table) override;
+    void clifford2(int q1, int q2, const CliffordTable &table) override;
+    void run(const Circuit &circ) override;
+    std::shared_ptr<CircuitNode> run_node(std::shared_ptr<CircuitNode> node) override;
+    using BaseFrameSimulator::run;
+    std::unique_ptr<BaseFrameSimulator> new_branch() override;
+    void merge_branch(BaseFrameSimulator &branch) override;
+    void save_shots(StateWriter &w) const override;
+    void load_shots(StateReader &r) override;
+    size_t memory_usage() const override;
+    void for_each_flip(std::function<void(size_t, int, const MeasurementTag&)> f) const override;
+    size_t duplicate_shot(size_t shot) override;
+    void apply_corrections(const CorrectionTable &table);
+    std::vector<int> get_branches(const BranchCondition &condition);
+    std::vector<const ErrorTable*> get_syndrome_tables(const SyndromeMeasurements &syndrome);
     void flip_error(size_t shot, int qubit, int type) override;
 };
\ No newline at end of file
@@ -0,0 +1,363 @@
+#include "optimizer.h"
+#include "analysis.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
+// Inverse of a gate, for gates with a frame action that can be cancelled
+// Returns std::nullopt for any other instruction
+static std::optional<InstructionType> inverse_gate(InstructionType type)
+{
+    switch (type) {
+        case InstructionType::X:
+        case InstructionType::Y:
+        case InstructionType::Z:
+        case InstructionType::H:
+        case InstructionType::CX:
+        case InstructionType::CY:
+        case InstructionType::CZ:
+            return type;
+        case InstructionType::S:
+            return InstructionType::SDG;
+        case InstructionType::SDG:
+            return InstructionType::S;
+        case InstructionType::SX:
+            return InstructionType::SXDG;
+        case InstructionType::SXDG:
+            return InstructionType::SX;
+        case InstructionType::SY:
+            return InstructionType::SYDG;
+        case InstructionType::SYDG:
+            return InstructionType::SY;
+        case InstructionType::SXX:
+            return InstructionType::SXXDG;
+        case InstructionType::SXXDG:
+            return InstructionType::SXX;
+        case InstructionType::SZZ:
+            return InstructionType::SZZDG;
+        case InstructionType::SZZDG:
+            return InstructionType::SZZ;
+        default:
+            return std::nullopt;
+    }
+}
+Circuit cancel_inverse_gates(const Circuit &circ)
+{
+    auto &instructions = circ.instructions;
+    // Last gate acting on each qubit, as (instruction, target index), or -1 if the qubit
+    // was last used by an instruction which can't be cancelled
+    int num_qubits = circ.num_qubits;
+    for (auto inst : instructions) {
+        for (int q : inst.targets)
+            num_qubits = std::max(num_qubits, q+1);
+    }
+    std::vector<std::pair<int, int>> last(num_qubits, {-1, -1});
+    std::vector<std::vector<bool>> removed(instructions.size());
+    for (int k=0; k<instructions.size(); k++) {
+        auto inst = instructions[k];
+        removed[k].resize(inst.targets.size());
+        if (inst.type == InstructionType::TICK)
+            continue;
+        auto inverse = inverse_gate(inst.type);
+        if (!inverse || inst.label) {
+            for (int q : inst.targets)
+                last[q] = {-1, -1};
+            continue;
+        }
+        switch (inst.type) {
+            case InstructionType::CX:
+            case InstructionType::CY:
+            case InstructionType::CZ:
+                for (int i=0; i+1<inst.targets.size(); i+=2) {
+                    auto &[ka, ia] = last[inst.targets[i]];
+                    auto &[kb, ib] = last[inst.targets[i+1]];
+                    // Both qubits must come from the same pair, in the same order unless the gate is symmetric
+                    bool cancel = ka >= 0 && ka == kb && instructions[ka].type == *inverse && ia/2 == ib/2
+                        && (ia < ib || inst.type == InstructionType::CZ);
+                    if (cancel) {
+                        removed[ka][ia] = removed[ka][ib] = true;
+                        removed[k][i] = removed[k][i+1] = true;
+                        ka = kb = -1;
+                    } else {
+                        last[inst.targets[i]] = {k, i};
+                        last[inst.targets[i+1]] = {k, i+1};
+                    }
+                }
+                break;
+            case InstructionType::SXX:
+            case InstructionType::SXXDG:
+            case InstructionType::SZZ:
+            case InstructionType::SZZDG:
+            {
+                // The gate acts on all pairs of targets, so only whole instructions
+                // on the same set of qubits can be cancelled
+                if (inst.targets.empty())
+                    break;
+                int kp = last[inst.targets[0]].first;
+                bool cancel = kp >= 0 && instructions[kp].type == *inverse
+                    && instructions[kp].targets.size() == inst.targets.size();
+                for (int i=0; cancel && i<inst.targets.size(); i++)
+                    cancel = last[inst.targets[i]].first == kp;
+                if (cancel) {
+                    std::fill(removed[kp].begin(), removed[kp].end(), true);
+                    std::fill(removed[k].begin(), removed[k].end(), true);
+                    for (int q : inst.targets)
+                        last[q] = {-1, -1};
+                } else {
+                    for (int i=0; i<inst.targets.size(); i++)
+                        last[inst.targets[i]] = {k, i};
+                }
+                break;
+            }
+            default:
+                for (int i=0; i<inst.targets.size(); i++) {
+                    auto &[kp, ip] = last[inst.targets[i]];
+                    if (kp >= 0 && instructions[kp].type == *inverse) {
+                        removed[kp][ip] = removed[k][i] = true;
+                        kp = -1;
+                    } else {
+                        last[inst.targets[i]] = {k, i};
+                    }
+                }
+                break;
+        }
+    }
+    Circuit newcirc;
+    newcirc.num_qubits = circ.num_qubits;
+    newcirc.instructions.reserve(instructions.size(), 0);
+    std::vector<int> targets;
+    for (int k=0; k<instructions.size(); k++) {
+        auto inst = instructions[k];
+        targets.clear();
+        for (int i=0; i<inst.targets.size(); i++) {
+            if (!removed[k][i])
+                targets.push_back(inst.targets[i]);
+        }
+        if (targets.size() == inst.targets.size())
+            newcirc.instructions.push_back(inst);
+        else if (!targets.empty())
+            newcirc.instructions.push_back(inst.type, targets, inst.p, inst.measurement_tag, inst.label);
+    }
+    return newcirc;
+}
+// Probabilities of each Pauli error, indexed as the error types of the simulator:
+// 1 for X, 2 for Z and 3 for Y. Two qubit errors are indexed as first | second<<2
+typedef std::array<double, 4> Channel1;
+typedef std::array<double, 16> Channel2;
+// Channel equivalent to applying both channels
+// Errors compose by xor of their indices
+template<size_t N>
+static std::array<double, N> compose(const std::array<double, N> &a, const std::array<double, N> &b)
+{
+    std::array<double, N> c{};
+    for (int i=0; i<N; i++) {
+        for (int j=0; j<N; j++)
+            c[i^j] += a[i]*b[j];
+    }
+    return c;
+}
+// Two qubit channel with a single qubit channel on the first (second=false) or second qubit
+static Channel2 extend(const Channel1 &p, bool second)
+{
+    Channel2 c{};
+    for (int i=0; i<4; i++)
+        c[second ? i<<2 : i] = p[i];
+    return c;
+}
+static Channel2 swap_qubits(const Channel2 &p)
+{
+    Channel2 c;
+    for (int i=0; i<16; i++)
+        c[(i>>2) | (i&3)<<2] = p[i];
+    return c;
+}
+// Channel of a noise instruction on one or two qubits. Returns std::nullopt for other instructions
+// DEPOLARIZE applies one channel to all its targets, so it isn't split into channels of one or two qubits
+static std::optional<Channel1> channel1(const InstructionRef &inst)
+{
+    auto p = pauli_channel(inst);
+    if (inst.type == InstructionType::DEPOLARIZE || p.size() != 4)
+        return std::nullopt;
+    Channel1 c;
+    std::copy(p.begin(), p.end(), c.begin());
+    return c;
+}
+static std::optional<Channel2> channel2(const InstructionRef &inst)
+{
+    auto p = pauli_channel(inst);
+    if (inst.type == InstructionType::DEPOLARIZE || p.size() != 16)
+        return std::nullopt;
+    Channel2 c;
+    std::copy(p.begin(), p.end(), c.begin());
+    return c;
+}
+// Composed probabilities which should be equal can differ in the last bits
+static bool nearly_equal(double a, double b)
+{
+    return std::abs(a-b) <= 1e-12*std::max(std::abs(a), std::abs(b));
+}
+// Pauli channels waiting to be written to the output circuit
+// Every qubit has at most one pending channel, either on its own or as part of a pair
+struct PendingChannels
+{
+    std::vector<std::optional<Channel1>> single;
+    struct Pair
+    {
+        int a, b;
+        Channel2 p;
+    };
+    std::vector<std::optional<Pair>> pairs;
+    // Index of the pending pair of each qubit, or -1
+    std::vector<int> pair_of;
+    // Qubits with a pending channel, possibly repeated
+    std::vector<int> used;
+    // Flushed channels, grouped by instruction type and parameters, in order of first appearance
+    std::map<std::pair<InstructionType, std::vector<double>>, int> group_index;
+    std::vector<Instruction> groups;
+    PendingChannels(int num_qubits) : single(num_qubits), pair_of(num_qubits, -1) {}
+    void touch(int q)
+    {
+        if (q >= single.size()) {
+            single.resize(q+1);
+            pair_of.resize(q+1, -1);
+        }
+        used.push_back(q);
+    }
+    void add(int q, const Channel1 &p)
+    {
+        touch(q);
+        if (pair_of[q] >= 0) {
+            auto &pair = *pairs[pair_of[q]];
+            pair.p = compose(pair.p, extend(p, pair.b == q));
+        } else {
+            single[q] = single[q] ? compose(*single[q], p) : p;
+        }
+    }
+    void add(int a, int b, Channel2 p)
+    {
+        touch(a);
+        touch(b);
+        if (pair_of[a] >= 0 && pair_of[a] == pair_of[b]) {
+            auto &pair = *pairs[pair_of[a]];
+            pair.p = compose(pair.p, pair.a == a ? p : swap_qubits(p));
+            return;
+        }
+        flush_pair(a);
+        flush_pair(b);
+        if (single[a])
+            p = compose(p, extend(*single[a], false));
+        if (single[b])
+            p = compose(p, extend(*single[b], true));
+        single[a] = single[b] = std::nullopt;
+        pair_of[a] = pair_of[b] = pairs.size();
+        pairs.push_back(Pair{a, b, p});
+    }
+    void emit(InstructionType type, std::vector<int> targets, std::vector<double> p)
+    {
+        auto [it, inserted] = group_index.try_emplace({type, p}, groups.size());
+        if (inserted)
+            groups.emplace_back(type, std::move(targets), std::move(p));
+        else
+            groups[it->second].targets.insert(groups[it->second].targets.end(), targets.begin(), targets.end());
+    }
+    void flush_pair(int q)
+    {
+        if (q >= pair_of.size() || pair_of[q] < 0)
+            return;
+        auto &pair = pairs[pair_of[q]];
+        pair_of[pair->a] = pair_of[pair->b] = -1;
+        auto &p = pair->p;
+        if (p[0] < 1) {
+            bool uniform = true;
+            for (int i=2; i<16; i++)
+                uniform &= nearly_equal(p[i], p[1]);
+            if (uniform)
+                emit(InstructionType::DEPOLARIZE2, {pair->a, pair->b}, {15*p[1]});
+            else
+                emit(InstructionType::PAULI2, {pair->a, pair->b}, std::vector<double>(p.begin()+1, p.end()));
+        }
+        pair = std::nullopt;
+    }
+    void flush(int q)
+    {
+        flush_pair(q);
+        if (q >= single.size() || !single[q])
+            return;
+        auto &p = *single[q];
+        if (p[0] < 1) {
+            if (nearly_equal(p[1], p[2]) && nearly_equal(p[2], p[3]))
+                emit(InstructionType::DEPOLARIZE1, {q}, {p[1]+p[2]+p[3]});
+            else if (p[2] == 0 && p[3] == 0)
+                emit(InstructionType::X_ERROR, {q}, {p[1]});
+            else if (p[1] == 0 && p[3] == 0)
+                emit(InstructionType::Z_ERROR, {q}, {p[2]});
+            else if (p[1] == 0 && p[2] == 0)
+                emit(InstructionType::Y_ERROR, {q}, {p[3]});
+            else
+                emit(InstructionType::PAULI1, {q}, {p[1], p[2], p[3]});
+        }
+        single[q] = std::nullopt;
+    }
+    void flush_all()
+    {
+        for (int q : used)
+            flush(q);
+        used.clear();
+        pairs.clear();
+    }
+    // Writes the flushed channels to the circuit
+    void write(Circuit &circ)
+    {
+        for (auto &inst : groups)
+            circ.append(inst);
+        groups.clear();
+        group_index.clear();
+    }
+};
+Circuit fuse_noise_channels(const Circuit &circ)
+{
+    Circuit newcirc;
+    newcirc.num_qubits = circ.num_qubits;
+    newcirc.instructions.reserve(circ.instructions.size(), 0);
+    PendingChannels pending(circ.num_qubits);
+    for (auto inst : circ.instructions) {
+        if (!inst.label) {
+            if (auto p = channel1(inst)) {
+                for (int q : inst.targets)
+                    pending.add(q, *p);
+                continue;
+            }
+            if (auto p = channel2(inst)) {
+                for (int i=0; i+1<inst.targets.size(); i+=2)
+                    pending.add(inst.targets[i], inst.targets[i+1], *p);
+                continue;
+            }
+        }
+        if (inst.type == InstructionType::TICK) {
+            pending.flush_all();
+        } else {
+            for (int q : inst.targets)
+                pending.flush(q);
+        }
+        pending.write(newcirc);
+        newcirc.instructions.push_back(inst);
+    }
+    pending.flush_all();
+    pending.write(newcirc);
+    return newcirc;
+}
+Circuit optimize_circuit(const Circuit &circ)
+{
+    return fuse_noise_channels(cancel_inverse_gates(circ));
+}
+void optimize_nodes(std::shared_ptr<CircuitNode> node0)
+{
+    CircuitStore originals;
+    std::map<const Circuit*, SharedCircuit> optimized;
+    for (auto &node : reachable_nodes(node0)) {
+        auto circ = originals.intern(node->circuit.share());
+        auto it = optimized.find(circ.get());
+        if (it == optimized.end())
+            it = optimized.emplace(circ.get(), optimize_circuit(*circ)).first;
+        node->circuit = it->second;
+    }
+}
@@ -0,0 +1,17 @@
+#pragma once
+#include "circuit.h"
+// Circuit optimization passes. The optimized circuit produces the same distribution of
+// errors and measurement flips, with fewer instructions to simulate
+
+// Removes pairs of adjacent gates that cancel each other (e.g. H H, S SDG or CX CX on the same qubits)
+// Gates are adjacent if no other instruction acts on their qubits between them, TICKs excluded
+Circuit cancel_inverse_gates(const Circuit &circ);
+// Combines the Pauli channels acting on the same qubits between two other instructions
+// into a single channel with the composed probabilities, and groups channels with the
+// same probabilities into a single instruction
+// Channels are not moved across TICK instructions
+Circuit fuse_noise_channels(const Circuit &circ);
+// Applies all passes
+Circuit optimize_circuit(const Circuit &circ);
+// Optimizes all circuits in a tree. Every distinct circuit is only optimized once
+void optimize_nodes(std::shared_ptr<CircuitNode> node0);
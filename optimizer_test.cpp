@@ -0,0 +1,107 @@
+// Optimized circuits must give the same errors as the original ones
+#include "optimizer.h"
+#include "dem.h"
+#include "simulator.h"
+#include <cmath>
+#include <iostream>
+static int failures = 0;
+static void check(bool ok, const std::string &name)
+{
+    std::cout<<(ok ? "ok   " : "FAIL ")<<name<<std::endl;
+    if (!ok)
+        failures++;
+}
+// Circuit with gates that cancel, gates separated by noise that don't, and several channels
+// on the same qubits, both on single qubits and on pairs
+// Every channel is a product of independent mechanisms, so that the detector error models are exact
+static Circuit test_circuit()
+{
+    Circuit circ;
+    circ.append(Instruction(InstructionType::RZ, {0, 1, 2}));
+    circ.append(Instruction(InstructionType::H, {0}));
+    circ.append(Instruction(InstructionType::H, {0}));
+    circ.append(Instruction(InstructionType::X_ERROR, {0}, 0.05));
+    circ.append(Instruction(InstructionType::DEPOLARIZE1, {0}, 0.02));
+    circ.append(Instruction(InstructionType::Z_ERROR, {0}, 0.01));
+    circ.append(Instruction(InstructionType::CX, {0, 1}));
+    circ.append(Instruction(InstructionType::S, {1}));
+    circ.append(Instruction(InstructionType::SDG, {1}));
+    circ.append(Instruction(InstructionType::SXX, {1, 2}));
+    circ.append(Instruction(InstructionType::SXXDG, {1, 2}));
+    circ.append(Instruction(InstructionType::PAULI2, {1, 2}, {0.01, 0.002, 0.02, 0.003, 0.004, 0.002, 0.03, 0.002, 0.003, 0.002, 0.002, 0.01, 0.002, 0.003, 0.02}));
+    circ.append(Instruction(InstructionType::DEPOLARIZE2, {1, 2}, 0.04));
+    circ.append(Instruction(InstructionType::Y_ERROR, {2}, 0.03));
+    circ.append(Instruction(InstructionType::H, {2}));
+    circ.append(Instruction(InstructionType::X_ERROR, {2}, 0.06));
+    circ.append(Instruction(InstructionType::H, {2}));
+    circ.append(Instruction(InstructionType::TICK, {}));
+    circ.append(Instruction(InstructionType::X_ERROR, {1}, 0.07));
+    circ.append(Instruction(InstructionType::CX, {1, 0}));
+    circ.append(Instruction(InstructionType::MZ, {0, 1, 2}, {}, MeasurementTag{0, "m"}));
+    return circ;
+}
+static DetectorErrorModel model(const Circuit &circ)
+{
+    std::vector<std::vector<MeasurementRef>> detectors;
+    for (int q=0; q<3; q++)
+        detectors.push_back({{q, MeasurementTag{0, "m"}}});
+    return detector_error_model(circ, detectors, {});
+}
+static bool same_model(const DetectorErrorModel &a, const DetectorErrorModel &b)
+{
+    if (a.errors.size() != b.errors.size())
+        return false;
+    for (size_t i=0; i<a.errors.size(); i++) {
+        auto &x = a.errors[i], &y = b.errors[i];
+        if (x.detectors != y.detectors || x.observables != y.observables || std::abs(x.p-y.p) > 1e-12)
+            return false;
+    }
+    return true;
+}
+// Number of shots with every combination of flipped measurements
+static std::vector<uint64_t> flip_histogram(const Circuit &circ, size_t num_shots)
+{
+    std::mt19937_64 rng;
+    FrameSimulator sim(num_shots, rng);
+    sim.use_counter_rng(11);
+    auto node = std::make_shared<CircuitNode>("circuit");
+    node->circuit = circ;
+    sim.run(node);
+    std::map<size_t, int> flips;
+    sim.for_each_flip([&](size_t shot, int qubit, const MeasurementTag &) {
+        flips[shot] |= 1<<qubit;
+    });
+    std::vector<uint64_t> histogram(8);
+    histogram[0] = num_shots-flips.size();
+    for (auto &[shot, pattern] : flips)
+        histogram[pattern]++;
+    return histogram;
+}
+// Whether two samples of the same distribution agree within 5 standard deviations
+static bool same_distribution(const std::vector<uint64_t> &a, const std::vector<uint64_t> &b)
+{
+    for (size_t i=0; i<a.size(); i++) {
+        double diff = (double)a[i]-(double)b[i];
+        if (std::abs(diff) > 5*std::sqrt((double)(a[i]+b[i]))+1)
+            return false;
+    }
+    return true;
+}
+int main()
+{
+    auto circ = test_circuit();
+    auto cancelled = cancel_inverse_gates(circ);
+    auto fused = fuse_noise_channels(circ);
+    auto optimized = optimize_circuit(circ);
+    check(cancelled.instructions.size() < circ.instructions.size(), "gates cancelled");
+    check(fused.instructions.size() < circ.instructions.size(), "channels fused");
+    check(same_model(model(cancelled), model(circ)), "cancel_inverse_gates keeps the detector error model");
+    check(same_model(model(fused), model(circ)), "fuse_noise_channels keeps the detector error model");
+    check(same_model(model(optimized), model(circ)), "optimize_circuit keeps the detector error model");
+    size_t shots = 200000;
+    auto reference = flip_histogram(circ, shots);
+    check(same_distribution(flip_histogram(cancelled, shots), reference), "cancel_inverse_gates keeps the flip distribution");
+    check(same_distribution(flip_histogram(fused, shots), reference), "fuse_noise_channels keeps the flip distribution");
+    check(same_distribution(flip_histogram(optimized, shots), reference), "optimize_circuit keeps the flip distribution");
+    return failures > 0;
+}
@@ -0,0 +1,448 @@
+#include "parser.h"
+#include <charconv>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+MappedFile::MappedFile(const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr<<"Cannot open "<<path<<std::endl;
+        abort();
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr != MAP_FAILED) {
+            madvise(addr, st.st_size, MADV_SEQUENTIAL);
+            data = (const char*)addr;
+            length = st.st_size;
+            mapped = true;
+        }
+    }
+    if (!mapped) {
+        char chunk[65536];
+        ssize_t n;
+        while ((n = read(fd, chunk, sizeof(chunk))) > 0)
+            buffer.append(chunk, n);
+        data = buffer.data();
+        length = buffer.size();
+    }
+    close(fd);
+}
+MappedFile::~MappedFile()
+{
+    if (mapped)
+        munmap((void*)data, length);
+}
+// Instruction names accepted in each format
+// Stim names that need to be expanded into several instructions are handled by the parser
+static const std::unordered_map<std::string_view, InstructionType> &native_names()
+{
+    static std::unordered_map<std::string_view, InstructionType> names = [] {
+        std::unordered_map<std::string_view, InstructionType> names;
+        for (int i=0; i<NUM_INSTRUCTION_TYPES; i++)
+            names[InstructionNames[i]] = (InstructionType)i;
+        return names;
+    }();
+    return names;
+}
+static const std::unordered_map<std::string_view, InstructionType> &stim_names()
+{
+    static std::unordered_map<std::string_view, InstructionType> names = {
+        {"I", InstructionType::I},
+        {"X", InstructionType::X},
+        {"Y", InstructionType::Y},
+        {"Z", InstructionType::Z},
+        {"H", InstructionType::H},
+        {"H_XZ", InstructionType::H},
+        {"S", InstructionType::S},
+        {"SQRT_Z", InstructionType::S},
+        {"S_DAG", InstructionType::SDG},
+        {"SQRT_Z_DAG", InstructionType::SDG},
+        {"SQRT_X", InstructionType::SX},
+        {"SQRT_X_DAG", InstructionType::SXDG},
+        {"SQRT_Y", InstructionType::SY},
+        {"SQRT_Y_DAG", InstructionType::SYDG},
+        {"CX", InstructionType::CX},
+        {"CNOT", InstructionType::CX},
+        {"ZCX", InstructionType::CX},
+        {"CY", InstructionType::CY},
+        {"ZCY", InstructionType::CY},
+        {"CZ", InstructionType::CZ},
+        {"ZCZ", InstructionType::CZ},
+        {"SQRT_XX", InstructionType::SXX},
+        {"SQRT_XX_DAG", InstructionType::SXXDG},
+        {"SQRT_ZZ", InstructionType::SZZ},
+        {"SQRT_ZZ_DAG", InstructionType::SZZDG},
+        {"M", InstructionType::MZ},
+        {"MZ", InstructionType::MZ},
+        {"MX", InstructionType::MX},
+        {"MY", InstructionType::MY},
+        {"R", InstructionType::RZ},
+        {"RZ", InstructionType::RZ},
+        {"RX", InstructionType::RX},
+        {"RY", InstructionType::RY},
+        {"DEPOLARIZE1", InstructionType::DEPOLARIZE1},
+        {"DEPOLARIZE2", InstructionType::DEPOLARIZE2},
+        {"X_ERROR", InstructionType::X_ERROR},
+        {"Y_ERROR", InstructionType::Y_ERROR},
+        {"Z_ERROR", InstructionType::Z_ERROR},
+        {"PAULI_CHANNEL_1", InstructionType::PAULI1},
+        {"PAULI_CHANNEL_2", InstructionType::PAULI2},
+        {"TICK", InstructionType::TICK},
+    };
+    return names;
+}
+// Measure and reset instructions, expanded into a measurement followed by a reset
+static const std::unordered_map<std::string_view, InstructionType> stim_measure_reset = {
+    {"MR", InstructionType::MZ},
+    {"MRZ", InstructionType::MZ},
+    {"MRX", InstructionType::MX},
+    {"MRY", InstructionType::MY},
+};
+// Instructions without effect on the simulation
+static const std::set<std::string_view> stim_annotations = {
+    "DETECTOR",
+    "OBSERVABLE_INCLUDE",
+    "QUBIT_COORDS",
+    "SHIFT_COORDS",
+};
+// Single pass tokenizer over the text
+// Tokens are views into the text; targets and parameters are parsed into reusable
+// buffers and appended directly into the circuit pools
+class CircuitParser
+{
+    const char *pos;
+    const char *end;
+    CircuitFormat format;
+    int line=1;
+    int num_measurements=0;
+    std::vector<int> targets;
+    std::vector<double> params;
+    std::string label;
+    MeasurementTag tag;
+
+    [[noreturn]] void error(const std::string &msg)
+    {
+        std::cerr<<"Circuit parse error at line "<<line<<": "<<msg<<std::endl;
+        abort();
+    }
+    void skip_spaces()
+    {
+        while (pos < end && (*pos == ' ' || *pos == '\t' || *pos == '\r'))
+            pos++;
+    }
+    // Skips the rest of the line, including comments
+    void skip_line()
+    {
+        const char *nl = (const char*)memchr(pos, '\n', end-pos);
+        pos = nl ? nl : end;
+    }
+    bool at_line_end()
+    {
+        return pos == end || *pos == '\n' || *pos == '#';
+    }
+    static bool is_name_char(char c)
+    {
+        return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '_';
+    }
+    std::string_view read_word()
+    {
+        const char *start = pos;
+        while (pos < end && is_name_char(*pos))
+            pos++;
+        return std::string_view(start, pos-start);
+    }
+    int read_int()
+    {
+        if (pos == end || *pos < '0' || *pos > '9')
+            error("expected integer");
+        int val = 0;
+        while (pos < end && *pos >= '0' && *pos <= '9') {
+            val = val*10 + (*pos-'0');
+            pos++;
+        }
+        return val;
+    }
+    // Decimal numbers with few digits are converted exactly with one multiplication or
+    // division by a power of ten, which is much faster than the generic conversion
+    bool read_double_fast(double &val)
+    {
+        static const double pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+        const char *p = pos;
+        uint64_t mantissa = 0;
+        int digits = 0;
+        int exponent = 0;
+        while (p < end && *p >= '0' && *p <= '9') {
+            mantissa = mantissa*10 + (*p++-'0');
+            digits++;
+        }
+        if (p < end && *p == '.') {
+            p++;
+            while (p < end && *p >= '0' && *p <= '9') {
+                mantissa = mantissa*10 + (*p++-'0');
+                digits++;
+                exponent--;
+            }
+        }
+        if (digits == 0 || digits > 15)
+            return false;
+        if (p < end && (*p == 'e' || *p == 'E')) {
+            p++;
+            bool negative = p < end && *p == '-';
+            if (p < end && (*p == '-' || *p == '+'))
+                p++;
+            if (p == end || *p < '0' || *p > '9')
+                return false;
+            int e = 0;
+            while (p < end && *p >= '0' && *p <= '9' && e < 1000)
+                e = e*10 + (*p++-'0');
+            exponent += negative ? -e : e;
+        }
+        if (exponent < -22 || exponent > 22)
+            return false;
+        val = exponent < 0 ? mantissa / pow10[-exponent] : mantissa * pow10[exponent];
+        pos = p;
+        return true;
+    }
+    double read_double()
+    {
+        double val;
+        if (read_double_fast(val))
+            return val;
+        auto res = std::from_chars(pos, end, val);
+        if (res.ec != std::errc())
+            error("expected number");
+        pos = res.ptr;
+        return val;
+    }
+    void read_params()
+    {
+        params.clear();
+        if (pos == end || *pos != '(')
+            return;
+        pos++;
+        skip_spaces();
+        if (pos < end && *pos == ')') {
+            pos++;
+            return;
+        }
+        for (;;) {
+            skip_spaces();
+            params.push_back(read_double());
+            skip_spaces();
+            if (pos < end && *pos == ',') {
+                pos++;
+            } else if (pos < end && *pos == ')') {
+                pos++;
+                return;
+            } else {
+                error("expected ',' or ')'");
+            }
+        }
+    }
+    // Reads a [name:round] measurement tag
+    bool read_tag()
+    {
+        if (pos == end || *pos != '[')
+            return false;
+        const char *close = (const char*)memchr(pos, ']', end-pos);
+        const char *nl = (const char*)memchr(pos, '\n', end-pos);
+        if (close == nullptr || (nl != nullptr && nl < close))
+            error("unterminated measurement tag");
+        const char *colon = close;
+        while (colon > pos && *colon != ':')
+            colon--;
+        if (colon == pos)
+            error("expected ':' in measurement tag");
+        tag.name.assign(pos+1, colon);
+        pos = colon+1;
+        bool negative = pos < close && *pos == '-';
+        if (negative)
+            pos++;
+        tag.current_round = negative ? -read_int() : read_int();
+        if (pos != close)
+            error("invalid measurement round");
+        pos = close+1;
+        return true;
+    }
+    void read_targets(bool allow_label, bool &has_label)
+    {
+        targets.clear();
+        has_label = false;
+        for (;;) {
+            skip_spaces();
+            if (at_line_end())
+                return;
+            if (*pos >= '0' && *pos <= '9') {
+                targets.push_back(read_int());
+            } else if (allow_label && targets.empty() && !has_label) {
+                const char *start = pos;
+                while (pos < end && *pos != ' ' && *pos != '\t' && *pos != '\r' && *pos != '\n')
+                    pos++;
+                label.assign(start, pos);
+                has_label = true;
+            } else {
+                error("unsupported target");
+            }
+            if (pos < end && *pos != ' ' && *pos != '\t' && !at_line_end() && *pos != '\r')
+                error("unexpected character in targets");
+        }
+    }
+    void parse_native_instruction(Circuit &circ, std::string_view name)
+    {
+        auto it = native_names().find(name);
+        if (it == native_names().end())
+            error("unknown instruction "+std::string(name));
+        read_params();
+        bool has_tag = read_tag();
+        bool has_label;
+        read_targets(true, has_label);
+        circ.append(it->second, targets, params, has_tag ? &tag : nullptr, has_label ? &label : nullptr);
+    }
+    // Stim PAULI_CHANNEL parameters are ordered X,Y,Z (IX,IY,...,ZZ for two qubits),
+    // while PAULI1/PAULI2 index probabilities by error type X=1,Z=2,Y=3 (control | target<<2)
+    void reorder_pauli_params(InstructionType type)
+    {
+        static const int stim_to_type[4] = {0, 1, 3, 2};
+        if (type == InstructionType::PAULI1) {
+            if (params.size() != 3)
+                error("PAULI_CHANNEL_1 takes 3 arguments");
+            std::swap(params[1], params[2]);
+        } else if (type == InstructionType::PAULI2) {
+            if (params.size() != 15)
+                error("PAULI_CHANNEL_2 takes 15 arguments");
+            std::vector<double> p(15);
+            for (int k=1; k<16; k++)
+                p[(stim_to_type[k>>2] | stim_to_type[k&3]<<2)-1] = params[k-1];
+            params = std::move(p);
+        }
+    }
+    void parse_stim_instruction(Circuit &circ, std::string_view name)
+    {
+        if (stim_annotations.count(name)) {
+            skip_line();
+            return;
+        }
+        auto mr = stim_measure_reset.find(name);
+        InstructionType type;
+        if (mr != stim_measure_reset.end()) {
+            type = mr->second;
+        } else {
+            auto it = stim_names().find(name);
+            if (it == stim_names().end())
+                error("unsupported Stim instruction "+std::string(name));
+            type = it->second;
+        }
+        read_params();
+        bool has_label;
+        read_targets(false, has_label);
+        bool measurement = type == InstructionType::MX || type == InstructionType::MY || type == InstructionType::MZ;
+        if (measurement) {
+            // The argument of a measurement is the probability of flipping its result
+            if (!params.empty() && params[0] > 0)
+                circ.append(type == InstructionType::MX ? InstructionType::Z_ERROR : InstructionType::X_ERROR, targets, params[0]);
+            tag.name = "stim";
+            tag.current_round = num_measurements++;
+            circ.append(type, targets, Span<double>(), &tag);
+        } else {
+            reorder_pauli_params(type);
+            circ.append(type, targets, params);
+        }
+        if (mr != stim_measure_reset.end()) {
+            InstructionType reset = type == InstructionType::MX ? InstructionType::RX : (type == InstructionType::MY ? InstructionType::RY : InstructionType::RZ);
+            circ.append(reset, targets);
+        }
+    }
+    // Parses lines until the end of the text or the end of a REPEAT block
+    void parse_block(Circuit &circ, bool nested)
+    {
+        while (pos < end) {
+            skip_spaces();
+            if (pos == end)
+                break;
+            if (*pos == '\n') {
+                pos++;
+                line++;
+                continue;
+            }
+            if (*pos == '#') {
+                skip_line();
+                continue;
+            }
+            if (format == CircuitFormat::STIM && *pos == '}') {
+                if (!nested)
+                    error("unmatched '}'");
+                pos++;
+                return;
+            }
+            std::string_view name = read_word();
+            if (name.empty())
+                error("expected instruction name");
+            if (format == CircuitFormat::STIM && name == "REPEAT") {
+                skip_spaces();
+                int count = read_int();
+                skip_spaces();
+                if (pos == end || *pos != '{')
+                    error("expected '{'");
+                pos++;
+                // The body is parsed once per repetition, so that every measurement gets its own tag
+                const char *body = pos;
+                int body_line = line;
+                for (int i=0; i<count; i++) {
+                    pos = body;
+                    line = body_line;
+                    parse_block(circ, true);
+                }
+                if (count == 0) {
+                    Circuit skipped;
+                    parse_block(skipped, true);
+                }
+                continue;
+            }
+            if (format == CircuitFormat::STIM)
+                parse_stim_instruction(circ, name);
+            else
+                parse_native_instruction(circ, name);
+            skip_spaces();
+            if (pos < end && *pos == '#')
+                skip_line();
+        }
+        if (nested)
+            error("unterminated REPEAT block");
+    }
+    public:
+    CircuitParser(std::string_view text, CircuitFormat format) : pos(text.data()), end(text.data()+text.size()), format(format) {}
+    Circuit parse()
+    {
+        Circuit circ;
+        // Every line holds at most one instruction, so the line count bounds the pool sizes
+        size_t num_lines = 1;
+        for (const char *p = pos; (p = (const char*)memchr(p, '\n', end-p)) != nullptr; p++)
+            num_lines++;
+        circ.instructions.reserve(num_lines, 2*num_lines);
+        parse_block(circ, false);
+        return circ;
+    }
+};
+Circuit parse_circuit(std::string_view text, CircuitFormat format)
+{
+    return CircuitParser(text, format).parse();
+}
+Circuit load_circuit(const std::string &path, CircuitFormat format)
+{
+    MappedFile file(path);
+    return parse_circuit(file.view(), format);
+}
+Circuit load_circuit(const std::string &path)
+{
+    bool stim = path.size() >= 5 && path.compare(path.size()-5, 5, ".stim") == 0;
+    return load_circuit(path, stim ? CircuitFormat::STIM : CircuitFormat::NATIVE);
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include "circuit.h"
+#include <string>
+#include <string_view>
+// Text formats accepted by the circuit parser
+// NATIVE is the format written by operator<<(std::ostream&, const Circuit&):
+//   NAME(p1,p2,...)[tag_name:round] label t1 t2 ...
+// where the parameter list, tag and label are optional
+// STIM accepts the subset of Stim circuits that maps to FrameSim instructions.
+// Annotations (DETECTOR, OBSERVABLE_INCLUDE, coordinates) are skipped and
+// REPEAT blocks are unrolled. Measurements are tagged with the name "stim" and
+// the index of the measurement instruction as round
+enum struct CircuitFormat
+{
+    NATIVE,
+    STIM,
+};
+// Read-only view of a file's contents, memory-mapped when possible
+// Falls back to reading the file into memory when it can't be mapped (e.g. pipes)
+class MappedFile
+{
+    const char *data=nullptr;
+    size_t length=0;
+    bool mapped=false;
+    std::string buffer;
+    public:
+    MappedFile(const std::string &path);
+    MappedFile(const MappedFile&) = delete;
+    MappedFile &operator=(const MappedFile&) = delete;
+    ~MappedFile();
+    std::string_view view() const
+    {
+        return std::string_view(data, length);
+    }
+};
+// Parses a circuit from text. Aborts with a message indicating the line on syntax errors
+Circuit parse_circuit(std::string_view text, CircuitFormat format=CircuitFormat::NATIVE);
+// Parses a circuit file. Files ending in .stim are read as Stim circuits
+Circuit load_circuit(const std::string &path);
+Circuit load_circuit(const std::string &path, CircuitFormat format);
@@ -0,0 +1,55 @@
+// Parsing of circuits written by operator<< and of Stim circuits
+#include "parser.h"
+#include <iostream>
+#include <sstream>
+static int failures = 0;
+static void check(bool ok, const std::string &name)
+{
+    std::cout<<(ok ? "ok   " : "FAIL ")<<name<<std::endl;
+    if (!ok)
+        failures++;
+}
+static std::string to_string(const Circuit &circ)
+{
+    std::ostringstream os;
+    os<<circ;
+    return os.str();
+}
+int main()
+{
+    Circuit circ;
+    circ.append(Instruction(InstructionType::RZ, {0, 1, 2, 3}));
+    circ.append(Instruction(InstructionType::H, {0}));
+    circ.append(Instruction(InstructionType::CY, {0, 1}));
+    circ.append(Instruction(InstructionType::SXXDG, {1, 2, 3}));
+    circ.append(Instruction(InstructionType::DEPOLARIZE2, {0, 1}, 1.0/3));
+    circ.append(Instruction(InstructionType::PAULI1, {2}, {1e-5, 0.25, 0.125}));
+    circ.append(Instruction(InstructionType::DELAY, {3}, {2.5e-7}, std::nullopt, std::string("wait")));
+    circ.append(Instruction(InstructionType::TICK, {}));
+    circ.append(Instruction(InstructionType::MX, {0}, {}, MeasurementTag{-2, "flag"}));
+    circ.append(Instruction(InstructionType::MZ, {1, 2}, {}, MeasurementTag{7, "syndrome"}));
+    check(parse_circuit(to_string(circ)) == circ, "native format round trip");
+    Circuit stim = parse_circuit(
+        "# comment\n"
+        "R 0 1\n"
+        "X_ERROR(0.125) 0\n"
+        "REPEAT 2 {\n"
+        "    CNOT 0 1\n"
+        "    M 1\n"
+        "    DETECTOR rec[-1]\n"
+        "}\n"
+        "MR 0\n", CircuitFormat::STIM);
+    // REPEAT blocks are unrolled, annotations skipped and measurements numbered in order
+    Circuit expected = parse_circuit(
+        "RZ 0 1\n"
+        "X_ERROR(0.125) 0\n"
+        "CX 0 1\n"
+        "MZ[stim:0] 1\n"
+        "CX 0 1\n"
+        "MZ[stim:1] 1\n"
+        "MZ[stim:2] 0\n"
+        "RZ 0\n");
+    check(stim == expected, "Stim circuit");
+    check(expected.instructions.size() == 8 && *expected.instructions[5].measurement_tag == MeasurementTag{1, "stim"}, "native format");
+    return failures > 0;
+}
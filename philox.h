@@ -0,0 +1,58 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <limits>
+// Philox4x64-10 counter-based random number generator (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3")
+// Every (key, counter) pair gives an independent block of random numbers, so the numbers for any
+// position of the stream are computed directly, without generating the ones before
+// The first word of the counter is used as the position within the stream, so an object of this class
+// is a std::uniform_random_bit_generator for the stream identified by the key and the other 3 words
+class Philox4x64
+{
+    public:
+    typedef uint64_t result_type;
+    typedef std::array<uint64_t, 4> Counter;
+    typedef std::array<uint64_t, 2> Key;
+    private:
+    Key key;
+    Counter counter;
+    Counter output;
+    int used=4;
+    static inline void mulhilo(uint64_t a, uint64_t b, uint64_t &hi, uint64_t &lo)
+    {
+        unsigned __int128 product = (unsigned __int128)a*b;
+        hi = product>>64;
+        lo = (uint64_t)product;
+    }
+    public:
+    Philox4x64(Key key, Counter counter) : key(key), counter(counter) {}
+    static Counter generate(Counter ctr, Key k)
+    {
+        for (int round=0; round<10; round++) {
+            uint64_t hi0, lo0, hi1, lo1;
+            mulhilo(UINT64_C(0xD2E7470EE14C6C93), ctr[0], hi0, lo0);
+            mulhilo(UINT64_C(0xCA5A826395121157), ctr[2], hi1, lo1);
+            ctr = {hi1^ctr[1]^k[0], lo1, hi0^ctr[3]^k[1], lo0};
+            k[0] += UINT64_C(0x9E3779B97F4A7C15);
+            k[1] += UINT64_C(0xBB67AE8584CAA73B);
+        }
+        return ctr;
+    }
+    static constexpr result_type min()
+    {
+        return 0;
+    }
+    static constexpr result_type max()
+    {
+        return std::numeric_limits<result_type>::max();
+    }
+    result_type operator()()
+    {
+        if (used == 4) {
+            output = generate(counter, key);
+            counter[0]++;
+            used = 0;
+        }
+        return output[used++];
+    }
+};
@@ -0,0 +1,116 @@
+#include "reweight.h"
+#include "simulator.h"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+std::vector<ReweightedRate> reweight(const BaseFrameSimulator &sim, std::function<bool(MeasurementResults&)> logical_error,
+    const std::vector<double> &scales)
+{
+    auto &counts = sim.get_fault_counts();
+    // Ranges of global shot indices of every group, to find the group of a shot
+    struct GroupRange
+    {
+        uint64_t first;
+        size_t count;
+        size_t group;
+    };
+    std::vector<GroupRange> ranges;
+    for (size_t g=0; g<counts.groups.size(); g++) {
+        for (auto &range : counts.groups[g].ids.get_ranges())
+            ranges.push_back(GroupRange{range.first, range.count, g});
+    }
+    std::sort(ranges.begin(), ranges.end(), [](const GroupRange &a, const GroupRange &b) {
+        return a.first < b.first;
+    });
+    auto group_of = [&](uint64_t shot) {
+        auto it = std::upper_bound(ranges.begin(), ranges.end(), shot, [](uint64_t shot, const GroupRange &range) {
+            return shot < range.first;
+        });
+        if (it == ranges.begin() || shot >= (it-1)->first+(it-1)->count) {
+            std::cerr<<"Shot "<<shot<<" has no recorded fault locations"<<std::endl;
+            abort();
+        }
+        return (it-1)->group;
+    };
+    // Flipped measurements of the kept shots
+    std::map<size_t, MeasurementResultsSparse> results;
+    sim.for_each_flip([&](size_t shot, int qubit, const MeasurementTag &tag) {
+        results[shot].results[qubit].insert(tag);
+    });
+    MeasurementResultsSparse no_flips;
+    bool fails_without_flips = logical_error(no_flips);
+    std::vector<uint64_t> failed;
+    std::vector<uint64_t> flipped;
+    for (auto &[shot, res] : results) {
+        uint64_t id = sim.get_shot_ids().global(shot);
+        flipped.push_back(id);
+        if (logical_error(res))
+            failed.push_back(id);
+    }
+    std::vector<ReweightedRate> rates;
+    size_t num_classes = counts.classes.size();
+    for (double scale : scales) {
+        // Log-ratios of a fault, and of a location without fault, for every class
+        std::vector<double> fault_ratio(num_classes), no_fault_ratio(num_classes);
+        for (size_t c=0; c<num_classes; c++) {
+            double p = counts.classes[c].second;
+            if (p <= 0 || p >= 1)
+                continue;
+            double q = std::min(p*scale, 1.0);
+            fault_ratio[c] = std::log(q/p);
+            no_fault_ratio[c] = std::log1p(-q)-std::log1p(-p);
+        }
+        std::vector<double> group_weight(counts.groups.size());
+        for (size_t g=0; g<counts.groups.size(); g++) {
+            auto &locations = counts.groups[g].locations;
+            double log_weight = 0;
+            for (size_t c=0; c<locations.size(); c++)
+                log_weight += locations[c]*no_fault_ratio[c];
+            group_weight[g] = log_weight;
+        }
+        auto weight = [&](uint64_t shot, size_t group) {
+            double log_weight = group_weight[group];
+            auto it = counts.shot_faults.find(shot);
+            if (it != counts.shot_faults.end()) {
+                for (size_t c=0; c<it->second.size(); c++)
+                    log_weight += it->second[c]*(fault_ratio[c]-no_fault_ratio[c]);
+            }
+            return std::exp(log_weight);
+        };
+        // Sums over all shots: shots without faults of a group share its weight
+        double sum = 0, sum_squares = 0, discarded = 0;
+        for (size_t g=0; g<counts.groups.size(); g++) {
+            auto &group = counts.groups[g];
+            double w0 = std::exp(group_weight[g]);
+            double group_sum = 0;
+            uint64_t faulty = 0;
+            for (auto &range : group.ids.get_ranges()) {
+                auto begin = counts.shot_faults.lower_bound(range.first);
+                auto end = counts.shot_faults.lower_bound(range.first+range.count);
+                for (auto it = begin; it != end; ++it) {
+                    double w = weight(it->first, g);
+                    group_sum += w;
+                    sum_squares += w*w;
+                    faulty++;
+                }
+            }
+            group_sum += (group.ids.size()-faulty)*w0;
+            sum_squares += (group.ids.size()-faulty)*w0*w0;
+            sum += group_sum;
+            if (group.discarded)
+                discarded += group_sum;
+        }
+        double failed_sum = 0;
+        if (fails_without_flips) {
+            // All kept shots fail except those with flips that don't
+            failed_sum = sum-discarded;
+            for (uint64_t shot : flipped)
+                failed_sum -= weight(shot, group_of(shot));
+        }
+        for (uint64_t shot : failed)
+            failed_sum += weight(shot, group_of(shot));
+        double total = counts.total_shots;
+        rates.push_back(ReweightedRate{scale, failed_sum/total, (sum-discarded)/total, sum_squares > 0 ? sum*sum/sum_squares : 0});
+    }
+    return rates;
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include "simulator_base.h"
+// Estimates of a run at other error rates, from the shots sampled at the reference rates
+// A shot with k_c faults in n_c fault locations of every channel class c has weight
+// prod_c (p'_c/p_c)^k_c ((1-p'_c)/(1-p_c))^(n_c-k_c) when the fault probability of the class changes from p_c to p'_c.
+// Estimates are accurate for rates close to the reference ones, as long as the effective number
+// of shots stays large
+struct ReweightedRate
+{
+    // Factor applied to the fault probabilities of all channels
+    double scale;
+    // Estimated fraction of shots with a logical error, and of shots not discarded by post-selection
+    double logical_error_rate;
+    double acceptance_rate;
+    // Effective number of shots of the weighted estimate, (sum w)^2/(sum w^2)
+    double effective_shots;
+};
+// Reweights the results of a simulator which has run a tree with enable_fault_counts(), for every
+// scale of the fault probabilities. logical_error() is evaluated on the flipped measurements of every shot
+std::vector<ReweightedRate> reweight(const BaseFrameSimulator &sim, std::function<bool(MeasurementResults&)> logical_error,
+    const std::vector<double> &scales);
@@ -0,0 +1,183 @@
+#include "sampling_pipeline.h"
+#include <iostream>
+#ifndef NO_THREADS
+// Number of samples drawn by a noise instruction: one per qubit or pair of qubits, or one for DEPOLARIZE
+static uint64_t num_samples(const InstructionRef &instruction)
+{
+    switch (instruction.type) {
+        case InstructionType::DEPOLARIZE:
+            return 1;
+        case InstructionType::DEPOLARIZE2:
+        case InstructionType::PAULI2:
+            return instruction.targets.size()/2;
+        default:
+            return instruction.targets.size();
+    }
+}
+// Simulator which only samples noise instructions, recording the flips instead of applying them
+class FaultRecorder final : public BaseFrameSimulator
+{
+    // Not used by the counter-based generator
+    std::mt19937_64 unused_rng;
+    std::vector<SampledFlip> *flips=nullptr;
+    public:
+    FaultRecorder() : BaseFrameSimulator(0, unused_rng) {}
+    void setup(const SamplingJob &job)
+    {
+        counter_rng = true;
+        counter_seed = job.seed;
+        circuit_index = job.circuit_index;
+        shot_ids = job.shot_ids;
+        num_shots = job.num_shots;
+    }
+    void record(const InstructionRef &instruction, uint64_t first_sample, std::vector<SampledFlip> &out)
+    {
+        sample_index = first_sample;
+        flips = &out;
+        BaseFrameSimulator::run(instruction);
+    }
+    void flip_error(size_t shot, int qubit, int type) override
+    {
+        flips->push_back({shot, qubit, type});
+    }
+    void h(int) override {}
+    void s(int) override {}
+    void sx(int) override {}
+    void sxx(int, int) override {}
+    void szz(int, int) override {}
+    void cx(int, int) override {}
+    void cz(int, int) override {}
+    void mx(int, MeasurementTag) override {}
+    void my(int, MeasurementTag) override {}
+    void mz(int, MeasurementTag) override {}
+    void rx(int) override {}
+    void ry(int) override {}
+    void rz(int) override {}
+    void clifford1(int, const CliffordTable &) override {}
+    void clifford2(int, int, const CliffordTable &) override {}
+    std::shared_ptr<CircuitNode> run_node(std::shared_ptr<CircuitNode>) override
+    {
+        return nullptr;
+    }
+    size_t duplicate_shot(size_t shot) override
+    {
+        return shot;
+    }
+    std::unique_ptr<BaseFrameSimulator> new_branch() override
+    {
+        return nullptr;
+    }
+    void merge_branch(BaseFrameSimulator &) override {}
+    void save_shots(StateWriter &) const override {}
+    void load_shots(StateReader &) override {}
+    size_t memory_usage() const override
+    {
+        return 0;
+    }
+    void for_each_flip(std::function<void(size_t, int, const MeasurementTag&)>) const override {}
+};
+SamplingPipeline::SamplingPipeline(int num_producers, size_t ring_size)
+{
+    for (int i=0; i<std::max(num_producers, 1); i++) {
+        rings.push_back(std::make_unique<Ring>());
+        rings.back()->slots.resize(ring_size);
+    }
+    for (int i=0; i<rings.size(); i++)
+        producers.emplace_back(&SamplingPipeline::produce, this, i);
+}
+SamplingPipeline::~SamplingPipeline()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    job_started.notify_all();
+    for (auto &thread : producers)
+        thread.join();
+}
+void SamplingPipeline::produce(int index)
+{
+    FaultRecorder recorder;
+    auto &ring = *rings[index];
+    uint64_t seen = 0;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            job_started.wait(lock, [&]() { return stop || generation != seen; });
+            if (stop)
+                return;
+            seen = generation;
+        }
+        // The job is not modified until all producers have finished it
+        recorder.setup(job);
+        for (size_t i=index; i<noise.size(); i+=rings.size()) {
+            size_t head = ring.head.load(std::memory_order_relaxed);
+            while (head-ring.tail.load(std::memory_order_acquire) >= ring.slots.size())
+                std::this_thread::yield();
+            auto &flips = ring.slots[head%ring.slots.size()];
+            flips.clear();
+            recorder.record(noise[i].first, noise[i].second, flips);
+            ring.head.store(head+1, std::memory_order_release);
+        }
+        busy.fetch_sub(1, std::memory_order_release);
+    }
+}
+void SamplingPipeline::start(const Circuit &circ, SamplingJob new_job)
+{
+    // Producers finish the previous circuit after writing its last flips, which have already been read
+    while (busy.load(std::memory_order_acquire) > 0)
+        std::this_thread::yield();
+    std::lock_guard<std::mutex> lock(mutex);
+    job = std::move(new_job);
+    noise.clear();
+    uint64_t samples = 0;
+    for (auto instruction : circ.instructions) {
+        if (is_noise(instruction.type)) {
+            noise.emplace_back(instruction, samples);
+            samples += num_samples(instruction);
+        }
+    }
+    next_instruction = 0;
+    busy = rings.size();
+    generation++;
+    job_started.notify_all();
+}
+const std::vector<SampledFlip> &SamplingPipeline::next()
+{
+    auto &ring = *rings[next_instruction%rings.size()];
+    size_t tail = ring.tail.load(std::memory_order_relaxed);
+    while (ring.head.load(std::memory_order_acquire) == tail)
+        std::this_thread::yield();
+    return ring.slots[tail%ring.slots.size()];
+}
+void SamplingPipeline::release()
+{
+    auto &ring = *rings[next_instruction++%rings.size()];
+    ring.tail.fetch_add(1, std::memory_order_release);
+}
+void BaseFrameSimulator::enable_pipelined_sampling(int num_producers)
+{
+    pipeline = std::make_shared<SamplingPipeline>(num_producers);
+}
+void BaseFrameSimulator::run_pipelined(const Circuit &circ)
+{
+    begin_circuit();
+    pipeline->start(circ, {counter_seed, circuit_index, shot_ids, num_shots});
+    for (auto instruction : circ.instructions) {
+        if (!is_noise(instruction.type)) {
+            run(instruction);
+            continue;
+        }
+        current_instruction = instruction.type;
+        for (auto &flip : pipeline->next())
+            flip_error(flip.shot, flip.qubit, flip.type);
+        pipeline->release();
+        sample_index += num_samples(instruction);
+    }
+}
+#else
+void BaseFrameSimulator::enable_pipelined_sampling(int)
+{
+    std::cerr<<"Pipelined sampling requires a build with FRAMESIM_THREADS, faults are drawn by the simulator thread"<<std::endl;
+}
+#endif
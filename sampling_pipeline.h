@@ -0,0 +1,61 @@
+#pragma once
+#include "simulator_base.h"
+#ifndef NO_THREADS
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+// Frame flip made by a sampled fault
+struct SampledFlip
+{
+    size_t shot;
+    int qubit;
+    int type;
+};
+// State which determines the faults drawn in a circuit by the counter-based generator
+struct SamplingJob
+{
+    uint64_t seed;
+    uint64_t circuit_index;
+    ShotIds shot_ids;
+    size_t num_shots;
+};
+// Producer threads drawing the faults of the noise instructions of a circuit, while the simulator
+// propagates the frames. Noise instructions are assigned to the producers in turns, and every producer
+// writes the flips of its instructions to a ring buffer, which the simulator reads in program order.
+// With the counter-based generator, the faults of an instruction only depend on its position in the
+// circuit, so they are the same as those the simulator would draw itself
+class SamplingPipeline
+{
+    // Buffer of a producer, with a single writer and a single reader
+    struct Ring
+    {
+        std::vector<std::vector<SampledFlip>> slots;
+        // Number of batches written and read, only increased
+        alignas(64) std::atomic<size_t> head{0};
+        alignas(64) std::atomic<size_t> tail{0};
+    };
+    std::vector<std::unique_ptr<Ring>> rings;
+    std::vector<std::thread> producers;
+    // Noise instructions of the circuit being run, and index of their first sample
+    std::vector<std::pair<InstructionRef, uint64_t>> noise;
+    SamplingJob job;
+    // Next instruction to be read by the simulator
+    size_t next_instruction=0;
+    std::mutex mutex;
+    std::condition_variable job_started;
+    uint64_t generation=0;
+    bool stop=false;
+    // Producers which haven't finished the current circuit
+    std::atomic<int> busy{0};
+    void produce(int index);
+    public:
+    SamplingPipeline(int num_producers, size_t ring_size=64);
+    ~SamplingPipeline();
+    // Starts drawing the faults of a circuit, which must be kept until they have been read
+    void start(const Circuit &circ, SamplingJob job);
+    // Flips of the next noise instruction, valid until release() is called
+    const std::vector<SampledFlip> &next();
+    void release();
+};
+#endif
@@ -0,0 +1,546 @@
+#include "serialize.h"
+#include "parser.h"
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+// File layout, all values little endian (converted on big-endian hosts):
+//   header: "FSIMTREE", u32 version, u32 reserved
+//   u64 number of circuits, followed by the circuits
+//   u64 number of nodes, followed by the nodes
+// Instruction records, targets and parameters are stored as aligned arrays, so that a
+// circuit is loaded with a few bulk copies
+static const char FILE_MAGIC[8] = {'F','S','I','M','T','R','E','E'};
+static const uint32_t FILE_VERSION = 2;
+// Instruction record inside a serialized circuit
+struct InstructionRecord
+{
+    uint32_t type;
+    uint32_t num_targets;
+    uint32_t num_p;
+    int32_t tag;
+    int32_t label;
+};
+enum struct CallbackKind : uint8_t
+{
+    NONE,
+    NAMED,
+    MERGED,
+};
+void CallbackRegistry::set_next_node_index(CircuitNode &node, const std::string &name) const
+{
+    auto it = next_node_functions.find(name);
+    if (it == next_node_functions.end()) {
+        std::cerr<<"Unknown next_node_index callback "<<name<<std::endl;
+        abort();
+    }
+    node.next_node_index = it->second;
+    node.next_node_index_source = {name, nullptr, nullptr};
+}
+void CallbackRegistry::set_error_corrections(CircuitNode &node, const std::string &name) const
+{
+    auto it = correction_functions.find(name);
+    if (it == correction_functions.end()) {
+        std::cerr<<"Unknown error_corrections callback "<<name<<std::endl;
+        abort();
+    }
+    node.error_corrections = it->second;
+    node.error_corrections_source = {name, nullptr, nullptr};
+}
+// Values are stored little endian, so files can be read on hosts of any byte order
+template<typename T>
+static T little_endian(T value)
+{
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+    char bytes[sizeof(T)];
+    memcpy(bytes, &value, sizeof(T));
+    std::reverse(bytes, bytes+sizeof(T));
+    memcpy(&value, bytes, sizeof(T));
+#endif
+    return value;
+}
+static InstructionRecord little_endian(InstructionRecord record)
+{
+    record.type = little_endian(record.type);
+    record.num_targets = little_endian(record.num_targets);
+    record.num_p = little_endian(record.num_p);
+    record.tag = little_endian(record.tag);
+    record.label = little_endian(record.label);
+    return record;
+}
+class BinaryWriter
+{
+    public:
+    std::string data;
+    template<typename T>
+    void put(T value)
+    {
+        value = little_endian(value);
+        data.append((const char*)&value, sizeof(T));
+    }
+    template<typename T>
+    void put_array(const T *values, size_t count)
+    {
+        align();
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        data.append((const char*)values, count*sizeof(T));
+#else
+        for (size_t i=0; i<count; i++) {
+            T value = little_endian(values[i]);
+            data.append((const char*)&value, sizeof(T));
+        }
+#endif
+    }
+    void put_string(const std::string &str)
+    {
+        put<uint32_t>(str.size());
+        data.append(str);
+    }
+    void align()
+    {
+        data.resize((data.size()+7) & ~(size_t)7, '\0');
+    }
+    void put_syndrome(const SyndromeMeasurements &syndrome)
+    {
+        put<uint32_t>(syndrome.syndrome.size());
+        for (auto &ref : syndrome.syndrome) {
+            put<int32_t>(ref.qubit);
+            put<int32_t>(ref.tag.current_round);
+            put_string(ref.tag.name);
+        }
+    }
+    void put_qubits(const std::vector<int> &qubits)
+    {
+        put<uint32_t>(qubits.size());
+        for (int q : qubits)
+            put<int32_t>(q);
+    }
+    void put_correction(const CorrectionTable::Correction &correction)
+    {
+        put_qubits(correction.x);
+        put_qubits(correction.z);
+    }
+};
+class BinaryReader
+{
+    const char *pos;
+    const char *begin;
+    const char *end;
+    public:
+    BinaryReader(std::string_view data) : pos(data.data()), begin(data.data()), end(data.data()+data.size()) {}
+    void check(size_t size)
+    {
+        if ((size_t)(end-pos) < size) {
+            std::cerr<<"Truncated circuit tree file"<<std::endl;
+            abort();
+        }
+    }
+    template<typename T>
+    T get()
+    {
+        T value;
+        check(sizeof(T));
+        memcpy(&value, pos, sizeof(T));
+        pos += sizeof(T);
+        return little_endian(value);
+    }
+    template<typename T>
+    void get_array(std::vector<T> &values, size_t count)
+    {
+        align();
+        check(count*sizeof(T));
+        values.resize(count);
+        memcpy(values.data(), pos, count*sizeof(T));
+        pos += count*sizeof(T);
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+        for (auto &value : values)
+            value = little_endian(value);
+#endif
+    }
+    std::string get_string()
+    {
+        uint32_t size = get<uint32_t>();
+        check(size);
+        std::string str(pos, size);
+        pos += size;
+        return str;
+    }
+    void get_bytes(char *dst, size_t size)
+    {
+        check(size);
+        memcpy(dst, pos, size);
+        pos += size;
+    }
+    void align()
+    {
+        size_t offset = pos-begin;
+        size_t aligned = (offset+7) & ~(size_t)7;
+        check(aligned-offset);
+        pos = begin+aligned;
+    }
+    void get_syndrome(SyndromeMeasurements &syndrome)
+    {
+        uint32_t size = get<uint32_t>();
+        syndrome.syndrome.resize(size);
+        for (auto &ref : syndrome.syndrome) {
+            ref.qubit = get<int32_t>();
+            ref.tag.current_round = get<int32_t>();
+            ref.tag.name = get_string();
+        }
+        syndrome.check_size();
+    }
+    std::vector<int> get_qubits()
+    {
+        std::vector<int> qubits(get<uint32_t>());
+        for (int &q : qubits)
+            q = get<int32_t>();
+        return qubits;
+    }
+    CorrectionTable::Correction get_correction()
+    {
+        CorrectionTable::Correction correction;
+        correction.x = get_qubits();
+        correction.z = get_qubits();
+        return correction;
+    }
+};
+static void write_circuit(BinaryWriter &out, const Circuit &circ)
+{
+    std::vector<InstructionRecord> records;
+    std::vector<int32_t> targets;
+    std::vector<double> params;
+    std::vector<const MeasurementTag*> tags;
+    std::vector<const std::string*> labels;
+    records.reserve(circ.instructions.size());
+    for (auto inst : circ.instructions) {
+        InstructionRecord rec;
+        rec.type = (uint32_t)inst.type;
+        rec.num_targets = inst.targets.size();
+        rec.num_p = inst.p.size();
+        rec.tag = -1;
+        rec.label = -1;
+        if (inst.measurement_tag) {
+            rec.tag = tags.size();
+            tags.push_back(inst.measurement_tag);
+        }
+        if (inst.label) {
+            rec.label = labels.size();
+            labels.push_back(inst.label);
+        }
+        records.push_back(rec);
+        targets.insert(targets.end(), inst.targets.begin(), inst.targets.end());
+        params.insert(params.end(), inst.p.begin(), inst.p.end());
+    }
+    out.put<uint32_t>(circ.num_qubits);
+    out.put<uint64_t>(records.size());
+    out.put<uint64_t>(targets.size());
+    out.put<uint64_t>(params.size());
+    out.put_array(records.data(), records.size());
+    out.put_array(targets.data(), targets.size());
+    out.put_array(params.data(), params.size());
+    out.put<uint64_t>(tags.size());
+    for (auto *tag : tags) {
+        out.put<int32_t>(tag->current_round);
+        out.put_string(tag->name);
+    }
+    out.put<uint64_t>(labels.size());
+    for (auto *label : labels)
+        out.put_string(*label);
+}
+static Circuit read_circuit(BinaryReader &in)
+{
+    Circuit circ;
+    int num_qubits = in.get<uint32_t>();
+    uint64_t num_instructions = in.get<uint64_t>();
+    uint64_t num_targets = in.get<uint64_t>();
+    uint64_t num_params = in.get<uint64_t>();
+    std::vector<InstructionRecord> records;
+    std::vector<int32_t> targets;
+    std::vector<double> params;
+    in.get_array(records, num_instructions);
+    in.get_array(targets, num_targets);
+    in.get_array(params, num_params);
+    std::vector<MeasurementTag> tags(in.get<uint64_t>());
+    for (auto &tag : tags) {
+        tag.current_round = in.get<int32_t>();
+        tag.name = in.get_string();
+    }
+    std::vector<std::string> labels(in.get<uint64_t>());
+    for (auto &label : labels)
+        label = in.get_string();
+    circ.instructions.reserve(num_instructions, num_targets);
+    size_t target_offset = 0;
+    size_t p_offset = 0;
+    for (auto &rec : records) {
+        if (rec.type >= NUM_INSTRUCTION_TYPES || target_offset+rec.num_targets > num_targets || p_offset+rec.num_p > num_params
+            || rec.tag >= (int64_t)tags.size() || rec.label >= (int64_t)labels.size()) {
+            std::cerr<<"Corrupt circuit in tree file"<<std::endl;
+            abort();
+        }
+        circ.append((InstructionType)rec.type, Span<int>(targets.data()+target_offset, rec.num_targets), Span<double>(params.data()+p_offset, rec.num_p),
+            rec.tag < 0 ? nullptr : &tags[rec.tag], rec.label < 0 ? nullptr : &labels[rec.label]);
+        target_offset += rec.num_targets;
+        p_offset += rec.num_p;
+    }
+    // Keep the declared qubit count, which can include idle qubits
+    circ.num_qubits = num_qubits;
+    return circ;
+}
+static void write_branch_condition(BinaryWriter &out, const BranchCondition &cond)
+{
+    out.put_syndrome(cond);
+    out.put<int32_t>(cond.default_branch);
+    out.put<uint32_t>(cond.rules.size());
+    for (auto &rule : cond.rules) {
+        out.put<uint8_t>((uint8_t)rule.type);
+        out.put<uint64_t>(rule.mask);
+        out.put<uint64_t>(rule.value);
+        out.put<int32_t>(rule.branch);
+    }
+    // Sorted, so that equal trees produce equal files
+    std::vector<std::pair<uint64_t,int>> entries(cond.table.begin(), cond.table.end());
+    std::sort(entries.begin(), entries.end());
+    out.put<uint32_t>(entries.size());
+    for (auto &entry : entries) {
+        out.put<uint64_t>(entry.first);
+        out.put<int32_t>(entry.second);
+    }
+}
+static BranchCondition read_branch_condition(BinaryReader &in)
+{
+    BranchCondition cond;
+    in.get_syndrome(cond);
+    cond.default_branch = in.get<int32_t>();
+    cond.rules.resize(in.get<uint32_t>());
+    for (auto &rule : cond.rules) {
+        rule.type = (BranchCondition::Rule::Type)in.get<uint8_t>();
+        rule.mask = in.get<uint64_t>();
+        rule.value = in.get<uint64_t>();
+        rule.branch = in.get<int32_t>();
+    }
+    uint32_t num_entries = in.get<uint32_t>();
+    for (uint32_t i=0; i<num_entries; i++) {
+        uint64_t syndrome_value = in.get<uint64_t>();
+        cond.table[syndrome_value] = in.get<int32_t>();
+    }
+    return cond;
+}
+static void write_correction_table(BinaryWriter &out, const CorrectionTable &table)
+{
+    out.put_syndrome(table);
+    out.put<uint32_t>(table.parity_rules.size());
+    for (auto &rule : table.parity_rules) {
+        out.put<uint64_t>(rule.mask);
+        out.put_correction(rule.correction);
+    }
+    std::vector<uint64_t> keys;
+    for (auto &entry : table.table)
+        keys.push_back(entry.first);
+    std::sort(keys.begin(), keys.end());
+    out.put<uint32_t>(keys.size());
+    for (uint64_t key : keys) {
+        out.put<uint64_t>(key);
+        out.put_correction(table.table.at(key));
+    }
+}
+static CorrectionTable read_correction_table(BinaryReader &in)
+{
+    CorrectionTable table;
+    in.get_syndrome(table);
+    table.parity_rules.resize(in.get<uint32_t>());
+    for (auto &rule : table.parity_rules) {
+        rule.mask = in.get<uint64_t>();
+        rule.correction = in.get_correction();
+    }
+    uint32_t num_entries = in.get<uint32_t>();
+    for (uint32_t i=0; i<num_entries; i++) {
+        uint64_t syndrome_value = in.get<uint64_t>();
+        table.table[syndrome_value] = in.get_correction();
+    }
+    return table;
+}
+static void write_callback_source(BinaryWriter &out, const CircuitNode::CallbackSource &source, bool has_function, std::map<const CircuitNode*, int> &indices, const CircuitNode &node)
+{
+    if (!has_function) {
+        out.put<uint8_t>((uint8_t)CallbackKind::NONE);
+    } else if (source.nodea != nullptr) {
+        out.put<uint8_t>((uint8_t)CallbackKind::MERGED);
+        out.put<int32_t>(indices.at(source.nodea.get()));
+        out.put<int32_t>(indices.at(source.nodeb.get()));
+    } else if (!source.name.empty()) {
+        out.put<uint8_t>((uint8_t)CallbackKind::NAMED);
+        out.put_string(source.name);
+    } else {
+        std::cerr<<"Node "<<node.name<<" has a callback that is not in a CallbackRegistry and can't be serialized"<<std::endl;
+        abort();
+    }
+}
+std::string serialize_tree(std::shared_ptr<CircuitNode> root)
+{
+    // Number the nodes reachable through childs and merged callbacks, root first
+    std::vector<CircuitNode*> nodes;
+    std::map<const CircuitNode*, int> indices;
+    std::vector<CircuitNode*> pending = {root.get()};
+    indices[root.get()] = 0;
+    nodes.push_back(root.get());
+    auto visit = [&](CircuitNode *node) {
+        if (node != nullptr && indices.emplace(node, nodes.size()).second) {
+            nodes.push_back(node);
+            pending.push_back(node);
+        }
+    };
+    while (!pending.empty()) {
+        CircuitNode *node = pending.back();
+        pending.pop_back();
+        for (size_t i=0; i<node->childs.size(); i++)
+            visit(node->get_child(i).get());
+        for (auto *source : {&node->next_node_index_source, &node->error_corrections_source}) {
+            visit(source->nodea.get());
+            visit(source->nodeb.get());
+        }
+    }
+    // Store every distinct circuit once
+    std::unordered_multimap<uint64_t, int> circuit_indices;
+    std::vector<const Circuit*> circuits;
+    std::vector<int> node_circuits;
+    std::map<const Circuit*, int> shared_circuits;
+    for (auto *node : nodes) {
+        // Nodes sharing the same circuit handle don't need to be compared
+        auto shared = shared_circuits.find(&*node->circuit);
+        if (shared != shared_circuits.end()) {
+            node_circuits.push_back(shared->second);
+            continue;
+        }
+        uint64_t hash = circuit_hash(*node->circuit);
+        int index = -1;
+        auto range = circuit_indices.equal_range(hash);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (*circuits[it->second] == *node->circuit) {
+                index = it->second;
+                break;
+            }
+        }
+        if (index < 0) {
+            index = circuits.size();
+            circuits.push_back(&*node->circuit);
+            circuit_indices.emplace(hash, index);
+        }
+        shared_circuits[&*node->circuit] = index;
+        node_circuits.push_back(index);
+    }
+    BinaryWriter out;
+    out.data.append(FILE_MAGIC, sizeof(FILE_MAGIC));
+    out.put<uint32_t>(FILE_VERSION);
+    out.put<uint32_t>(0);
+    out.put<uint64_t>(circuits.size());
+    for (auto *circ : circuits)
+        write_circuit(out, *circ);
+    out.put<uint64_t>(nodes.size());
+    for (int i=0; i<nodes.size(); i++) {
+        CircuitNode &node = *nodes[i];
+        out.put_string(node.name);
+        out.put<uint32_t>(node_circuits[i]);
+        out.put<uint32_t>(node.childs.size());
+        // Merged nodes only hold some successors in childs, the others are found by get_child()
+        for (size_t j=0; j<node.childs.size(); j++) {
+            auto child = node.get_child(j);
+            out.put<int32_t>(child == nullptr ? -1 : indices[child.get()]);
+        }
+        write_callback_source(out, node.next_node_index_source, (bool)node.next_node_index, indices, node);
+        write_callback_source(out, node.error_corrections_source, (bool)node.error_corrections, indices, node);
+        out.put<uint8_t>(node.branch_condition.has_value());
+        if (node.branch_condition)
+            write_branch_condition(out, *node.branch_condition);
+        out.put<uint8_t>(node.pure_callbacks);
+        out.put<uint32_t>(node.correction_tables.size());
+        for (auto &table : node.correction_tables)
+            write_correction_table(out, table);
+    }
+    return std::move(out.data);
+}
+std::shared_ptr<CircuitNode> deserialize_tree(std::string_view data, const CallbackRegistry &registry)
+{
+    BinaryReader in(data);
+    char magic[sizeof(FILE_MAGIC)];
+    in.get_bytes(magic, sizeof(magic));
+    uint32_t version = in.get<uint32_t>();
+    if (memcmp(magic, FILE_MAGIC, sizeof(magic)) != 0 || version < 1 || version > FILE_VERSION) {
+        std::cerr<<"Not a circuit tree file, or unsupported version"<<std::endl;
+        abort();
+    }
+    in.get<uint32_t>();
+    // Nodes with the same circuit share it
+    std::vector<SharedCircuit> circuits(in.get<uint64_t>());
+    for (auto &circ : circuits)
+        circ = read_circuit(in);
+    uint64_t num_nodes = in.get<uint64_t>();
+    if (num_nodes == 0) {
+        std::cerr<<"Empty circuit tree file"<<std::endl;
+        abort();
+    }
+    std::vector<std::shared_ptr<CircuitNode>> nodes(num_nodes);
+    for (auto &node : nodes)
+        node = std::make_shared<CircuitNode>("");
+    auto get_node = [&](int32_t index) -> std::shared_ptr<CircuitNode> {
+        if (index < 0)
+            return nullptr;
+        if (index >= (int64_t)nodes.size()) {
+            std::cerr<<"Corrupt node reference in tree file"<<std::endl;
+            abort();
+        }
+        return nodes[index];
+    };
+    for (auto &node : nodes) {
+        node->name = in.get_string();
+        uint32_t circ = in.get<uint32_t>();
+        if (circ >= circuits.size()) {
+            std::cerr<<"Corrupt circuit reference in tree file"<<std::endl;
+            abort();
+        }
+        node->circuit = circuits[circ];
+        node->childs.resize(in.get<uint32_t>());
+        for (auto &child : node->childs)
+            child = get_node(in.get<int32_t>());
+        auto kind = (CallbackKind)in.get<uint8_t>();
+        if (kind == CallbackKind::NAMED) {
+            registry.set_next_node_index(*node, in.get_string());
+        } else if (kind == CallbackKind::MERGED) {
+            auto nodea = get_node(in.get<int32_t>());
+            auto nodeb = get_node(in.get<int32_t>());
+            node->next_node_index = merged_next_node_index(nodea, nodeb);
+            node->next_node_index_source = {"", nodea, nodeb};
+        }
+        kind = (CallbackKind)in.get<uint8_t>();
+        if (kind == CallbackKind::NAMED) {
+            registry.set_error_corrections(*node, in.get_string());
+        } else if (kind == CallbackKind::MERGED) {
+            auto nodea = get_node(in.get<int32_t>());
+            auto nodeb = get_node(in.get<int32_t>());
+            node->error_corrections = merged_error_corrections(nodea, nodeb);
+            node->error_corrections_source = {"", nodea, nodeb};
+        }
+        if (in.get<uint8_t>())
+            node->branch_condition = read_branch_condition(in);
+        if (version >= 2)
+            node->pure_callbacks = in.get<uint8_t>();
+        node->correction_tables.resize(in.get<uint32_t>());
+        for (auto &table : node->correction_tables)
+            table = read_correction_table(in);
+    }
+    return nodes[0];
+}
+void save_tree(std::shared_ptr<CircuitNode> root, const std::string &path)
+{
+    std::string data = serialize_tree(root);
+    std::ofstream file(path, std::ios::binary);
+    file.write(data.data(), data.size());
+    if (!file) {
+        std::cerr<<"Cannot write "<<path<<std::endl;
+        abort();
+    }
+}
+std::shared_ptr<CircuitNode> load_tree(const std::string &path, const CallbackRegistry &registry)
+{
+    MappedFile file(path);
+    return deserialize_tree(file.view(), registry);
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include "circuit.h"
+#include <string>
+#include <string_view>
+// Named callbacks that can be assigned to circuit nodes
+// std::function members can't be saved, so serialized trees refer to their callbacks by name,
+// and the same registry has to be provided when loading the tree
+class CallbackRegistry
+{
+    public:
+    typedef std::function<int(MeasurementResults&)> NextNodeFunction;
+    typedef std::function<std::pair<std::set<int>,std::set<int>>(MeasurementResults&)> CorrectionFunction;
+    private:
+    std::map<std::string, NextNodeFunction> next_node_functions;
+    std::map<std::string, CorrectionFunction> correction_functions;
+    public:
+    void register_next_node_index(const std::string &name, NextNodeFunction function)
+    {
+        next_node_functions[name] = function;
+    }
+    void register_error_corrections(const std::string &name, CorrectionFunction function)
+    {
+        correction_functions[name] = function;
+    }
+    // Assigns a registered callback to the node. Aborts if the name was not registered
+    void set_next_node_index(CircuitNode &node, const std::string &name) const;
+    void set_error_corrections(CircuitNode &node, const std::string &name) const;
+};
+// Binary serialization of circuit node graphs
+// Every node is stored once, so shared subtrees and loops are preserved,
+// and identical circuits are stored once. Node callbacks must either come from
+// a CallbackRegistry or be created by merge_nodes() from nodes that can be serialized
+// The root node is the first node in the file
+std::string serialize_tree(std::shared_ptr<CircuitNode> root);
+std::shared_ptr<CircuitNode> deserialize_tree(std::string_view data, const CallbackRegistry &registry);
+void save_tree(std::shared_ptr<CircuitNode> root, const std::string &path);
+// Loads a tree from a memory-mapped file
+std::shared_ptr<CircuitNode> load_tree(const std::string &path, const CallbackRegistry &registry);
@@ -0,0 +1,117 @@
+// Round trips of circuit trees through the binary format
+#include "serialize.h"
+#include <iostream>
+static int failures = 0;
+static void check(bool ok, const std::string &name)
+{
+    std::cout<<(ok ? "ok   " : "FAIL ")<<name<<std::endl;
+    if (!ok)
+        failures++;
+}
+// Whether both graphs have the same shape, names and circuits, with shared successors and loops in the same places
+static bool same_graph(std::shared_ptr<CircuitNode> a, std::shared_ptr<CircuitNode> b)
+{
+    std::map<CircuitNode*, CircuitNode*> matched;
+    std::vector<std::pair<std::shared_ptr<CircuitNode>, std::shared_ptr<CircuitNode>>> pending = {{a, b}};
+    while (!pending.empty()) {
+        auto [x, y] = pending.back();
+        pending.pop_back();
+        if ((x == nullptr) != (y == nullptr))
+            return false;
+        if (x == nullptr)
+            continue;
+        auto [it, inserted] = matched.emplace(x.get(), y.get());
+        if (!inserted) {
+            if (it->second != y.get())
+                return false;
+            continue;
+        }
+        if (x->name != y->name || !(*x->circuit == *y->circuit) || x->childs.size() != y->childs.size())
+            return false;
+        if ((bool)x->next_node_index != (bool)y->next_node_index)
+            return false;
+        for (size_t i=0; i<x->childs.size(); i++)
+            pending.push_back({x->get_child(i), y->get_child(i)});
+    }
+    return true;
+}
+// Node which repeats its measurement while it is flipped
+static std::shared_ptr<CircuitNode> repeat_until_trivial(const std::string &name, int qubit, const CallbackRegistry &registry)
+{
+    auto node = std::make_shared<CircuitNode>(name);
+    node->circuit.append(Instruction(InstructionType::RZ, {qubit}));
+    node->circuit.append(Instruction(InstructionType::X_ERROR, {qubit}, 0.1));
+    node->circuit.append(Instruction(InstructionType::MZ, {qubit}, {}, MeasurementTag{0, name}));
+    node->childs = {nullptr, node};
+    registry.set_next_node_index(*node, name);
+    return node;
+}
+// Tree with every kind of node data: parameters, tags and labels, a circuit shared by two nodes,
+// declarative branches and corrections, and named callbacks
+static std::shared_ptr<CircuitNode> full_tree(const CallbackRegistry &registry)
+{
+    auto root = std::make_shared<CircuitNode>("root");
+    auto left = std::make_shared<CircuitNode>("left");
+    auto right = std::make_shared<CircuitNode>("right");
+    root->circuit.append(Instruction(InstructionType::RZ, {0, 1, 2}));
+    root->circuit.append(Instruction(InstructionType::CX, {0, 1, 2, 1}));
+    root->circuit.append(Instruction(InstructionType::PAULI1, {0}, {0.001, 0.002, 0.25}));
+    root->circuit.append(Instruction(InstructionType::DELAY, {2}, {1.5e-6}, std::nullopt, std::string("idle")));
+    root->circuit.append(Instruction(InstructionType::TICK, {}));
+    root->circuit.append(Instruction(InstructionType::MZ, {1}, {}, MeasurementTag{-3, "syndrome"}));
+    BranchCondition condition({{1, MeasurementTag{-3, "syndrome"}}}, 1);
+    condition.add_parity_rule(1, 0);
+    condition.add_comparison(1, 0, -1);
+    condition.add_entry(1, 0);
+    root->branch_condition = condition;
+    root->childs = {left, right};
+    left->circuit.append(Instruction(InstructionType::SZZ, {0, 1, 2}));
+    left->circuit.append(Instruction(InstructionType::MX, {0}, {}, MeasurementTag{0, "x"}));
+    CorrectionTable table({{0, MeasurementTag{0, "x"}}, {1, MeasurementTag{-3, "syndrome"}}});
+    table.add_entry(3, {0}, {1, 2});
+    table.add_parity_rule(2, {}, {0});
+    left->correction_tables.push_back(table);
+    left->pure_callbacks = true;
+    registry.set_error_corrections(*left, "flip");
+    left->childs = {right};
+    right->circuit = left->circuit;
+    registry.set_next_node_index(*right, "a");
+    right->childs = {nullptr, nullptr};
+    return root;
+}
+int main()
+{
+    CallbackRegistry registry;
+    for (auto [name, qubit] : {std::make_pair("a", 0), std::make_pair("b", 1)}) {
+        registry.register_next_node_index(name, [name = std::string(name), qubit = qubit](MeasurementResults &res) {
+            return res.is_flipped(qubit, MeasurementTag{0, name}) ? 1 : 0;
+        });
+    }
+    registry.register_error_corrections("flip", [](MeasurementResults &res) {
+        std::pair<std::set<int>, std::set<int>> corrections;
+        if (res.is_flipped(0, MeasurementTag{0, "x"}))
+            corrections.second.insert(0);
+        return corrections;
+    });
+    {
+        auto tree = full_tree(registry);
+        auto data = serialize_tree(tree);
+        auto loaded = deserialize_tree(data, registry);
+        check(same_graph(tree, loaded), "tree with every kind of node data");
+        check(serialize_tree(loaded) == data, "tree saved again after loading");
+        check(loaded->get_child(0)->get_child(0)->circuit.share() == loaded->get_child(1)->circuit.share(), "shared circuits");
+        // Version 2, little endian
+        check(data.substr(8, 4) == std::string("\x02\0\0\0", 4), "file header");
+    }
+    auto a = repeat_until_trivial("a", 0, registry);
+    auto b = repeat_until_trivial("b", 1, registry);
+    {
+        auto merged = merge_nodes(a, b);
+        auto loaded = deserialize_tree(serialize_tree(merged), registry);
+        check(same_graph(merged, loaded), "merged tree with loops");
+    }
+    // Loops of the original trees are broken, so that they can be freed
+    a->childs.clear();
+    b->childs.clear();
+    return failures > 0;
+}
@@ -0,0 +1,279 @@
+#include "shard.h"
+#include "analysis.h"
+#include "checkpoint.h"
+#include "driver.h"
+#include "nonsparsesim.h"
+#include "simulator.h"
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <queue>
+// File layout:
+//   header: "FSIMRSLT", u32 version
+//   shots, kept shots, flipped shots
+//   number of flipped measurements, followed by the qubit, tag and count of each one
+//   number of nodes, followed by the name and visits of each one
+//   records flag, number of records, followed by the records in increasing shot order:
+//   shot (as the difference from the previous one), number of flips, qubit and tag of each flip
+// Integers and tags are written by StateWriter
+static const char FILE_MAGIC[8] = {'F','S','I','M','R','S','L','T'};
+static const uint32_t FILE_VERSION = 1;
+void ShardResults::merge(const ShardResults &o)
+{
+    // Records are kept if all merged results have them
+    records = shots == 0 ? o.records : records && o.records;
+    shots += o.shots;
+    kept_shots += o.kept_shots;
+    flipped_shots += o.flipped_shots;
+    for (auto &[measurement, count] : o.flips)
+        flips[measurement] += count;
+    if (node_visits.empty()) {
+        node_visits = o.node_visits;
+    } else if (!o.node_visits.empty()) {
+        if (node_visits.size() != o.node_visits.size()) {
+            std::cerr<<"Merging results of different trees"<<std::endl;
+            abort();
+        }
+        for (size_t i=0; i<node_visits.size(); i++)
+            node_visits[i].second += o.node_visits[i].second;
+    }
+    if (!records) {
+        shot_records.clear();
+        return;
+    }
+    for (auto &[shot, refs] : o.shot_records) {
+        if (!shot_records.emplace(shot, refs).second) {
+            std::cerr<<"Shot "<<shot<<" appears in more than one result"<<std::endl;
+            abort();
+        }
+    }
+}
+ShardResults run_shard(std::shared_ptr<CircuitNode> root, const ShardOptions &options)
+{
+    if (options.shard < 0 || options.shard >= options.num_shards) {
+        std::cerr<<"Invalid shard "<<options.shard<<" of "<<options.num_shards<<std::endl;
+        abort();
+    }
+    auto shard_begin = [&](int shard) {
+        return (uint64_t)((unsigned __int128)options.total_shots*shard/options.num_shards);
+    };
+    uint64_t begin = shard_begin(options.shard);
+    uint64_t end = shard_begin(options.shard+1);
+    ShardResults results;
+    results.shots = end-begin;
+    results.records = options.records;
+    auto nodes = reachable_nodes(root);
+    std::map<const CircuitNode*, size_t> node_index;
+    for (auto &node : nodes) {
+        node_index[node.get()] = results.node_visits.size();
+        results.node_visits.emplace_back(node->name, 0);
+    }
+    // Only used by the randomization of the dense simulator
+    std::seed_seq seq{options.seed, (uint64_t)options.shard};
+    std::mt19937_64 rng(seq);
+    auto make_simulator = [&](size_t num_shots, uint64_t first_shot) {
+        std::unique_ptr<BaseFrameSimulator> sim;
+        if (options.dense)
+            sim = std::make_unique<DenseFrameSimulator>(num_shots, rng);
+        else
+            sim = std::make_unique<FrameSimulator>(num_shots, rng);
+        sim->use_counter_rng(options.seed, begin+first_shot);
+        sim->enable_node_visits();
+        return sim;
+    };
+    run_chunked(root, end-begin, options.memory_budget, make_simulator, [&](BaseFrameSimulator &sim, uint64_t) {
+        results.kept_shots += sim.get_num_shots();
+        for (auto &[node, visits] : sim.get_node_visits())
+            results.node_visits[node_index[node]].second += visits;
+        std::vector<bool> flipped(sim.get_num_shots());
+        auto &ids = sim.get_shot_ids();
+        sim.for_each_flip([&](size_t shot, int qubit, const MeasurementTag &tag) {
+            results.flips[{qubit, tag}]++;
+            results.flipped_shots += !flipped[shot];
+            flipped[shot] = true;
+            if (options.records)
+                results.shot_records[ids.global(shot)].push_back({qubit, tag});
+        });
+    });
+    return results;
+}
+static void write_counts(StateWriter &w, const ShardResults &results, uint64_t num_records)
+{
+    w.put(results.shots);
+    w.put(results.kept_shots);
+    w.put(results.flipped_shots);
+    w.put(results.flips.size());
+    for (auto &[measurement, count] : results.flips) {
+        w.put_signed(measurement.first);
+        w.put_tag(measurement.second);
+        w.put(count);
+    }
+    w.put(results.node_visits.size());
+    for (auto &[name, visits] : results.node_visits) {
+        w.put_string(name);
+        w.put(visits);
+    }
+    w.put(results.records);
+    w.put(num_records);
+}
+// Reads everything but the records, and returns their number
+static uint64_t read_counts(StateReader &r, ShardResults &results)
+{
+    results.shots = r.get();
+    results.kept_shots = r.get();
+    results.flipped_shots = r.get();
+    size_t num_flips = r.get();
+    for (size_t i=0; i<num_flips; i++) {
+        int qubit = r.get_signed();
+        auto tag = r.get_tag();
+        results.flips[{qubit, tag}] = r.get();
+    }
+    results.node_visits.resize(r.get());
+    for (auto &[name, visits] : results.node_visits) {
+        name = r.get_string();
+        visits = r.get();
+    }
+    results.records = r.get();
+    return r.get();
+}
+static void write_record(StateWriter &w, uint64_t shot, uint64_t &last_shot, const std::vector<MeasurementRef> &refs)
+{
+    w.put(shot-last_shot);
+    last_shot = shot;
+    w.put(refs.size());
+    for (auto &ref : refs) {
+        w.put_signed(ref.qubit);
+        w.put_tag(ref.tag);
+    }
+}
+static void read_record(StateReader &r, uint64_t &shot, std::vector<MeasurementRef> &refs)
+{
+    shot += r.get();
+    refs.resize(r.get());
+    for (auto &ref : refs) {
+        ref.qubit = r.get_signed();
+        ref.tag = r.get_tag();
+    }
+}
+// Streams use a large buffer, which must outlive them
+static void open_output(std::ofstream &file, std::vector<char> &buffer, const std::string &path)
+{
+    buffer.resize(1<<20);
+    file.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+    file.open(path, std::ios::binary | std::ios::trunc);
+    if (!file) {
+        std::cerr<<"Cannot open "<<path<<" for writing"<<std::endl;
+        abort();
+    }
+    file.write(FILE_MAGIC, sizeof(FILE_MAGIC));
+    StateWriter(file).put_u32(FILE_VERSION);
+}
+static void open_input(std::ifstream &file, std::vector<char> &buffer, const std::string &path)
+{
+    buffer.resize(1<<20);
+    file.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+    file.open(path, std::ios::binary);
+    char magic[sizeof(FILE_MAGIC)];
+    file.read(magic, sizeof(magic));
+    if (!file || !std::equal(magic, magic+sizeof(magic), FILE_MAGIC) || StateReader(file).get_u32() != FILE_VERSION) {
+        std::cerr<<path<<" is not a FrameSim result file of version "<<FILE_VERSION<<std::endl;
+        abort();
+    }
+}
+static void close_output(std::ofstream &file, const std::string &path)
+{
+    file.flush();
+    if (!file) {
+        std::cerr<<"Error writing "<<path<<std::endl;
+        abort();
+    }
+}
+void save_results(const ShardResults &results, const std::string &path)
+{
+    std::vector<char> buffer;
+    std::ofstream file;
+    open_output(file, buffer, path);
+    StateWriter w(file);
+    write_counts(w, results, results.records ? results.shot_records.size() : 0);
+    uint64_t last_shot = 0;
+    if (results.records) {
+        for (auto &[shot, refs] : results.shot_records)
+            write_record(w, shot, last_shot, refs);
+    }
+    close_output(file, path);
+}
+ShardResults load_results(const std::string &path)
+{
+    std::vector<char> buffer;
+    std::ifstream file;
+    open_input(file, buffer, path);
+    StateReader r(file);
+    ShardResults results;
+    uint64_t num_records = read_counts(r, results);
+    uint64_t shot = 0;
+    for (uint64_t i=0; i<num_records; i++) {
+        std::vector<MeasurementRef> refs;
+        read_record(r, shot, refs);
+        results.shot_records[shot] = std::move(refs);
+    }
+    return results;
+}
+void merge_result_files(const std::vector<std::string> &inputs, const std::string &output)
+{
+    struct Input
+    {
+        std::vector<char> buffer;
+        std::ifstream file;
+        std::unique_ptr<StateReader> reader;
+        uint64_t remaining;
+        uint64_t shot=0;
+        std::vector<MeasurementRef> refs;
+    };
+    std::vector<Input> files(inputs.size());
+    ShardResults total;
+    uint64_t num_records = 0;
+    for (size_t i=0; i<inputs.size(); i++) {
+        auto &in = files[i];
+        open_input(in.file, in.buffer, inputs[i]);
+        in.reader = std::make_unique<StateReader>(in.file);
+        ShardResults results;
+        in.remaining = read_counts(*in.reader, results);
+        num_records += in.remaining;
+        total.merge(results);
+    }
+    std::vector<char> buffer;
+    std::ofstream file;
+    open_output(file, buffer, output);
+    StateWriter w(file);
+    write_counts(w, total, total.records ? num_records : 0);
+    if (total.records) {
+        // Merge the records of all inputs by shot, holding the next record of every input
+        auto later = [&files](size_t a, size_t b) {
+            return files[a].shot > files[b].shot;
+        };
+        std::priority_queue<size_t, std::vector<size_t>, decltype(later)> next(later);
+        for (size_t i=0; i<files.size(); i++) {
+            if (files[i].remaining > 0) {
+                read_record(*files[i].reader, files[i].shot, files[i].refs);
+                next.push(i);
+            }
+        }
+        uint64_t last_shot = 0;
+        bool first = true;
+        while (!next.empty()) {
+            auto &in = files[next.top()];
+            next.pop();
+            if (!first && in.shot <= last_shot) {
+                std::cerr<<"Shot "<<in.shot<<" appears in more than one result file"<<std::endl;
+                abort();
+            }
+            first = false;
+            write_record(w, in.shot, last_shot, in.refs);
+            if (--in.remaining > 0) {
+                read_record(*in.reader, in.shot, in.refs);
+                next.push(&in-files.data());
+            }
+        }
+    }
+    close_output(file, output);
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include "simulator_base.h"
+#include <string>
+// Results of a run, or of a shard of a run, which can be merged with those of other shards
+struct ShardResults
+{
+    // Number of shots run, and shots not discarded by post-selection
+    uint64_t shots=0;
+    uint64_t kept_shots=0;
+    // Shots with at least one flipped measurement
+    uint64_t flipped_shots=0;
+    // Number of shots in which every measurement has been flipped
+    std::map<std::pair<int, MeasurementTag>, uint64_t> flips;
+    // Name and number of shots which have run every node, in the order of reachable_nodes(root)
+    std::vector<std::pair<std::string, uint64_t>> node_visits;
+    // Flipped measurements of every shot with flips, by global shot index. Only kept if records is set
+    bool records=false;
+    std::map<uint64_t, std::vector<MeasurementRef>> shot_records;
+    // Adds the results of another shard of the same tree
+    void merge(const ShardResults &o);
+};
+struct ShardOptions
+{
+    uint64_t total_shots;
+    uint64_t seed;
+    int shard=0;
+    int num_shards=1;
+    // Use DenseFrameSimulator instead of FrameSimulator
+    // Its random frame flips are drawn from a generator seeded with the seed and the shard, so flips of
+    // measurements with random outcomes depend on the sharding. Only errors are drawn per shot
+    bool dense=false;
+    // Keep the flipped measurements of every shot
+    bool records=false;
+    // Memory budget of the simulator, in bytes (see run_chunked())
+    size_t memory_budget=size_t(1)<<30;
+};
+// Runs shard of num_shards of a run: the shots from total_shots*shard/num_shards to total_shots*(shard+1)/num_shards-1
+// Errors are drawn with use_counter_rng(seed, first_shot), so shards are independent processes sharing
+// only the seed. With FrameSimulator, their merged results are the same as those of a single run with all the shots
+ShardResults run_shard(std::shared_ptr<CircuitNode> root, const ShardOptions &options);
+// Result files: the counts first, followed by the records sorted by shot, so that files
+// are merged by streaming their records
+void save_results(const ShardResults &results, const std::string &path);
+ShardResults load_results(const std::string &path);
+// Merges result files into output, reading the records of every input one at a time
+void merge_result_files(const std::vector<std::string> &inputs, const std::string &output);
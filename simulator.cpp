@@ -1,6 +1,8 @@
 #include "simulator.h"
 #include "nonsparsesim.h"
+#include "checkpoint.h"
 #include <iostream>
+#include <algorithm>
 //#define RANDOMIZE_FLIPS
 //#define CHECK_FT
 // Flips an error for a given shot
@@ -8,6 +10,15 @@
 // If there was no error, insert it
 void FrameSimulator::flip_error(size_t shot, int qubit, int type)
 {
+    if (fault_location != nullptr) {
+        auto &rows = fault_location->rows.at(qubit);
+        auto &outputs = (*fault_outputs)[shot];
+        if (type & ERROR_X)
+            xor_row(outputs, rows[0]);
+        if (type & ERROR_Z)
+            xor_row(outputs, rows[1]);
+        return;
+    }
     auto it = errors.find(shot);
     if (it == errors.end())
         it = errors.emplace(shot, std::pair<std::set<int>,std::set<int>>()).first;
@@ -30,13 +41,10 @@ void FrameSimulator::flip_error(std::map<size_t,std::pair<std::set<int>,std::set
 // Advances iterator to next shot with error
 void FrameSimulator::reset_error(std::map<size_t,std::pair<std::set<int>,std::set<int>>>::iterator &it, int qubit, int type)
 {
-    // FIXME!!! Not implemented for Y errors
-    if (type == ERROR_X)
+    if (type & ERROR_X)
         it->second.first.erase(qubit);
-    else if (type == ERROR_Z)
+    if (type & ERROR_Z)
         it->second.second.erase(qubit);
-    else
-        abort();
     if (it->second.first.empty() && it->second.second.empty())
         it = errors.erase(it);
     else
@@ -137,6 +145,42 @@ void FrameSimulator::szz(int q1, int q2)
         }
     }
 }
+// Pauli error of a shot in a qubit, as an error type
+static int error_type(const std::pair<std::set<int>,std::set<int>> &err, int qubit)
+{
+    return (err.first.count(qubit) ? ERROR_X : 0) | (err.second.count(qubit) ? ERROR_Z : 0);
+}
+// Flips the errors of the given type, without removing the shot if it has no errors left
+static void toggle_error(std::pair<std::set<int>,std::set<int>> &err, int qubit, int type)
+{
+    if ((type & ERROR_X) && !err.first.erase(qubit))
+        err.first.insert(qubit);
+    if ((type & ERROR_Z) && !err.second.erase(qubit))
+        err.second.insert(qubit);
+}
+// Generic Clifford gates
+// The error in the gate qubits is replaced by its image in the table
+void FrameSimulator::clifford1(int qubit, const CliffordTable &table)
+{
+    for (auto &[shot, err] : errors) {
+        int type = error_type(err, qubit);
+        toggle_error(err, qubit, type ^ table.image[type]);
+    }
+}
+void FrameSimulator::clifford2(int q1, int q2, const CliffordTable &table)
+{
+    for (auto it = errors.begin(); it != errors.end(); ) {
+        auto &err = it->second;
+        int type = error_type(err, q1) | error_type(err, q2)<<2;
+        int diff = type ^ table.image[type];
+        toggle_error(err, q1, diff & 3);
+        toggle_error(err, q2, diff >> 2);
+        if (err.first.empty() && err.second.empty())
+            it = errors.erase(it);
+        else
+            ++it;
+    }
+}
 // Measurement in the X basis
 // Flipped if there is a Z error in the qubit
 void FrameSimulator::mx(int qubit, MeasurementTag tag)
@@ -151,6 +195,20 @@ void FrameSimulator::mx(int qubit, MeasurementTag tag)
             qubit_measurement_results[shot].results[qubit].insert(tag);
     }
 }
+// Measurement in the Y basis
+// Flipped if there is a X or a Z error in the qubit, but not both
+void FrameSimulator::my(int qubit, MeasurementTag tag)
+{
+#ifdef RANDOMIZE_FLIPS
+    for (size_t i=0; i<num_shots; i++) {
+        if (randomizer(rng)) flip_error(i, qubit, ERROR_X|ERROR_Z);
+    }
+#endif
+    for (auto &[shot, err] : errors) {
+        if ((err.first.find(qubit) != err.first.end()) ^ (err.second.find(qubit) != err.second.end()))
+            qubit_measurement_results[shot].results[qubit].insert(tag);
+    }
+}
 // Measurement in the Z basis
 // Flipped if there is a X error in the qubit
 void FrameSimulator::mz(int qubit, MeasurementTag tag)
@@ -178,6 +236,19 @@ void FrameSimulator::rx(int qubit)
         reset_error(it, qubit, ERROR_Z);
     }
 }
+// Qubit preparation in |+i>
+// Resets all errors in the qubit, as a Y error doesn't change the state
+void FrameSimulator::ry(int qubit)
+{
+    for (auto it = errors.begin(); it != errors.end(); ) {
+        reset_error(it, qubit, ERROR_X|ERROR_Z);
+    }
+#ifdef RANDOMIZE_FLIPS
+    for (size_t i=0; i<num_shots; i++) {
+        if (randomizer(rng)) flip_error(i, qubit, ERROR_X|ERROR_Z);
+    }
+#endif
+}
 // Qubit preparation in |0>
 // Resets X errors in the qubit
 void FrameSimulator::rz(int qubit)
@@ -191,22 +262,122 @@ void FrameSimulator::rz(int qubit)
         reset_error(it, qubit, ERROR_X);
     }
 }
+// Applies the corrections of a declarative table to every shot with flipped measurements
+void FrameSimulator::apply_corrections(const CorrectionTable &table)
+{
+    table.check_size();
+    for (auto &[shot, res] : qubit_measurement_results) {
+        uint64_t syndrome = table.get_syndrome(res);
+        if (syndrome == 0)
+            continue;
+        auto apply = [this, shot](const CorrectionTable::Correction &corr) {
+            for (int errx : corr.x) {
+                flip_error(shot, errx, ERROR_X);
+            }
+            for (int errz : corr.z) {
+                flip_error(shot, errz, ERROR_Z);
+            }
+        };
+        for (auto &rule : table.parity_rules) {
+            if (parity(syndrome & rule.mask))
+                apply(rule.correction);
+        }
+        auto *corr = table.lookup(syndrome);
+        if (corr != nullptr)
+            apply(*corr);
+    }
+}
+// Runs a circuit from its fault table
+// The noise instructions are sampled in the same order as when running the circuit gate by gate,
+// so the same shots get the same faults
+void FrameSimulator::run(const Circuit &circ, const FaultTable &table)
+{
+    std::map<size_t, FaultTable::Row> outputs;
+    // Errors on qubits not used by the circuit are kept as they are
+    std::map<size_t, std::pair<std::set<int>,std::set<int>>> unchanged;
+    for (auto &[shot, err] : errors) {
+        auto &row = outputs[shot];
+        for (int q : err.first) {
+            if (q < table.num_qubits)
+                xor_row(row, table.inputs[q][0]);
+            else
+                unchanged[shot].first.insert(q);
+        }
+        for (int q : err.second) {
+            if (q < table.num_qubits)
+                xor_row(row, table.inputs[q][1]);
+            else
+                unchanged[shot].second.insert(q);
+        }
+    }
+    int start_tick = current_tick;
+    begin_circuit();
+    fault_outputs = &outputs;
+    // Frames are not propagated, so shots with faulty outputs are counted at every TICK
+    bool traced = tracing();
+    int tick = 0;
+    for (auto &location : table.locations) {
+        if (traced && location.tick != tick) {
+            trace_counter("faulty shots", outputs.size());
+            tick = location.tick;
+        }
+        fault_location = &location;
+        current_tick = start_tick + location.tick;
+        BaseFrameSimulator::run(circ.instructions[location.instruction]);
+    }
+    if (traced)
+        trace_counter("faulty shots", outputs.size());
+    fault_location = nullptr;
+    fault_outputs = nullptr;
+    current_tick = start_tick + table.num_ticks;
+    errors = std::move(unchanged);
+    int num_measurements = table.measurements.size();
+    for (auto &[shot, row] : outputs) {
+        for (int output : row) {
+            if (output < num_measurements) {
+                auto &[qubit, tag] = table.measurements[output];
+                qubit_measurement_results[shot].results[qubit].insert(tag);
+            } else {
+                auto &err = errors[shot];
+                int qubit = (output-num_measurements)/2;
+                if ((output-num_measurements) & 1)
+                    err.second.insert(qubit);
+                else
+                    err.first.insert(qubit);
+            }
+        }
+    }
+}
 // Runs a circuit node, which consists in a deterministic circuit
 // and a function which determines which circuit goes afterwards
-void FrameSimulator::run(std::shared_ptr<CircuitNode> node)
+std::shared_ptr<CircuitNode> FrameSimulator::run_node(std::shared_ptr<CircuitNode> node)
 {
     //std::cout<<node->name<<std::endl;
     // Run the circuit
-    BaseFrameSimulator::run(node->circuit);
+    // Faults are injected gate by gate when they are enumerated
+    if (fault_tables != nullptr && enumeration == nullptr) {
+        auto circ = node_circuit(*node).share();
+        auto it = fault_tables->find(circ);
+        if (it == fault_tables->end())
+            it = fault_tables->emplace(circ, FaultTable(*circ)).first;
+        run(*circ, it->second);
+    } else {
+        BaseFrameSimulator::run(*node_circuit(*node));
+    }
     
     /*if (node->error_corrections && node->next_node_index)
         abort();*/
+    // Pure callbacks are evaluated once for every distinct set of outcomes they read
+    auto *memos = node_memos(node);
     // Apply error corrections for this round, if any
     if (node->error_corrections) {
+        TraceSpan span("error_corrections", node->name);
+        span.arg("calls", qubit_measurement_results.size());
+        std::pair<std::set<int>,std::set<int>> computed;
         for (auto it = qubit_measurement_results.begin(); it != qubit_measurement_results.end(); ) {
             size_t shot = it->first;
             auto &res = it->second;
-            auto corr = node->error_corrections(res);
+            auto &corr = memos != nullptr ? memos->error_corrections.get(res, node->error_corrections) : (computed = node->error_corrections(res));
             for (int errx : corr.first) {
                 flip_error(shot, errx, ERROR_X);
             }
@@ -219,27 +390,39 @@ void FrameSimulator::run(std::shared_ptr<CircuitNode> node)
                 ++it;
         }
     }
-    if (node->childs.size() <= 1 && !node->next_node_index) {
-        if (!node->childs.empty())
-            run(node->childs[0]);
-        return;
+    for (auto &table : node->correction_tables) {
+        apply_corrections(table);
     }
+    if (node->childs.size() <= 1 && !node->has_branching())
+        return node->childs.empty() ? nullptr : node->get_child(0);
+    TraceSpan split("branch split", node->name);
+    split.arg("shots", num_shots);
+    // Branch followed by shots without flipped measurements
+    if (node->branch_condition)
+        node->branch_condition->check_size();
+    int noiseless_branch = node->branch_condition ? node->branch_condition->get_branch(UINT64_C(0)) : 0;
     // Sort shots by next circuit index
     std::map<int, std::vector<size_t>> branch_shots;
     // Process shots for which an error has been detected
     for (auto &[shot, res] : qubit_measurement_results) {
-        int branch = 0;
-        if (node->next_node_index)
+        int branch;
+        if (node->branch_condition)
+            branch = node->branch_condition->get_branch(res);
+        else if (memos != nullptr && node->next_node_index)
+            branch = memos->next_node_index.get(res, node->next_node_index);
+        else if (node->next_node_index)
             branch = node->next_node_index(res);
+        else
+            branch = 0;
         branch_shots[branch].push_back(shot);
     }
     // Process noisy runs with undetected errors
     for (auto &[shot, err] : errors) {
         if (qubit_measurement_results.find(shot) == qubit_measurement_results.end()) {
-            branch_shots[0].push_back(shot);
+            branch_shots[noiseless_branch].push_back(shot);
         }
     }
-    int processed_shots=0;
+    size_t processed_shots=0;
     for (auto &kvp : branch_shots) {
         processed_shots += kvp.second.size();
     }
@@ -249,67 +432,181 @@ void FrameSimulator::run(std::shared_ptr<CircuitNode> node)
     auto old_res = std::move(qubit_measurement_results);
     errors.clear();
     qubit_measurement_results.clear();
-    int start = 0;
-    // Run next circuits
+    // Shots without errors nor flipped measurements are not stored, so their global indices
+    // are found as ranges between the processed shots
+    std::vector<size_t> processed;
+    ShotIds old_ids;
+    if (track_shot_ids()) {
+        for (auto &kvp : branch_shots)
+            processed.insert(processed.end(), kvp.second.begin(), kvp.second.end());
+        std::sort(processed.begin(), processed.end());
+        old_ids = std::move(shot_ids);
+        shot_ids = ShotIds();
+    }
+    auto branch_ids = [&](const std::vector<size_t> &shots, bool noiseless) {
+        ShotIds ids;
+        for (size_t shot : shots)
+            ids.push_back(old_ids.global(shot));
+        if (noiseless) {
+            size_t begin = 0;
+            for (size_t shot : processed) {
+                ids.append(old_ids, begin, shot);
+                begin = shot+1;
+            }
+            ids.append(old_ids, begin, old_ids.size());
+        }
+        return ids;
+    };
+    split.end();
+    // Shots of branches without a node, such as those discarded by post-selection, are dropped
+    if (fault_counts != nullptr) {
+        branch_shots[noiseless_branch];
+        int num_branches = std::max<int>(node->childs.size(), 1);
+        for (auto &[i, shots] : branch_shots) {
+            if (i < 0 || i >= num_branches)
+                end_shots(branch_ids(shots, i == noiseless_branch), true);
+        }
+    }
+    // Move the shots to the simulators of the branches, which run the next circuits
     for (int i=0; i<node->childs.size() || i==0; i++) {
         auto &shots = branch_shots[i];
-        int nshots = shots.size();
-        // For the first branch, include shots which have no errors nor detected measurements
-        if (i == 0)
+        size_t nshots = shots.size();
+        // For the noiseless branch, include shots which have no errors nor detected measurements
+        if (i == noiseless_branch)
             nshots += num_shots-processed_shots;
         if (nshots == 0)
             continue;
-        if (i < node->childs.size() && node->childs[i]) {
-            //if (i == 0 && num_shots-processed_shots > shots.size()) {
-                FrameSimulator sim(nshots, rng);
-                // Setup new simulation with initial states equal to end state of the recently run simulation
-                // Fill with shots which require this branch
-                for (int j=0; j<shots.size(); j++) {
-                    auto it1 = old_err.find(shots[j]);
-                    if (it1 != old_err.end())
-                        sim.errors[j] = std::move(it1->second);
-                    auto it2 = old_res.find(shots[j]);
-                    if (it2 != old_res.end())
-                        sim.qubit_measurement_results[j] = std::move(it2->second);    
-                }
-                sim.error = error;
-                sim.current_tick = current_tick+1;
-                // Run next circuit
-                sim.run(node->childs[i]);
-                nshots = sim.num_shots;
-                // Move results and errors from the new simulation back to the original simulation
-                for (auto &[index,err] : sim.errors) {
-                    errors[index+start] = std::move(err);
-                }
-                for (auto &[index,res] : sim.qubit_measurement_results) {
-                    qubit_measurement_results[index+start] = std::move(res);
-                }
-            /*} else {
-                DenseFrameSimulator sim(0, rng);
-                for (int j=0; j<shots.size(); j++) {
-                    auto it1 = old_err.find(shots[j]);
-                    if (it1 != old_err.end())
-                        sim.errors[j] = std::move(it1->second);
-                    auto it2 = old_res.find(shots[j]);
-                    if (it2 != old_res.end())
-                        sim.qubit_measurement_results[j] = std::move(it2->second);
-                }
-                for (int j=shots.size(); j<nshots; j++) {
-                    sim.errors
-                }
-            }*/
-        } else {
-            // If there is no following circuit, just reorganize errors and sort them by branch
-            for (int j=0; j<shots.size(); j++) {
-                auto it1 = old_err.find(shots[j]);
-                if (it1 != old_err.end())
-                    errors[j+start] = std::move(it1->second);
-                auto it2 = old_res.find(shots[j]);
-                if (it2 != old_res.end())
-                    qubit_measurement_results[j+start] = std::move(it2->second);
-            }
+        auto sim = std::make_unique<FrameSimulator>(nshots, rng);
+        setup_branch(*sim);
+        // Setup new simulation with initial states equal to end state of the recently run simulation
+        // Fill with shots which require this branch
+        for (size_t j=0; j<shots.size(); j++) {
+            auto it1 = old_err.find(shots[j]);
+            if (it1 != old_err.end())
+                sim->errors[j] = std::move(it1->second);
+            auto it2 = old_res.find(shots[j]);
+            if (it2 != old_res.end())
+                sim->qubit_measurement_results[j] = std::move(it2->second);
+        }
+        if (track_shot_ids())
+            sim->shot_ids = branch_ids(shots, i == noiseless_branch);
+        // Shots of branches without a following circuit just end, sorted by branch
+        sim->next_node = i < node->childs.size() ? node->get_child(i) : nullptr;
+        sim->finished = false;
+        branches.push_back(std::move(sim));
+    }
+    num_shots = 0;
+    return nullptr;
+}
+void FrameSimulator::setup_branch(FrameSimulator &sim) const
+{
+    sim.error = error;
+    sim.fault_tables = fault_tables;
+    sim.current_tick = current_tick+1;
+    copy_sampling_state(sim);
+}
+std::unique_ptr<BaseFrameSimulator> FrameSimulator::new_branch()
+{
+    auto sim = std::make_unique<FrameSimulator>(0, rng);
+    setup_branch(*sim);
+    return sim;
+}
+// Shots of the branch go after those of the branches merged before
+void FrameSimulator::merge_branch(BaseFrameSimulator &branch)
+{
+    auto &sim = static_cast<FrameSimulator&>(branch);
+    for (auto &[index,err] : sim.errors) {
+        errors[index+num_shots] = std::move(err);
+    }
+    for (auto &[index,res] : sim.qubit_measurement_results) {
+        qubit_measurement_results[index+num_shots] = std::move(res);
+    }
+    if (track_shot_ids())
+        shot_ids.append(sim.shot_ids);
+    num_shots += sim.num_shots;
+}
+// Shots are written in increasing order, as differences from the previous one
+void FrameSimulator::save_shots(StateWriter &w) const
+{
+    w.put(errors.size());
+    size_t last = 0;
+    for (auto &[shot, err] : errors) {
+        w.put(shot-last);
+        w.put_set(err.first);
+        w.put_set(err.second);
+        last = shot;
+    }
+    w.put(qubit_measurement_results.size());
+    last = 0;
+    for (auto &[shot, res] : qubit_measurement_results) {
+        w.put(shot-last);
+        w.put(res.results.size());
+        for (auto &[qubit, tags] : res.results) {
+            w.put_signed(qubit);
+            w.put(tags.size());
+            for (auto &tag : tags)
+                w.put_tag(tag);
+        }
+        last = shot;
+    }
+}
+void FrameSimulator::load_shots(StateReader &r)
+{
+    errors.clear();
+    size_t count = r.get();
+    size_t shot = 0;
+    for (size_t i=0; i<count; i++) {
+        shot += r.get();
+        auto &err = errors[shot];
+        err.first = r.get_set();
+        err.second = r.get_set();
+    }
+    qubit_measurement_results.clear();
+    count = r.get();
+    shot = 0;
+    for (size_t i=0; i<count; i++) {
+        shot += r.get();
+        auto &res = qubit_measurement_results[shot].results;
+        size_t num_qubits = r.get();
+        for (size_t j=0; j<num_qubits; j++) {
+            auto &tags = res[r.get_signed()];
+            size_t num_tags = r.get();
+            for (size_t k=0; k<num_tags; k++)
+                tags.insert(r.get_tag());
         }
-        start += nshots;
     }
-    num_shots = start;
-}
\ No newline at end of file
+}
+size_t FrameSimulator::memory_usage() const
+{
+    // Approximate overhead of a node of std::map and std::set
+    const size_t node = 32;
+    size_t bytes = 0;
+    for (auto &[shot, err] : errors)
+        bytes += node+sizeof(shot)+sizeof(err)+(err.first.size()+err.second.size())*(node+sizeof(int));
+    for (auto &[shot, res] : qubit_measurement_results) {
+        bytes += node+sizeof(shot)+sizeof(res);
+        for (auto &[qubit, tags] : res.results)
+            bytes += node+sizeof(qubit)+sizeof(tags)+tags.size()*(node+sizeof(MeasurementTag));
+    }
+    return bytes;
+}
+void FrameSimulator::for_each_flip(std::function<void(size_t, int, const MeasurementTag&)> f) const
+{
+    for (auto &[shot, res] : qubit_measurement_results) {
+        for (auto &[qubit, tags] : res.results) {
+            for (auto &tag : tags)
+                f(shot, qubit, tag);
+        }
+    }
+}
+size_t FrameSimulator::duplicate_shot(size_t shot)
+{
+    size_t copy = num_shots++;
+    auto it1 = errors.find(shot);
+    if (it1 != errors.end())
+        errors[copy] = it1->second;
+    auto it2 = qubit_measurement_results.find(shot);
+    if (it2 != qubit_measurement_results.end())
+        qubit_measurement_results[copy] = it2->second;
+    return copy;
+}
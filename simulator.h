@@ -4,7 +4,8 @@
 #include <map>
 #include <set>
 #include "simulator_base.h"
-struct MeasurementResultsSparse : MeasurementResults
+#include "fault_table.h"
+struct MeasurementResultsSparse final : MeasurementResults
 {
     std::map<int,std::set<MeasurementTag>> results;
     bool is_flipped(int qubit, const MeasurementTag &tag) override
@@ -55,6 +56,20 @@ class FrameSimulator : public BaseFrameSimulator
     // Key: shot number
     // Value: list of qubits with X (first) and Z (second) errors
     std::map<size_t, std::pair<std::set<int>,std::set<int>>> errors;
+    // Fault tables of the circuits run so far, shared with the simulators of the branches
+    // nullptr unless enable_fault_tables() has been called
+    std::shared_ptr<std::map<std::shared_ptr<const Circuit>, FaultTable>> fault_tables;
+    // While sampling a noise instruction from a fault table, flip_error() adds
+    // the rows of the location to the outputs of the shot
+    const FaultTable::Location *fault_location = nullptr;
+    std::map<size_t, FaultTable::Row> *fault_outputs = nullptr;
+    void run(const Circuit &circ, const FaultTable &table);
+    // Shares the state of the simulator with the simulator of a branch
+    void setup_branch(FrameSimulator &sim) const;
+    std::unique_ptr<BaseFrameSimulator> new_branch() override;
+    void merge_branch(BaseFrameSimulator &branch) override;
+    void save_shots(StateWriter &w) const override;
+    void load_shots(StateReader &r) override;
     public:
     // Tracks measurement results which have been flipped due to an error
     // Key: shot number
@@ -69,10 +84,30 @@ class FrameSimulator : public BaseFrameSimulator
     void cx(int control, int target) override;
     void cz(int q1, int q2) override;
     void mx(int qubit, MeasurementTag tag) override;
+    void my(int qubit, MeasurementTag tag) override;
     void mz(int qubit, MeasurementTag tag) override;
     void rx(int qubit) override;
+    void ry(int qubit) override;
     void rz(int qubit) override;
-    void run(std::shared_ptr<CircuitNode> node) override;
+    void clifford1(int qubit, const CliffordTable &table) override;
+    void clifford2(int q1, int q2, const CliffordTable &table) override;
+    std::shared_ptr<CircuitNode> run_node(std::shared_ptr<CircuitNode> node) override;
+    using BaseFrameSimulator::run;
+    size_t memory_usage() const override;
+    int64_t num_faulty_shots() const override
+    {
+        return errors.size();
+    }
+    void for_each_flip(std::function<void(size_t, int, const MeasurementTag&)> f) const override;
+    size_t duplicate_shot(size_t shot) override;
+    // Runs circuits through their fault tables instead of gate by gate. Results are the same,
+    // but faulty shots cost a table lookup per fault instead of a propagation through every gate
+    void enable_fault_tables()
+    {
+        if (fault_tables == nullptr)
+            fault_tables = std::make_shared<std::map<std::shared_ptr<const Circuit>, FaultTable>>();
+    }
+    void apply_corrections(const CorrectionTable &table);
     void reset_error(std::map<size_t,std::pair<std::set<int>,std::set<int>>>::iterator &it, int qubit, int type);
     void flip_error(std::map<size_t,std::pair<std::set<int>,std::set<int>>>::iterator &it, int qubit, int type);
     void flip_error(size_t shot, int qubit, int type) override;
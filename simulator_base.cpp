@@ -1,75 +1,234 @@
 #include "simulator_base.h"
+#include "philox.h"
+#include "checkpoint.h"
+#include <sstream>
+#include <algorithm>
+#include <optional>
+void ShotIds::push_back(uint64_t first, size_t count)
+{
+    if (count == 0)
+        return;
+    sorted_ranges.clear();
+    if (!ranges.empty() && ranges.back().first+ranges.back().count == first)
+        ranges.back().count += count;
+    else
+        ranges.push_back(Range{first, count, total});
+    total += count;
+}
+void ShotIds::append(const ShotIds &o, size_t begin, size_t end)
+{
+    if (begin >= end)
+        return;
+    auto it = std::upper_bound(o.ranges.begin(), o.ranges.end(), begin, [](size_t local, const Range &range) {
+        return local < range.local;
+    });
+    for (--it; it != o.ranges.end() && it->local < end; ++it) {
+        size_t from = std::max(begin, it->local);
+        size_t to = std::min(end, it->local+it->count);
+        push_back(it->first+(from-it->local), to-from);
+    }
+}
+uint64_t ShotIds::global(size_t local) const
+{
+    auto it = std::upper_bound(ranges.begin(), ranges.end(), local, [](size_t local, const Range &range) {
+        return local < range.local;
+    });
+    --it;
+    return it->first+(local-it->local);
+}
+const std::vector<ShotIds::Range> &ShotIds::sorted() const
+{
+    if (sorted_ranges.empty() && !ranges.empty()) {
+        sorted_ranges = ranges;
+        std::sort(sorted_ranges.begin(), sorted_ranges.end(), [](const Range &a, const Range &b) {
+            return a.first < b.first;
+        });
+    }
+    return sorted_ranges;
+}
+// Number of consecutive shots sharing a stream of the counter-based generator
+// Faults in a block are found by geometric skipping from its first shot, so replaying
+// a single shot takes about 1+p*SHOT_BLOCK draws per fault location
+constexpr uint64_t SHOT_BLOCK = 1024;
+template<typename F>
+void BaseFrameSimulator::sample(double p, F on_sampled_fault)
+{
+    std::geometric_distribution<size_t> dist(p == 1 ? 0.5 : p);
+    uint64_t location = sample_index++;
+    int channel = -1;
+    if (fault_counts != nullptr) {
+        auto [it, inserted] = fault_counts->class_index.try_emplace({current_instruction, p}, fault_counts->classes.size());
+        if (inserted)
+            fault_counts->classes.push_back(it->first);
+        channel = it->second;
+        if (fault_locations.size() <= (size_t)channel)
+            fault_locations.resize(channel+1);
+        fault_locations[channel]++;
+    }
+    auto on_fault = [&](size_t shot, auto &gen) {
+        on_sampled_fault(shot, gen);
+        if (channel >= 0) {
+            auto &counts = fault_counts->shot_faults[shot_ids.global(shot)];
+            if (counts.size() <= channel)
+                counts.resize(channel+1);
+            counts[channel]++;
+        }
+    };
+    if (!counter_rng) {
+        size_t next_candidate = 0;
+        for (;;) {
+            size_t shot = next_candidate + (p == 1 ? 0 : dist(rng));
+            if (shot >= num_shots)
+                break;
+            next_candidate = shot+1;
+            on_fault(shot, rng);
+        }
+        return;
+    }
+    // Streams are identified by the counter words after the first: block index, or global shot index
+    // with the top bit set for the streams drawing the error types, then fault location
+    Philox4x64::Key key = {counter_seed, 0};
+    std::optional<Philox4x64> gen;
+    uint64_t block = 0;
+    uint64_t next = 0;
+    auto skip = [&]() -> uint64_t {
+        return p == 1 ? 0 : std::min<uint64_t>(dist(*gen), SHOT_BLOCK);
+    };
+    auto start_block = [&](uint64_t b) {
+        block = b;
+        gen.emplace(key, Philox4x64::Counter{0, b, location, circuit_index});
+        next = b*SHOT_BLOCK + skip();
+    };
+    // Shots are visited in global order, so that every block is only generated once
+    for (auto &range : shot_ids.sorted()) {
+        uint64_t end = range.first+range.count;
+        if (!gen || range.first >= (block+1)*SHOT_BLOCK)
+            start_block(range.first/SHOT_BLOCK);
+        for (;;) {
+            if (next >= (block+1)*SHOT_BLOCK) {
+                if ((block+1)*SHOT_BLOCK >= end)
+                    break;
+                start_block(block+1);
+                continue;
+            }
+            if (next >= end)
+                break;
+            if (next >= range.first) {
+                Philox4x64 shot_gen(key, {0, next | (UINT64_C(1)<<63), location, circuit_index});
+                on_fault(range.local+(next-range.first), shot_gen);
+            }
+            next += 1+skip();
+        }
+    }
+}
+std::ostream &operator<<(std::ostream &os, const Fault &fault)
+{
+    const char *names[] = {"I","X","Z","Y"};
+    for (size_t i=0; i<fault.qubits.size(); i++) {
+        if (i > 0)
+            os<<"*";
+        os<<names[(fault.type>>(2*i))&3]<<fault.qubits[i];
+    }
+    return os<<" at tick "<<fault.tick<<" of node "<<fault.node;
+}
+// Copies every shot with less than max_weight faults once for every fault type, and injects the fault in the copy
+// Copies are not considered again for the same instruction, so faults of a shot are at different locations
+void BaseFrameSimulator::inject_faults(std::vector<int> qubits, std::vector<int> types)
+{
+    if (!open_shots_valid) {
+        open_shots.clear();
+        for (size_t shot=0; shot<num_shots; shot++) {
+            if (enumeration->shot_faults[shot_ids.global(shot)].size() < enumeration->max_weight)
+                open_shots.push_back(shot);
+        }
+        open_shots_valid = true;
+    }
+    size_t count = open_shots.size();
+    for (size_t i=0; i<count; i++) {
+        size_t shot = open_shots[i];
+        uint64_t id = shot_ids.global(shot);
+        for (int type : types) {
+            // First faults are split among shards
+            if (enumeration->shot_faults[id].empty() && (enumeration->first_faults++ % enumeration->num_shards) != enumeration->shard)
+                continue;
+            size_t copy = duplicate_shot(shot);
+            shot_ids.push_back(enumeration->shot_faults.size());
+            auto faults = enumeration->shot_faults[id];
+            faults.push_back(Fault{current_node != nullptr ? current_node->name : "", current_tick, qubits, type});
+            if (faults.size() < enumeration->max_weight)
+                open_shots.push_back(copy);
+            enumeration->shot_faults.push_back(std::move(faults));
+            for (size_t j=0; j<qubits.size(); j++)
+                flip_error(copy, qubits[j], (type>>(2*j))&3);
+        }
+    }
+}
 // Introduces a X error with probability p
 void BaseFrameSimulator::x_error(int qubit, double p)
 {
-    std::geometric_distribution<size_t> dist(p == 1 ? 0.5 : p);
-    size_t next_candidate = 0;
-    for (;;) {
-        size_t shot = next_candidate + (p == 1 ? 0 : dist(rng));
-        if (shot >= num_shots)
-            break;
-        next_candidate = shot+1;
+    if (enumeration != nullptr) {
+        inject_faults({qubit}, p > 0 ? std::vector<int>{ERROR_X} : std::vector<int>{});
+        return;
+    }
+    sample(p, [&](size_t shot, auto &) {
 #ifdef CHECK_FT
         if (error)
-            continue;
+            return;
         error = true;
         std::cerr<<"X"<<qubit<<" at tick "<<current_tick<<std::endl;
 #endif
         flip_error(shot, qubit, ERROR_X);
-    }
+    });
 }
 // Introduces a Y error with probability p
 void BaseFrameSimulator::y_error(int qubit, double p)
 {
-    std::geometric_distribution<size_t> dist(p == 1 ? 0.5 : p);
-    size_t next_candidate = 0;
-    for (;;) {
-        size_t shot = next_candidate + (p == 1 ? 0 : dist(rng));
-        if (shot >= num_shots)
-            break;
-        next_candidate = shot+1;
+    if (enumeration != nullptr) {
+        inject_faults({qubit}, p > 0 ? std::vector<int>{ERROR_X|ERROR_Z} : std::vector<int>{});
+        return;
+    }
+    sample(p, [&](size_t shot, auto &) {
 #ifdef CHECK_FT
         if (error)
-            continue;
+            return;
         error = true;
         std::cerr<<"Y"<<qubit<<" at tick "<<current_tick<<std::endl;
 #endif
         flip_error(shot, qubit, ERROR_X|ERROR_Z);
-    }
+    });
 }
 // Introduces a Z error with probability p
 void BaseFrameSimulator::z_error(int qubit, double p)
 {
-    std::geometric_distribution<size_t> dist(p == 1 ? 0.5 : p);
-    size_t next_candidate = 0;
-    for (;;) {
-        size_t shot = next_candidate + (p == 1 ? 0 : dist(rng));
-        if (shot >= num_shots)
-            break;
-        next_candidate = shot+1;
+    if (enumeration != nullptr) {
+        inject_faults({qubit}, p > 0 ? std::vector<int>{ERROR_Z} : std::vector<int>{});
+        return;
+    }
+    sample(p, [&](size_t shot, auto &) {
 #ifdef CHECK_FT
         if (error)
-            continue;
+            return;
         error = true;
         std::cerr<<"Z"<<qubit<<" at tick "<<current_tick<<std::endl;
 #endif
         flip_error(shot, qubit, ERROR_Z);
-    }
+    });
 }
-void BaseFrameSimulator::depolarize(std::vector<int> &qubits, double p)
+void BaseFrameSimulator::depolarize(Span<int> qubits, double p)
 {
-    std::geometric_distribution<size_t> dist(p == 1 ? 0.5 : p);
+    if (enumeration != nullptr) {
+        std::vector<int> types;
+        for (int type=1; p > 0 && type < (4<<(2*qubits.size()-2)); type++)
+            types.push_back(type);
+        inject_faults(std::vector<int>(qubits.begin(), qubits.end()), types);
+        return;
+    }
     std::uniform_int_distribution<> depol(1, (4<<(2*qubits.size()-2))-1);
-    size_t next_candidate = 0;
-    for (;;) {
-        size_t shot = next_candidate + (p == 1 ? 0 : dist(rng));
-        if (shot >= num_shots)
-            break;
-        next_candidate = shot+1;
-        int type = depol(rng);
+    sample(p, [&](size_t shot, auto &gen) {
+        int type = depol(gen);
 #ifdef CHECK_FT
         if (error)
-            continue;
+            return;
         error = true;
         /*std::string names[] = {"","X","Z","Y"};
         std::cout<<names[type]<<qubit<<" TICK "<<current_tick<<std::endl;*/
@@ -77,113 +236,167 @@ void BaseFrameSimulator::depolarize(std::vector<int> &qubits, double p)
         for (int i=0; i<qubits.size(); i++) {
             flip_error(shot, qubits[i], (type>>(2*i))&3);
         }
-    }
+    });
 }
 // Introduces a depolarizing error with probability p
 // If error happens, randomly choose between X, Y or Z errors
 void BaseFrameSimulator::depolarize1(int qubit, double p)
 {
-    std::geometric_distribution<size_t> dist(p == 1 ? 0.5 : p);
-    size_t next_candidate = 0;
-    for (;;) {
-        size_t shot = next_candidate + (p == 1 ? 0 : dist(rng));
-        if (shot >= num_shots)
-            break;
-        next_candidate = shot+1;
-        int type = depolarizer1(rng);
+    if (enumeration != nullptr) {
+        inject_faults({qubit}, p > 0 ? std::vector<int>{1, 2, 3} : std::vector<int>{});
+        return;
+    }
+    sample(p, [&](size_t shot, auto &gen) {
+        int type = depolarizer1(gen);
 #ifdef CHECK_FT
         if (error)
-            continue;
+            return;
         error = true;
         std::string names[] = {"","X","Z","Y"};
         std::cerr<<names[type]<<qubit<<" at tick "<<current_tick<<std::endl;
 #endif
         flip_error(shot, qubit, type);
-    }
+    });
 }
 // Introduces a two-qubit depolarizing error with probability p
 // If error happens, randomly choose between {I,X,Y,Z}^2-{IxI} errors
 void BaseFrameSimulator::depolarize2(int control, int target, double p)
 {
-    std::geometric_distribution<size_t> dist(p == 1 ? 0.5 : p);
-    size_t next_candidate = 0;
-    for (;;) {
-        size_t shot = next_candidate + (p == 1 ? 0 : dist(rng));
-        if (shot >= num_shots)
-            break;
-        next_candidate = shot+1;
-        int type = depolarizer2(rng);
+    if (enumeration != nullptr) {
+        std::vector<int> types;
+        for (int type=1; p > 0 && type < 16; type++)
+            types.push_back(type);
+        inject_faults({control, target}, types);
+        return;
+    }
+    sample(p, [&](size_t shot, auto &gen) {
+        int type = depolarizer2(gen);
 #ifdef CHECK_FT
         if (error)
-            continue;
+            return;
         error = true;
         std::string names[] = {"","X","Z","Y"};
         std::cerr<<names[type&3]<<control<<"*"<<names[type>>2]<<target<<" at tick "<<current_tick<<std::endl;
 #endif
         flip_error(shot, control, type & 3);
         flip_error(shot, target, type>>2);
-    }
+    });
 }
-void BaseFrameSimulator::pauli1(int qubit, std::vector<double> &p)
+void BaseFrameSimulator::pauli1(int qubit, Span<double> p)
 {
+    if (enumeration != nullptr) {
+        std::vector<int> types;
+        for (int i=0; i<3; i++) {
+            if (p[i] > 0)
+                types.push_back(i+1);
+        }
+        inject_faults({qubit}, types);
+        return;
+    }
     double ptot = 0;
     for (int i=0; i<3; i++) {
         ptot += p[i];
     }
-    std::geometric_distribution<size_t> dist(ptot == 1 ? 0.5 : ptot);
     std::discrete_distribution<int> dist2(p.begin(), p.end());
-    size_t next_candidate = 0;
-    for (;;) {
-        size_t shot = next_candidate + (ptot == 1 ? 0 : dist(rng));
-        if (shot >= num_shots)
-            break;
-        next_candidate = shot+1;
-        int type = dist2(rng)+1;
+    sample(ptot, [&](size_t shot, auto &gen) {
+        int type = dist2(gen)+1;
 #ifdef CHECK_FT
         if (error)
-            continue;
+            return;
         error = true;
         std::string names[] = {"I","X","Z","Y"};
         std::cerr<<names[type]<<qubit<<" at tick "<<current_tick<<std::endl;
 #endif
         flip_error(shot, qubit, type);
-    }
+    });
 }
-void BaseFrameSimulator::pauli2(int control, int target, std::vector<double> &p)
+void BaseFrameSimulator::pauli2(int control, int target, Span<double> p)
 {
+    if (enumeration != nullptr) {
+        std::vector<int> types;
+        for (int i=0; i<p.size(); i++) {
+            if (p[i] > 0)
+                types.push_back(i+1);
+        }
+        inject_faults({control, target}, types);
+        return;
+    }
     double ptot = 0;
-    for (int i=0; i<3; i++) {
+    for (int i=0; i<p.size(); i++) {
         ptot += p[i];
     }
-    std::geometric_distribution<size_t> dist(ptot == 1 ? 0.5 : ptot);
     std::discrete_distribution<int> dist2(p.begin(), p.end());
-    size_t next_candidate = 0;
-    for (;;) {
-        size_t shot = next_candidate + (ptot == 1 ? 0 : dist(rng));
-        if (shot >= num_shots)
-            break;
-        next_candidate = shot+1;
-        int type = dist2(rng)+1;
+    sample(ptot, [&](size_t shot, auto &gen) {
+        int type = dist2(gen)+1;
 #ifdef CHECK_FT
         if (error)
-            continue;
+            return;
         error = true;
         std::string names[] = {"","X","Z","Y"};
         std::cerr<<names[type&3]<<control<<"*"<<names[type>>2]<<target<<" at tick "<<current_tick<<std::endl;
 #endif
         flip_error(shot, control, type & 3);
         flip_error(shot, target, type>>2);
+    });
+}
+// Action of the Clifford gates, generated at compile time from their tableaus
+static constexpr CliffordTable i_table("+X", "+Z");
+static constexpr CliffordTable x_table("+X", "-Z");
+static constexpr CliffordTable y_table("-X", "-Z");
+static constexpr CliffordTable z_table("-X", "+Z");
+static constexpr CliffordTable h_table("+Z", "+X");
+static constexpr CliffordTable s_table("+Y", "+Z");
+static constexpr CliffordTable sdg_table("-Y", "+Z");
+static constexpr CliffordTable sx_table("+X", "-Y");
+static constexpr CliffordTable sxdg_table("+X", "+Y");
+static constexpr CliffordTable sy_table("-Z", "+X");
+static constexpr CliffordTable sydg_table("+Z", "-X");
+static constexpr CliffordTable cx_table("+XX", "+Z_", "+_X", "+ZZ");
+static constexpr CliffordTable cy_table("+XY", "+Z_", "+ZX", "+ZZ");
+static constexpr CliffordTable cz_table("+XZ", "+Z_", "+ZX", "+_Z");
+static constexpr CliffordTable sxx_table("+X_", "-YX", "+_X", "-XY");
+static constexpr CliffordTable sxxdg_table("+X_", "+YX", "+_X", "+XY");
+static constexpr CliffordTable szz_table("+YZ", "+Z_", "+ZY", "+_Z");
+static constexpr CliffordTable szzdg_table("-YZ", "+Z_", "-ZY", "+_Z");
+const CliffordTable *clifford_table(InstructionType type)
+{
+    switch (type) {
+        case InstructionType::I: return &i_table;
+        case InstructionType::X: return &x_table;
+        case InstructionType::Y: return &y_table;
+        case InstructionType::Z: return &z_table;
+        case InstructionType::H: return &h_table;
+        case InstructionType::S: return &s_table;
+        case InstructionType::SDG: return &sdg_table;
+        case InstructionType::SX: return &sx_table;
+        case InstructionType::SXDG: return &sxdg_table;
+        case InstructionType::SY: return &sy_table;
+        case InstructionType::SYDG: return &sydg_table;
+        case InstructionType::CX: return &cx_table;
+        case InstructionType::CY: return &cy_table;
+        case InstructionType::CZ: return &cz_table;
+        case InstructionType::SXX: return &sxx_table;
+        case InstructionType::SXXDG: return &sxxdg_table;
+        case InstructionType::SZZ: return &szz_table;
+        case InstructionType::SZZDG: return &szzdg_table;
+        default: return nullptr;
     }
 }
 // Runs a circuit instruction
-void BaseFrameSimulator::run(Instruction &instruction)
+void BaseFrameSimulator::run(const InstructionRef &instruction)
 {
     //std::cout<<instruction<<" TICK "<<current_tick<<std::endl;
+    current_instruction = instruction.type;
+    // Pauli gates don't change frames, and dagger gates act on frames as the non-dagger ones
     switch (instruction.type) {
         case InstructionType::CX:
             for (int i=0; i<instruction.targets.size(); i+=2)
                 cx(instruction.targets[i], instruction.targets[i+1]);
             break;
+        case InstructionType::CY:
+            for (int i=0; i<instruction.targets.size(); i+=2)
+                clifford2(instruction.targets[i], instruction.targets[i+1], cy_table);
+            break;
         case InstructionType::CZ:
             for (int i=0; i<instruction.targets.size(); i+=2)
                 cz(instruction.targets[i], instruction.targets[i+1]);
@@ -209,6 +422,11 @@ void BaseFrameSimulator::run(Instruction &instruction)
                 mx(instruction.targets[i], *instruction.measurement_tag);
             }
             break;
+        case InstructionType::MY:
+            for (int i=0; i<instruction.targets.size(); i++) {
+                my(instruction.targets[i], *instruction.measurement_tag);
+            }
+            break;
         case InstructionType::MZ:
             for (int i=0; i<instruction.targets.size(); i++) {
                 mz(instruction.targets[i], *instruction.measurement_tag);
@@ -218,6 +436,10 @@ void BaseFrameSimulator::run(Instruction &instruction)
             for (int i=0; i<instruction.targets.size(); i++)
                 rx(instruction.targets[i]);
             break;
+        case InstructionType::RY:
+            for (int i=0; i<instruction.targets.size(); i++)
+                ry(instruction.targets[i]);
+            break;
         case InstructionType::RZ:
             for (int i=0; i<instruction.targets.size(); i++)
                 rz(instruction.targets[i]);
@@ -276,9 +498,305 @@ void BaseFrameSimulator::run(Instruction &instruction)
     }
 }
 // Runs a deterministic circuit
-void BaseFrameSimulator::run(Circuit &circuit)
+void BaseFrameSimulator::run(const Circuit &circuit)
 {
-    for (auto &i : circuit.instructions) {
+    if (tracing()) {
+        run_traced(circuit);
+        return;
+    }
+#ifndef NO_THREADS
+    if (pipeline != nullptr && counter_rng && enumeration == nullptr && fault_counts == nullptr) {
+        run_pipelined(circuit);
+        return;
+    }
+#endif
+    begin_circuit();
+    for (auto i : circuit.instructions) {
         run(i);
     }
-}
\ No newline at end of file
+}
+void BaseFrameSimulator::run_traced(const Circuit &circuit)
+{
+    begin_circuit();
+    // Time spent in the noise instructions of the current layer, shown as a span from the first one
+    uint64_t noise_start = 0;
+    uint64_t noise_time = 0;
+    auto end_layer = [&]() {
+        if (noise_time > 0)
+            trace_complete("noise sampling", noise_start, noise_time);
+        noise_time = 0;
+        int64_t faulty = num_faulty_shots();
+        if (faulty >= 0)
+            trace_counter("faulty shots", faulty);
+    };
+    for (auto i : circuit.instructions) {
+        if (is_noise(i.type)) {
+            uint64_t start = trace_time();
+            run(i);
+            if (noise_time == 0)
+                noise_start = start;
+            noise_time += trace_time()-start;
+        } else {
+            if (i.type == InstructionType::TICK)
+                end_layer();
+            run(i);
+        }
+    }
+    if (circuit.instructions.empty() || circuit.instructions.back().type != InstructionType::TICK)
+        end_layer();
+}
+void BaseFrameSimulator::run_next_node()
+{
+    auto node = std::move(next_node);
+    if (node_visits != nullptr)
+        (*node_visits)[node.get()] += num_shots;
+    current_node = node.get();
+    // Shots end at nodes without successors, otherwise they end in the simulators of the branches
+    bool branching = node->childs.size() > 1 || node->has_branching();
+    TraceSpan span("node", node->name);
+    span.arg("shots", num_shots);
+    next_node = run_node(node);
+    if (next_node == nullptr && !branching)
+        end_shots(shot_ids, false);
+    finished = next_node == nullptr && branches.empty();
+}
+bool BaseFrameSimulator::step()
+{
+    // Simulators of the branches being run, from this one to the one running the next node
+    std::vector<BaseFrameSimulator*> path = {this};
+    while (path.back()->next_node == nullptr && !path.back()->branches.empty())
+        path.push_back(path.back()->branches.front().get());
+    auto *sim = path.back();
+    if (sim->next_node != nullptr) {
+        sim->run_next_node();
+        return true;
+    }
+    // Branches without a node end their shots as they are
+    if (!sim->finished) {
+        sim->end_shots(sim->shot_ids, false);
+        sim->finished = true;
+    }
+    if (path.size() == 1)
+        return false;
+    auto *parent = path[path.size()-2];
+    parent->merge_branch(*sim);
+    parent->branches.pop_front();
+    parent->finished = parent->branches.empty();
+    return true;
+}
+static void save_shot_ids(StateWriter &w, const ShotIds &ids)
+{
+    auto &ranges = ids.get_ranges();
+    w.put(ranges.size());
+    for (auto &range : ranges) {
+        w.put(range.first);
+        w.put(range.count);
+    }
+}
+static ShotIds load_shot_ids(StateReader &r)
+{
+    ShotIds ids;
+    size_t num_ranges = r.get();
+    for (size_t i=0; i<num_ranges; i++) {
+        uint64_t first = r.get();
+        ids.push_back(first, r.get());
+    }
+    return ids;
+}
+static void save_locations(StateWriter &w, const std::vector<uint64_t> &locations)
+{
+    w.put(locations.size());
+    for (uint64_t count : locations)
+        w.put(count);
+}
+static std::vector<uint64_t> load_locations(StateReader &r)
+{
+    std::vector<uint64_t> locations(r.get());
+    for (auto &count : locations)
+        count = r.get();
+    return locations;
+}
+static void save_fault_counts(StateWriter &w, const FaultCounts &counts)
+{
+    w.put(counts.total_shots);
+    w.put(counts.classes.size());
+    for (auto &[type, p] : counts.classes) {
+        w.put((uint64_t)type);
+        w.put_double(p);
+    }
+    w.put(counts.shot_faults.size());
+    uint64_t last = 0;
+    for (auto &[shot, faults] : counts.shot_faults) {
+        w.put(shot-last);
+        last = shot;
+        w.put(faults.size());
+        for (uint32_t count : faults)
+            w.put(count);
+    }
+    w.put(counts.groups.size());
+    for (auto &group : counts.groups) {
+        save_shot_ids(w, group.ids);
+        save_locations(w, group.locations);
+        w.put(group.discarded);
+    }
+}
+static void load_fault_counts(StateReader &r, FaultCounts &counts)
+{
+    counts.total_shots = r.get();
+    counts.classes.resize(r.get());
+    counts.class_index.clear();
+    for (size_t i=0; i<counts.classes.size(); i++) {
+        auto type = (InstructionType)r.get();
+        counts.classes[i] = {type, r.get_double()};
+        counts.class_index[counts.classes[i]] = i;
+    }
+    counts.shot_faults.clear();
+    size_t num_shots = r.get();
+    uint64_t shot = 0;
+    for (size_t i=0; i<num_shots; i++) {
+        shot += r.get();
+        auto &faults = counts.shot_faults[shot];
+        faults.resize(r.get());
+        for (auto &count : faults)
+            count = r.get();
+    }
+    counts.groups.resize(r.get());
+    for (auto &group : counts.groups) {
+        group.ids = load_shot_ids(r);
+        group.locations = load_locations(r);
+        group.discarded = r.get();
+    }
+}
+static void save_enumeration(StateWriter &w, const FaultEnumeration &enumeration)
+{
+    w.put(enumeration.max_weight);
+    w.put(enumeration.shard);
+    w.put(enumeration.num_shards);
+    w.put(enumeration.first_faults);
+    w.put(enumeration.shot_faults.size());
+    for (auto &faults : enumeration.shot_faults) {
+        w.put(faults.size());
+        for (auto &fault : faults) {
+            w.put_string(fault.node);
+            w.put_signed(fault.tick);
+            w.put(fault.qubits.size());
+            for (int q : fault.qubits)
+                w.put(q);
+            w.put(fault.type);
+        }
+    }
+}
+static void load_enumeration(StateReader &r, FaultEnumeration &enumeration)
+{
+    enumeration.max_weight = r.get();
+    enumeration.shard = r.get();
+    enumeration.num_shards = r.get();
+    enumeration.first_faults = r.get();
+    enumeration.shot_faults.resize(r.get());
+    for (auto &faults : enumeration.shot_faults) {
+        faults.resize(r.get());
+        for (auto &fault : faults) {
+            fault.node = r.get_string();
+            fault.tick = r.get_signed();
+            fault.qubits.resize(r.get());
+            for (int &q : fault.qubits)
+                q = r.get();
+            fault.type = r.get();
+        }
+    }
+}
+// The statistics shared with the branches are written once, before the state of the simulators
+void BaseFrameSimulator::save_state(StateWriter &w) const
+{
+    std::ostringstream rng_state;
+    rng_state<<rng;
+    w.put_string(rng_state.str());
+    w.put(fault_counts != nullptr);
+    if (fault_counts != nullptr)
+        save_fault_counts(w, *fault_counts);
+    w.put(enumeration != nullptr);
+    if (enumeration != nullptr)
+        save_enumeration(w, *enumeration);
+    w.put(node_visits != nullptr);
+    if (node_visits != nullptr) {
+        w.put(node_visits->size());
+        for (auto &[node, visits] : *node_visits) {
+            w.put_node(node);
+            w.put(visits);
+        }
+    }
+    save_run_state(w);
+}
+// Shared statistics are loaded into the objects the simulator already has, if any, so that
+// callers holding them (e.g. the state of a fault enumeration) see the restored values
+void BaseFrameSimulator::load_state(StateReader &r)
+{
+    std::istringstream rng_state(r.get_string());
+    rng_state>>rng;
+    if (r.get()) {
+        if (fault_counts == nullptr)
+            fault_counts = std::make_shared<FaultCounts>();
+        load_fault_counts(r, *fault_counts);
+    } else {
+        fault_counts = nullptr;
+    }
+    if (r.get()) {
+        if (enumeration == nullptr)
+            enumeration = std::make_shared<FaultEnumeration>();
+        load_enumeration(r, *enumeration);
+    } else {
+        enumeration = nullptr;
+    }
+    if (r.get()) {
+        enable_node_visits();
+        node_visits->clear();
+        size_t num_nodes = r.get();
+        for (size_t i=0; i<num_nodes; i++) {
+            auto node = r.get_node();
+            (*node_visits)[node.get()] = r.get();
+        }
+    } else {
+        node_visits = nullptr;
+    }
+    create_callback_memos();
+    load_run_state(r);
+}
+void BaseFrameSimulator::save_run_state(StateWriter &w) const
+{
+    w.put(num_shots);
+    w.put_signed(current_tick);
+    w.put(error);
+    w.put(counter_rng);
+    w.put(counter_seed);
+    w.put(circuit_index);
+    w.put(sample_index);
+    save_shot_ids(w, shot_ids);
+    save_locations(w, fault_locations);
+    save_shots(w);
+    w.put_node(next_node);
+    w.put(finished);
+    w.put(branches.size());
+    for (auto &branch : branches)
+        branch->save_run_state(w);
+}
+void BaseFrameSimulator::load_run_state(StateReader &r)
+{
+    num_shots = r.get();
+    current_tick = r.get_signed();
+    error = r.get();
+    counter_rng = r.get();
+    counter_seed = r.get();
+    circuit_index = r.get();
+    sample_index = r.get();
+    shot_ids = load_shot_ids(r);
+    fault_locations = load_locations(r);
+    load_shots(r);
+    next_node = r.get_node();
+    finished = r.get();
+    branches.clear();
+    size_t num_branches = r.get();
+    for (size_t i=0; i<num_branches; i++) {
+        branches.push_back(new_branch());
+        branches.back()->load_run_state(r);
+    }
+}
@@ -1,19 +1,309 @@
 #pragma once
+#include <array>
+#include <deque>
 #include <random>
+#include <tuple>
 #include "circuit.h"
+#include "callback_memo.h"
+#include "trace.h"
 #define ERROR_X 1
 #define ERROR_Z 2
+// Pauli on up to two qubits, encoded as the error types: ERROR_X and ERROR_Z for the first qubit,
+// shifted by 2 bits for the second one. A leading sign is skipped, as signs don't affect frames
+// e.g. pauli_code("XZ") == ERROR_X|ERROR_Z<<2
+constexpr uint8_t pauli_code(const char *paulis)
+{
+    if (paulis[0] == '+' || paulis[0] == '-')
+        paulis++;
+    uint8_t code = 0;
+    for (int i=0; paulis[i] != 0; i++) {
+        uint8_t p = paulis[i] == 'X' ? ERROR_X : paulis[i] == 'Z' ? ERROR_Z : paulis[i] == 'Y' ? ERROR_X|ERROR_Z : 0;
+        code |= p<<(2*i);
+    }
+    return code;
+}
+// Action of a one or two qubit Clifford gate on Paulis, as a table with the image of every Pauli and its sign
+// The action is linear, so the table is generated from the images of X1, Z1, X2 and Z2 (the tableau),
+// given with their sign, e.g. "-Y". Frames only use the images, the tableau simulator the signs too
+struct CliffordTable
+{
+    int num_qubits;
+    std::array<uint8_t, 16> image;
+    // Bit p set if the image of Pauli p has a minus sign
+    uint16_t signs;
+    constexpr CliffordTable(const char *x1, const char *z1, const char *x2="_X", const char *z2="_Z") : num_qubits(0), image{}, signs(0)
+    {
+        uint8_t generators[4] = {pauli_code(x1), pauli_code(z1), pauli_code(x2), pauli_code(z2)};
+        bool negative[4] = {x1[0] == '-', z1[0] == '-', x2[0] == '-', z2[0] == '-'};
+        num_qubits = generators[2] == pauli_code("_X") && generators[3] == pauli_code("_Z") ? 1 : 2;
+        for (int p=0; p<16; p++) {
+            // Exponent of i of the image. Y = iXZ, so the image of a Pauli is the product of the images of its X and Z parts
+            int phase = 0;
+            for (int i=0; i<4; i++) {
+                if (!(p & (1<<i)))
+                    continue;
+                for (int q=0; q<2; q++)
+                    phase += pauli_phase((image[p]>>(2*q)) & 3, (generators[i]>>(2*q)) & 3);
+                phase += negative[i] ? 2 : 0;
+                image[p] ^= generators[i];
+            }
+            for (int q=0; q<2; q++)
+                phase += ((p>>(2*q)) & 3) == 3;
+            if ((phase & 3) == 2)
+                signs |= 1<<p;
+        }
+    }
+    // Image of the Pauli with a single X or Z (i=0 for X1, 1 for Z1, 2 for X2, 3 for Z2)
+    constexpr uint8_t generator(int i) const
+    {
+        return image[1<<i];
+    }
+    constexpr bool negative(int p) const
+    {
+        return (signs>>p) & 1;
+    }
+    private:
+    // Exponent of i in the product of the Paulis a and b of a qubit, given as error types
+    static constexpr int pauli_phase(int a, int b)
+    {
+        int xb = b & ERROR_X, zb = (b & ERROR_Z)>>1;
+        if (a == (ERROR_X|ERROR_Z))
+            return zb-xb;
+        if (a == ERROR_X)
+            return zb*(2*xb-1);
+        if (a == ERROR_Z)
+            return xb*(1-2*zb);
+        return 0;
+    }
+};
+// Table of a Clifford gate, nullptr for other instructions
+// Every gate has its own table, although some act in the same way on frames, e.g. S and SDG
+const CliffordTable *clifford_table(InstructionType type);
+// Global indices of the shots of a simulator, as ranges of consecutive indices in local shot order
+// Simulators reorder their shots when branching, so the global index of a shot is needed
+// to draw the same errors for it however the shots are grouped
+class ShotIds
+{
+    public:
+    struct Range
+    {
+        uint64_t first;
+        size_t count;
+        // Local index of the first shot
+        size_t local;
+    };
+    private:
+    std::vector<Range> ranges;
+    // Ranges ordered by global index, built when needed
+    mutable std::vector<Range> sorted_ranges;
+    size_t total=0;
+    public:
+    size_t size() const
+    {
+        return total;
+    }
+    // Adds count shots starting at global index first
+    void push_back(uint64_t first, size_t count=1);
+    // Adds the shots with local indices begin to end-1 of another set
+    void append(const ShotIds &o, size_t begin, size_t end);
+    void append(const ShotIds &o)
+    {
+        append(o, 0, o.size());
+    }
+    uint64_t global(size_t local) const;
+    const std::vector<Range> &get_ranges() const
+    {
+        return ranges;
+    }
+    const std::vector<Range> &sorted() const;
+};
+class StateWriter;
+class StateReader;
+class SamplingPipeline;
+// Fault injected by a fault enumeration: a Pauli on one or more qubits
+struct Fault
+{
+    // Node whose circuit contains the noise instruction, and timestep of the run
+    std::string node;
+    int tick;
+    std::vector<int> qubits;
+    // Error type of every qubit, 2 bits per qubit as in pauli_code()
+    int type;
+    bool operator<(const Fault &o) const
+    {
+        return std::tie(node, tick, qubits, type) < std::tie(o.node, o.tick, o.qubits, o.type);
+    }
+    bool operator==(const Fault &o) const
+    {
+        return std::tie(node, tick, qubits, type) == std::tie(o.node, o.tick, o.qubits, o.type);
+    }
+};
+// Writes the fault as e.g. X3*Z4 at tick 5 of node round
+std::ostream &operator<<(std::ostream &os, const Fault &fault);
+// Number of faults of every shot, by class of noise channel, to reweight results to other error rates
+// (see reweight.h). Shared with the simulators of the branches
+struct FaultCounts
+{
+    // Noise channels are classed by instruction type and fault probability per location
+    typedef std::pair<InstructionType, double> ChannelClass;
+    std::vector<ChannelClass> classes;
+    std::map<ChannelClass, int> class_index;
+    // Faults of every class in the shots with faults, by global shot index
+    std::map<uint64_t, std::vector<uint32_t>> shot_faults;
+    // Shots which ended after running the same fault locations, with the number of locations of every class
+    struct Group
+    {
+        ShotIds ids;
+        std::vector<uint64_t> locations;
+        // Shots discarded by post-selection
+        bool discarded;
+    };
+    std::vector<Group> groups;
+    uint64_t total_shots=0;
+};
+// State of an enumeration of faults, shared with the simulators of the branches (see fault_enumeration.h)
+struct FaultEnumeration
+{
+    // Maximum number of faults of a shot
+    int max_weight;
+    // First faults with index (in injection order) equal to shard modulo num_shards are injected
+    int shard;
+    int num_shards;
+    uint64_t first_faults=0;
+    // Faults of every shot, by global index
+    std::vector<std::vector<Fault>> shot_faults;
+};
 // Base class for a frame simulator which is capable to run circuit trees given the initial node
 class BaseFrameSimulator
 {
     protected:
     std::mt19937_64 &rng;
+    // Errors are drawn from a counter-based generator instead of rng, see use_counter_rng()
+    bool counter_rng=false;
+    uint64_t counter_seed=0;
+    ShotIds shot_ids;
+    // Number of circuits run in the path of the current shots, and of noise samples in the current circuit
+    // Together with the global shot index, they identify every fault location of a shot
+    uint64_t circuit_index=0;
+    uint64_t sample_index=0;
+    // Calls on_fault(shot, gen) for every shot where an event with probability p happens, with a
+    // random generator to draw the type of error
+    template<typename F>
+    void sample(double p, F on_fault);
+    // Starts the noise samples of a circuit
+    void begin_circuit()
+    {
+        circuit_index++;
+        sample_index = 0;
+        open_shots_valid = false;
+    }
+    // Instead of sampling noise, every shot with less than max_weight faults is copied
+    // at every noise instruction, once for every possible fault, which is injected in the copy
+    std::shared_ptr<FaultEnumeration> enumeration;
+    // Local indices of the shots with less than max_weight faults, in increasing order. Built at the
+    // first noise instruction of every circuit, since shots are only reordered between circuits
+    std::vector<size_t> open_shots;
+    bool open_shots_valid=false;
+    // Node being run, for the description of injected faults
+    const CircuitNode *current_node=nullptr;
+    void inject_faults(std::vector<int> qubits, std::vector<int> types);
+    // Adds a shot with the same frame and measurement records as another one, returning its local index
+    virtual size_t duplicate_shot(size_t shot)=0;
+    // Circuits run instead of those of the nodes, by the circuit of the node (see set_circuit_map())
+    std::shared_ptr<const std::map<const Circuit*, SharedCircuit>> circuit_map;
+    const SharedCircuit &node_circuit(const CircuitNode &node) const
+    {
+        if (circuit_map != nullptr) {
+            auto it = circuit_map->find(node.circuit.operator->());
+            if (it != circuit_map->end())
+                return it->second;
+        }
+        return node.circuit;
+    }
+    // Fault counts of the shots, nullptr unless enable_fault_counts() has been called
+    std::shared_ptr<FaultCounts> fault_counts;
+    // Number of fault locations of every class run by the shots of this simulator, since the start of the tree
+    std::vector<uint64_t> fault_locations;
+    // Type of the instruction being run, for the class of its noise channel
+    InstructionType current_instruction;
+    // Records the fault locations of shots which won't run more nodes
+    void end_shots(const ShotIds &ids, bool discarded)
+    {
+        if (fault_counts != nullptr && ids.size() > 0)
+            fault_counts->groups.push_back(FaultCounts::Group{ids, fault_locations, discarded});
+    }
+    // Global shot indices are tracked when they identify the errors of a shot
+    bool track_shot_ids() const
+    {
+        return counter_rng || enumeration != nullptr || fault_counts != nullptr;
+    }
+    // Number of shots which have run every node, shared with the simulators of the branches
+    // nullptr unless enable_node_visits() has been called
+    std::shared_ptr<std::map<const CircuitNode*, uint64_t>> node_visits;
+    // Memos of the callbacks of nodes with pure_callbacks set, shared with the simulators of the branches
+    struct CallbackMemos
+    {
+        CallbackMemo<int> next_node_index;
+        CallbackMemo<std::pair<std::set<int>,std::set<int>>> error_corrections;
+    };
+    // Created by start() and load_state(), before the simulators of the branches copy it
+    std::shared_ptr<std::map<std::shared_ptr<const CircuitNode>, CallbackMemos>> callback_memos;
+    void create_callback_memos()
+    {
+        if (callback_memos == nullptr)
+            callback_memos = std::make_shared<std::map<std::shared_ptr<const CircuitNode>, CallbackMemos>>();
+    }
+    // Memos of the callbacks of a node, nullptr if they are not declared pure
+    CallbackMemos *node_memos(const std::shared_ptr<CircuitNode> &node)
+    {
+        if (!node->pure_callbacks || callback_memos == nullptr)
+            return nullptr;
+        return &(*callback_memos)[node];
+    }
+    // Producer threads drawing the faults of the noise instructions ahead of the propagation of the frames,
+    // nullptr unless enable_pipelined_sampling() has been called. Shared with the simulators of the branches
+    std::shared_ptr<SamplingPipeline> pipeline;
+    // Runs a circuit applying the faults drawn by the pipeline
+    void run_pipelined(const Circuit &circ);
+    // Copies the sampling state and the statistics to the simulator of a branch, which will run the following circuit
+    void copy_sampling_state(BaseFrameSimulator &sim) const
+    {
+        sim.counter_rng = counter_rng;
+        sim.counter_seed = counter_seed;
+        sim.circuit_index = circuit_index;
+        sim.node_visits = node_visits;
+        sim.enumeration = enumeration;
+        sim.fault_counts = fault_counts;
+        sim.fault_locations = fault_locations;
+        sim.circuit_map = circuit_map;
+        sim.callback_memos = callback_memos;
+        sim.pipeline = pipeline;
+    }
     // Randomly determines the index of next faulty shot
     std::bernoulli_distribution randomizer;
     // Randomly picks a number between 1 and 3 for single qubit depolarizing
     std::uniform_int_distribution<> depolarizer1;
     // Randomly picks a number between 1 and 15 for two-qubit depolarizing
     std::uniform_int_distribution<> depolarizer2;
+    // Node to be run next, nullptr once the shots have been split into branches or have ended
+    std::shared_ptr<CircuitNode> next_node;
+    // Simulators of the branches of the last node run, each one with the shots of a branch. They are run
+    // in order until the end of the tree, and their shots are merged back with merge_branch()
+    std::deque<std::unique_ptr<BaseFrameSimulator>> branches;
+    // Whether the shots have ended, or the branches have been merged back
+    bool finished=true;
+    // Runs next_node
+    void run_next_node();
+    // Empty simulator of the same class for a branch, sharing the sampling state and statistics
+    virtual std::unique_ptr<BaseFrameSimulator> new_branch()=0;
+    // Appends the shots of a branch which has finished
+    virtual void merge_branch(BaseFrameSimulator &branch)=0;
+    // State of the simulator but rng, which is shared with the branches
+    void save_run_state(StateWriter &w) const;
+    void load_run_state(StateReader &r);
+    // Frames and measurement records of the shots
+    virtual void save_shots(StateWriter &w) const=0;
+    virtual void load_shots(StateReader &r)=0;
     // Current timestep of the simulation
     int current_tick=0;
     // Number of shots
@@ -30,20 +320,120 @@ class BaseFrameSimulator
     virtual void cx(int control, int target)=0;
     virtual void cz(int q1, int q2)=0;
     virtual void mx(int qubit, MeasurementTag tag)=0;
+    virtual void my(int qubit, MeasurementTag tag)=0;
     virtual void mz(int qubit, MeasurementTag tag)=0;
     virtual void rx(int qubit)=0;
+    virtual void ry(int qubit)=0;
     virtual void rz(int qubit)=0;
+    // Applies any Clifford gate given by its table
+    virtual void clifford1(int qubit, const CliffordTable &table)=0;
+    virtual void clifford2(int q1, int q2, const CliffordTable &table)=0;
     virtual void x_error(int qubit, double p);
     virtual void y_error(int qubit, double p);
     virtual void z_error(int qubit, double p);
-    virtual void depolarize(std::vector<int> &qubits, double p);
+    virtual void depolarize(Span<int> qubits, double p);
     virtual void depolarize1(int qubit, double p);
     virtual void depolarize2(int control, int target, double p);
-    virtual void pauli1(int qubit, std::vector<double> &p);
-    virtual void pauli2(int q1, int q2, std::vector<double> &p);
-    virtual void run(Instruction &instruction);
-    virtual void run(Circuit &circ);
-    virtual void run(std::shared_ptr<CircuitNode> node)=0;
+    virtual void pauli1(int qubit, Span<double> p);
+    virtual void pauli2(int q1, int q2, Span<double> p);
+    virtual void run(const InstructionRef &instruction);
+    virtual void run(const Circuit &circ);
+    // Runs a circuit recording the noise sampling of every layer and the faulty shots at every TICK (see trace.h)
+    void run_traced(const Circuit &circ);
+    // Runs the circuit of a node and its corrections. If all shots continue to the same child,
+    // it is returned to be run next. Otherwise the shots are moved to new simulators, one per branch,
+    // which are added to branches, and nullptr is returned
+    virtual std::shared_ptr<CircuitNode> run_node(std::shared_ptr<CircuitNode> node)=0;
+    // Starts a run of the tree at node, whose nodes are run one at a time by step()
+    void start(std::shared_ptr<CircuitNode> node)
+    {
+        next_node = node;
+        branches.clear();
+        finished = node == nullptr;
+        create_callback_memos();
+    }
+    // Runs the next node of the run, in this simulator or in the simulator of a branch,
+    // or merges back a branch which has reached the end of the tree. Returns false once the run has finished
+    bool step();
+    virtual void run(std::shared_ptr<CircuitNode> node)
+    {
+        start(node);
+        while (step());
+    }
+    // Writes and reads back the whole simulation state, including the state of rng and the simulators of
+    // the branches being run, so that a run is resumed with step() (see checkpoint.h)
+    void save_state(StateWriter &w) const;
+    void load_state(StateReader &r);
+    // Approximate number of bytes used by the frames and measurement records of the shots
+    virtual size_t memory_usage() const=0;
+    // Number of shots with errors in their frames, for the trace. -1 if the simulator can't tell them apart
+    virtual int64_t num_faulty_shots() const
+    {
+        return -1;
+    }
     virtual void flip_error(size_t shot, int qubit, int type)=0;
+    // Calls f(shot, qubit, tag) for every flipped measurement, with the local index of the shot
+    virtual void for_each_flip(std::function<void(size_t, int, const MeasurementTag&)> f) const=0;
     inline size_t get_num_shots() { return num_shots; }
+    // Draws errors from a Philox generator keyed by the seed, the global shot index and the fault location,
+    // instead of the shared std::mt19937_64. Every shot then gets the same errors however shots are split
+    // between simulators, and shot i of a run is replayed by a simulator of 1 shot with first_shot=i
+    // Must be called before running the first circuit
+    void use_counter_rng(uint64_t seed, uint64_t first_shot=0)
+    {
+        counter_rng = true;
+        counter_seed = seed;
+        shot_ids = ShotIds();
+        shot_ids.push_back(first_shot, num_shots);
+    }
+    const ShotIds &get_shot_ids() const
+    {
+        return shot_ids;
+    }
+    // Enumerates faults instead of sampling noise. The simulator must start with a single shot,
+    // without faults, which has global index 0 (see fault_enumeration.h)
+    void enumerate_faults(std::shared_ptr<FaultEnumeration> state)
+    {
+        enumeration = state;
+        shot_ids = ShotIds();
+        shot_ids.push_back(0, num_shots);
+        enumeration->shot_faults.resize(num_shots);
+    }
+    // Runs the given circuits instead of those of the nodes, e.g. noisy versions of the circuits of a noiseless tree
+    // Nodes are not modified, so several simulators can run the same tree with different noise
+    void set_circuit_map(std::shared_ptr<const std::map<const Circuit*, SharedCircuit>> map)
+    {
+        circuit_map = map;
+    }
+    // Draws the faults of every circuit in num_producers threads, while this one propagates the frames
+    // (see sampling_pipeline.h). Only used with use_counter_rng(), so results are the same as without it.
+    // Fault enumerations and fault counts are run without the pipeline, as well as circuits run
+    // while recording a trace or from fault tables. Builds without FRAMESIM_THREADS print a warning and
+    // draw the faults in this thread
+    void enable_pipelined_sampling(int num_producers=1);
+    // Counts the faults of every shot, to reweight its results to other error rates (see reweight.h)
+    // Must be called before running the first circuit, and after use_counter_rng()
+    void enable_fault_counts()
+    {
+        fault_counts = std::make_shared<FaultCounts>();
+        fault_counts->total_shots = num_shots;
+        if (shot_ids.size() != num_shots) {
+            shot_ids = ShotIds();
+            shot_ids.push_back(0, num_shots);
+        }
+    }
+    const FaultCounts &get_fault_counts() const
+    {
+        return *fault_counts;
+    }
+    // Counts the shots that run every node, see get_node_visits()
+    void enable_node_visits()
+    {
+        if (node_visits == nullptr)
+            node_visits = std::make_shared<std::map<const CircuitNode*, uint64_t>>();
+    }
+    const std::map<const CircuitNode*, uint64_t> &get_node_visits() const
+    {
+        return *node_visits;
+    }
 };
\ No newline at end of file
@@ -0,0 +1,180 @@
+#include "sweep.h"
+#include "analysis.h"
+#include "driver.h"
+#include "nonsparsesim.h"
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#ifndef NO_THREADS
+#include <atomic>
+#include <thread>
+#endif
+std::vector<SweepPoint> sweep_grid(const std::map<std::string, std::vector<double>> &values)
+{
+    std::vector<SweepPoint> points = {SweepPoint()};
+    for (auto &[name, list] : values) {
+        std::vector<SweepPoint> extended;
+        for (auto &point : points) {
+            for (double value : list) {
+                extended.push_back(point);
+                extended.back()[name] = value;
+            }
+        }
+        points = std::move(extended);
+    }
+    return points;
+}
+// Distinct circuits of a tree, and the circuit of every node
+struct TreeCircuits
+{
+    CircuitStore store;
+    std::vector<std::shared_ptr<const Circuit>> distinct;
+    std::map<const Circuit*, int> node_circuit;
+    TreeCircuits(std::shared_ptr<CircuitNode> root)
+    {
+        std::map<const Circuit*, int> index;
+        for (auto &node : reachable_nodes(root)) {
+            auto circ = node->circuit.share();
+            if (node_circuit.count(circ.get()))
+                continue;
+            auto interned = store.intern(circ);
+            auto [it, inserted] = index.try_emplace(interned.get(), distinct.size());
+            if (inserted)
+                distinct.push_back(interned);
+            node_circuit[circ.get()] = it->second;
+        }
+    }
+};
+static SweepResult run_point(std::shared_ptr<CircuitNode> root, const TreeCircuits &circuits, const SweepPoint &point,
+    std::function<std::unique_ptr<NoiseModel>(const SweepPoint&)> make_noise,
+    std::function<bool(MeasurementResults&)> logical_error, const SweepOptions &options)
+{
+    auto start = std::chrono::steady_clock::now();
+    auto noise = make_noise(point);
+    std::vector<SharedCircuit> noisy;
+    for (auto &circ : circuits.distinct)
+        noisy.push_back(noise->noisy_circuit(*circ));
+    auto map = std::make_shared<std::map<const Circuit*, SharedCircuit>>();
+    for (auto &[circ, index] : circuits.node_circuit)
+        (*map)[circ] = noisy[index];
+    SweepResult result{point, options.shots, 0, 0, 0};
+    MeasurementResultsSparse no_flips;
+    bool fails_without_flips = logical_error(no_flips);
+    // Only used by the randomization of the dense simulator
+    std::mt19937_64 rng(options.seed);
+    auto make_simulator = [&](size_t num_shots, uint64_t first_shot) {
+        std::unique_ptr<BaseFrameSimulator> sim;
+        if (options.dense)
+            sim = std::make_unique<DenseFrameSimulator>(num_shots, rng);
+        else
+            sim = std::make_unique<FrameSimulator>(num_shots, rng);
+        sim->use_counter_rng(options.seed, first_shot);
+        sim->set_circuit_map(map);
+        return sim;
+    };
+    run_chunked(root, options.shots, options.memory_budget, make_simulator, [&](BaseFrameSimulator &sim, uint64_t) {
+        result.kept_shots += sim.get_num_shots();
+        std::map<size_t, MeasurementResultsSparse> results;
+        sim.for_each_flip([&](size_t shot, int qubit, const MeasurementTag &tag) {
+            results[shot].results[qubit].insert(tag);
+        });
+        if (fails_without_flips)
+            result.logical_errors += sim.get_num_shots()-results.size();
+        for (auto &[shot, res] : results)
+            result.logical_errors += logical_error(res);
+    });
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+    return result;
+}
+std::vector<SweepResult> run_sweep(std::shared_ptr<CircuitNode> root, const std::vector<SweepPoint> &points,
+    std::function<std::unique_ptr<NoiseModel>(const SweepPoint&)> make_noise,
+    std::function<bool(MeasurementResults&)> logical_error, const SweepOptions &options)
+{
+    // Also builds lazily built nodes, before the threads share the tree
+    TreeCircuits circuits(root);
+    std::vector<SweepResult> results(points.size());
+#ifndef NO_THREADS
+    std::atomic<size_t> next = 0;
+    std::vector<std::thread> threads;
+    for (int i=0; i<std::min<size_t>(std::max(options.num_threads, 1), points.size()); i++) {
+        threads.emplace_back([&]() {
+            for (size_t j; (j = next++) < points.size(); )
+                results[j] = run_point(root, circuits, points[j], make_noise, logical_error, options);
+        });
+    }
+    for (auto &thread : threads)
+        thread.join();
+#else
+    for (size_t j=0; j<points.size(); j++)
+        results[j] = run_point(root, circuits, points[j], make_noise, logical_error, options);
+#endif
+    return results;
+}
+// Parameter names are quoted, doubling the quotes they contain
+static void write_csv_string(std::ostream &os, const std::string &str)
+{
+    os<<"\"";
+    for (char c : str)
+        os<<(c == '"' ? "\"\"" : std::string(1, c));
+    os<<"\"";
+}
+void write_csv(std::ostream &os, const std::vector<SweepResult> &results)
+{
+    if (results.empty())
+        return;
+    for (auto &[name, value] : results[0].point) {
+        write_csv_string(os, name);
+        os<<",";
+    }
+    os<<"shots,kept_shots,logical_errors,logical_error_rate,seconds\n";
+    os<<std::setprecision(15);
+    for (auto &result : results) {
+        for (auto &[name, value] : result.point)
+            os<<value<<",";
+        double rate = result.kept_shots > 0 ? (double)result.logical_errors/result.kept_shots : 0;
+        os<<result.shots<<","<<result.kept_shots<<","<<result.logical_errors<<","<<rate<<","<<result.seconds<<"\n";
+    }
+}
+static void write_json_string(std::ostream &os, const std::string &str)
+{
+    os<<"\"";
+    for (unsigned char c : str) {
+        if (c == '"' || c == '\\')
+            os<<"\\"<<c;
+        else if (c < 0x20)
+            os<<"\\u"<<std::hex<<std::setw(4)<<std::setfill('0')<<(int)c<<std::dec<<std::setfill(' ');
+        else
+            os<<c;
+    }
+    os<<"\"";
+}
+// JSON has no representation for NaN and infinities
+static void write_json_number(std::ostream &os, double value)
+{
+    if (std::isfinite(value))
+        os<<value;
+    else
+        os<<"null";
+}
+void write_json(std::ostream &os, const std::vector<SweepResult> &results)
+{
+    os<<std::setprecision(15)<<"[";
+    for (size_t i=0; i<results.size(); i++) {
+        auto &result = results[i];
+        os<<(i > 0 ? ",\n" : "\n")<<"  {";
+        for (auto &[name, value] : result.point) {
+            write_json_string(os, name);
+            os<<": ";
+            write_json_number(os, value);
+            os<<", ";
+        }
+        double rate = result.kept_shots > 0 ? (double)result.logical_errors/result.kept_shots : 0;
+        os<<"\"shots\": "<<result.shots<<", \"kept_shots\": "<<result.kept_shots<<", \"logical_errors\": "<<result.logical_errors
+            <<", \"logical_error_rate\": ";
+        write_json_number(os, rate);
+        os<<", \"seconds\": ";
+        write_json_number(os, result.seconds);
+        os<<"}";
+    }
+    os<<"\n]\n";
+}
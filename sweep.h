@@ -0,0 +1,39 @@
+#pragma once
+#include "noise.h"
+#include <ostream>
+// Point of a parameter sweep, as the value of every parameter by name
+typedef std::map<std::string, double> SweepPoint;
+struct SweepResult
+{
+    SweepPoint point;
+    uint64_t shots;
+    // Shots not discarded by post-selection, and shots with a logical error
+    uint64_t kept_shots;
+    uint64_t logical_errors;
+    double seconds;
+};
+struct SweepOptions
+{
+    uint64_t shots;
+    uint64_t seed=0;
+    // Points are run concurrently by a pool of threads
+    int num_threads=1;
+    // Use DenseFrameSimulator instead of FrameSimulator
+    bool dense=false;
+    // Memory budget of every point, in bytes (see run_chunked())
+    size_t memory_budget=size_t(1)<<30;
+};
+// Every combination of the values of the parameters
+std::vector<SweepPoint> sweep_grid(const std::map<std::string, std::vector<double>> &values);
+// Runs a noiseless tree with the noise model of every point. The tree is not modified nor copied:
+// the noisy version of every distinct circuit is built once per point, and the simulators run them
+// instead of the circuits of the nodes (see BaseFrameSimulator::set_circuit_map()).
+// Errors are drawn with use_counter_rng(seed), so results don't depend on the number of threads.
+// make_noise(), logical_error() and the callbacks of the nodes must be thread-safe
+std::vector<SweepResult> run_sweep(std::shared_ptr<CircuitNode> root, const std::vector<SweepPoint> &points,
+    std::function<std::unique_ptr<NoiseModel>(const SweepPoint&)> make_noise,
+    std::function<bool(MeasurementResults&)> logical_error, const SweepOptions &options);
+// Writes the results as a table with a column for every parameter. Parameter names are quoted and
+// escaped, and JSON output writes null for non-finite numbers
+void write_csv(std::ostream &os, const std::vector<SweepResult> &results);
+void write_json(std::ostream &os, const std::vector<SweepResult> &results);
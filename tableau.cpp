@@ -0,0 +1,326 @@
+#include "tableau.h"
+#include "analysis.h"
+#include "simulator.h"
+#include <algorithm>
+#include <iostream>
+TableauSimulator::TableauSimulator(int num_qubits) : num_qubits(num_qubits), words((num_qubits+63)/64)
+{
+    xs.resize((2*num_qubits+1)*words);
+    zs.resize((2*num_qubits+1)*words);
+    signs.resize(2*num_qubits+1);
+    // Initial state |0...0>: destabilizers X_i, stabilizers Z_i
+    for (int q=0; q<num_qubits; q++) {
+        x_row(q)[q>>6] |= UINT64_C(1)<<(q&63);
+        z_row(num_qubits+q)[q>>6] |= UINT64_C(1)<<(q&63);
+    }
+}
+void TableauSimulator::rowsum(size_t h, size_t i)
+{
+    uint64_t *x1 = x_row(h), *z1 = z_row(h);
+    const uint64_t *x2 = x_row(i), *z2 = z_row(i);
+    // Exponent of i of the product, counted modulo 4 in parallel for every bit of the words
+    uint64_t count1 = 0, count2 = 0;
+    for (size_t w=0; w<words; w++) {
+        uint64_t old_x1 = x1[w], old_z1 = z1[w];
+        x1[w] ^= x2[w];
+        z1[w] ^= z2[w];
+        uint64_t x1z2 = old_x1 & z2[w];
+        uint64_t anticommutes = (x2[w] & old_z1) ^ x1z2;
+        count2 ^= (count1 ^ x1[w] ^ z1[w] ^ x1z2) & anticommutes;
+        count1 ^= anticommutes;
+    }
+    int phase = std::bitset<64>(count1).count() + 2*std::bitset<64>(count2).count() + 2*signs[h] + 2*signs[i];
+    signs[h] = (phase & 3) == 2;
+}
+void TableauSimulator::apply(int qubit, const CliffordTable &table)
+{
+    size_t w = qubit>>6;
+    int shift = qubit&63;
+    for (size_t row=0; row<2*num_qubits; row++) {
+        uint64_t &x = xs[row*words+w], &z = zs[row*words+w];
+        int pauli = ((x>>shift) & 1) | ((z>>shift) & 1)<<1;
+        uint8_t image = table.image[pauli];
+        x = (x & ~(UINT64_C(1)<<shift)) | (uint64_t)(image & 1)<<shift;
+        z = (z & ~(UINT64_C(1)<<shift)) | (uint64_t)((image>>1) & 1)<<shift;
+        signs[row] ^= table.negative(pauli);
+    }
+}
+void TableauSimulator::apply(int q1, int q2, const CliffordTable &table)
+{
+    size_t w1 = q1>>6, w2 = q2>>6;
+    int s1 = q1&63, s2 = q2&63;
+    for (size_t row=0; row<2*num_qubits; row++) {
+        uint64_t *x = x_row(row), *z = z_row(row);
+        int pauli = ((x[w1]>>s1) & 1) | ((z[w1]>>s1) & 1)<<1 | ((x[w2]>>s2) & 1)<<2 | ((z[w2]>>s2) & 1)<<3;
+        if (pauli == 0)
+            continue;
+        uint8_t image = table.image[pauli];
+        x[w1] = (x[w1] & ~(UINT64_C(1)<<s1)) | (uint64_t)(image & 1)<<s1;
+        z[w1] = (z[w1] & ~(UINT64_C(1)<<s1)) | (uint64_t)((image>>1) & 1)<<s1;
+        x[w2] = (x[w2] & ~(UINT64_C(1)<<s2)) | (uint64_t)((image>>2) & 1)<<s2;
+        z[w2] = (z[w2] & ~(UINT64_C(1)<<s2)) | (uint64_t)((image>>3) & 1)<<s2;
+        signs[row] ^= table.negative(pauli);
+    }
+}
+bool TableauSimulator::measure_z(int qubit, bool &random)
+{
+    size_t n = num_qubits;
+    // The outcome is random if a stabilizer anticommutes with Z
+    size_t p = n;
+    while (p < 2*n && !x_bit(p, qubit))
+        p++;
+    random = p < 2*n;
+    if (random) {
+        for (size_t i=0; i<2*n; i++) {
+            if (i != p && x_bit(i, qubit))
+                rowsum(i, p);
+        }
+        std::copy(x_row(p), x_row(p)+words, x_row(p-n));
+        std::copy(z_row(p), z_row(p)+words, z_row(p-n));
+        signs[p-n] = signs[p];
+        std::fill(x_row(p), x_row(p)+words, 0);
+        std::fill(z_row(p), z_row(p)+words, 0);
+        z_row(p)[qubit>>6] |= UINT64_C(1)<<(qubit&63);
+        signs[p] = 0;
+        return false;
+    }
+    // Otherwise, Z is the product of the stabilizers paired with the destabilizers which anticommute with it
+    size_t scratch = 2*n;
+    std::fill(x_row(scratch), x_row(scratch)+words, 0);
+    std::fill(z_row(scratch), z_row(scratch)+words, 0);
+    signs[scratch] = 0;
+    for (size_t i=0; i<n; i++) {
+        if (x_bit(i, qubit))
+            rowsum(scratch, i+n);
+    }
+    return signs[scratch];
+}
+void TableauSimulator::reset_z(int qubit)
+{
+    bool random;
+    if (measure_z(qubit, random))
+        apply(qubit, *clifford_table(InstructionType::X));
+}
+void TableauSimulator::run(const InstructionRef &instruction)
+{
+    auto *table = clifford_table(instruction.type);
+    if (table != nullptr) {
+        // Two-qubit rotations act on every pair of their targets, as in the frame simulators
+        if (instruction.type >= InstructionType::SXX) {
+            for (size_t j=1; j<instruction.targets.size(); j++) {
+                for (size_t i=0; i<j; i++)
+                    apply(instruction.targets[i], instruction.targets[j], *table);
+            }
+        } else if (instruction.type >= InstructionType::CX) {
+            for (size_t i=0; i+1<instruction.targets.size(); i+=2)
+                apply(instruction.targets[i], instruction.targets[i+1], *table);
+        } else {
+            for (int qubit : instruction.targets)
+                apply(qubit, *table);
+        }
+        return;
+    }
+    switch (instruction.type) {
+        case InstructionType::MX:
+        case InstructionType::MY:
+        case InstructionType::MZ:
+            for (int qubit : instruction.targets) {
+                // Rotate the measured basis to Z and back
+                if (instruction.type == InstructionType::MY)
+                    apply(qubit, *clifford_table(InstructionType::SDG));
+                if (instruction.type != InstructionType::MZ)
+                    apply(qubit, *clifford_table(InstructionType::H));
+                bool random;
+                bool outcome = measure_z(qubit, random);
+                measurements.push_back({qubit, *instruction.measurement_tag, outcome, random});
+                if (instruction.type != InstructionType::MZ)
+                    apply(qubit, *clifford_table(InstructionType::H));
+                if (instruction.type == InstructionType::MY)
+                    apply(qubit, *clifford_table(InstructionType::S));
+            }
+            break;
+        case InstructionType::RX:
+        case InstructionType::RY:
+        case InstructionType::RZ:
+            for (int qubit : instruction.targets) {
+                reset_z(qubit);
+                if (instruction.type != InstructionType::RZ)
+                    apply(qubit, *clifford_table(InstructionType::H));
+                if (instruction.type == InstructionType::RY)
+                    apply(qubit, *clifford_table(InstructionType::S));
+            }
+            break;
+        default:
+            // Noise, delays and ticks
+            break;
+    }
+}
+void TableauSimulator::run(const Circuit &circ)
+{
+    if (circ.num_qubits > num_qubits) {
+        std::cerr<<"Circuit with "<<circ.num_qubits<<" qubits run by a tableau of "<<num_qubits<<std::endl;
+        abort();
+    }
+    for (auto instruction : circ.instructions)
+        run(instruction);
+}
+std::vector<uint64_t> TableauSimulator::canonical_stabilizers() const
+{
+    // Stabilizers are brought to a canonical form by Gaussian elimination, first on the X bits of every
+    // qubit and then on the Z bits, so that equal groups give equal rows
+    TableauSimulator canonical = *this;
+    size_t n = num_qubits;
+    size_t pivot = n;
+    for (int pass=0; pass<2; pass++) {
+        for (int qubit=0; qubit<num_qubits && pivot<2*n; qubit++) {
+            auto has_bit = [&](size_t row) {
+                auto &bits = pass == 0 ? canonical.xs : canonical.zs;
+                return (bits[row*words+(qubit>>6)]>>(qubit&63)) & 1;
+            };
+            size_t row = pivot;
+            while (row < 2*n && !has_bit(row))
+                row++;
+            if (row == 2*n)
+                continue;
+            if (row != pivot) {
+                std::swap_ranges(canonical.x_row(row), canonical.x_row(row)+words, canonical.x_row(pivot));
+                std::swap_ranges(canonical.z_row(row), canonical.z_row(row)+words, canonical.z_row(pivot));
+                std::swap(canonical.signs[row], canonical.signs[pivot]);
+            }
+            for (size_t i=n; i<2*n; i++) {
+                if (i != pivot && has_bit(i))
+                    canonical.rowsum(i, pivot);
+            }
+            pivot++;
+        }
+    }
+    std::vector<uint64_t> rows(canonical.xs.begin()+n*words, canonical.xs.begin()+2*n*words);
+    rows.insert(rows.end(), canonical.zs.begin()+n*words, canonical.zs.begin()+2*n*words);
+    for (size_t row=n; row<2*n; row+=64) {
+        uint64_t word = 0;
+        for (size_t i=row; i<std::min(row+64, 2*n); i++)
+            word |= (uint64_t)canonical.signs[i]<<(i-row);
+        rows.push_back(word);
+    }
+    return rows;
+}
+bool ReferenceCheck::ok() const
+{
+    for (auto &random : random_measurements) {
+        if (!random.read_by.empty())
+            return false;
+    }
+    return true;
+}
+// Results without flips, recording the measurements read by the callbacks of a node
+struct RecordedReads final : MeasurementResults
+{
+    MeasurementResultsSparse results;
+    std::vector<MeasurementRef> reads;
+    bool is_flipped(int qubit, const MeasurementTag &tag) override
+    {
+        reads.push_back({qubit, tag});
+        return results.is_flipped(qubit, tag);
+    }
+    bool reset_flipped(int qubit, const MeasurementTag &tag) override
+    {
+        reads.push_back({qubit, tag});
+        return results.reset_flipped(qubit, tag);
+    }
+    void flip(int qubit, const MeasurementTag &tag) override
+    {
+        results.flip(qubit, tag);
+    }
+};
+ReferenceCheck check_reference(std::shared_ptr<CircuitNode> root, uint64_t max_node_runs)
+{
+    ReferenceCheck check;
+    auto nodes = reachable_nodes(root);
+    int num_qubits = 0;
+    for (auto &node : nodes)
+        num_qubits = std::max(num_qubits, node->circuit->num_qubits);
+    // Random measurements found, and the measuring node of the random measurements of a path
+    std::map<std::tuple<std::string, int, MeasurementTag>, size_t> found;
+    typedef std::map<std::pair<int, MeasurementTag>, std::string> PathRandoms;
+    // Nodes already run, by the state and random measurements before them
+    std::set<std::tuple<const CircuitNode*, std::vector<uint64_t>, PathRandoms>> visited;
+    struct Frame
+    {
+        std::shared_ptr<CircuitNode> node;
+        TableauSimulator state;
+        PathRandoms randoms;
+        // Whether the path is followed by shots without errors
+        bool noiseless;
+        // Depth of the frame in the path
+        size_t depth;
+    };
+    // Nodes of the current path, to stop at loops
+    std::vector<const CircuitNode*> path;
+    // Explicit stack, as trees can be deeper than the call stack allows
+    std::vector<Frame> stack;
+    stack.push_back({root, TableauSimulator(num_qubits), {}, true, 0});
+    while (!stack.empty()) {
+        Frame frame = std::move(stack.back());
+        stack.pop_back();
+        path.resize(frame.depth);
+        auto &node = frame.node;
+        if (std::find(path.begin(), path.end(), node.get()) != path.end())
+            continue;
+        // The noiseless path is always run, to record the reference
+        bool first_visit = visited.insert({node.get(), frame.state.canonical_stabilizers(), frame.randoms}).second;
+        if (!first_visit && !frame.noiseless)
+            continue;
+        if (check.node_runs == max_node_runs) {
+            check.truncated = true;
+            break;
+        }
+        check.node_runs++;
+        path.push_back(node.get());
+        auto &state = frame.state;
+        state.measurements.clear();
+        state.run(*node->circuit);
+        for (auto &m : state.measurements) {
+            if (frame.noiseless)
+                check.reference.push_back(m);
+            if (!m.random)
+                continue;
+            frame.randoms[{m.qubit, m.tag}] = node->name;
+            auto [it, inserted] = found.try_emplace({node->name, m.qubit, m.tag}, check.random_measurements.size());
+            if (inserted)
+                check.random_measurements.push_back({node->name, {m.qubit, m.tag}, {}});
+        }
+        // Measurements read by the node
+        RecordedReads results;
+        if (node->error_corrections)
+            node->error_corrections(results);
+        int noiseless_branch = 0;
+        if (node->branch_condition)
+            noiseless_branch = node->branch_condition->get_branch(UINT64_C(0));
+        else if (node->next_node_index)
+            noiseless_branch = node->next_node_index(results);
+        auto reads = std::move(results.reads);
+        if (node->branch_condition)
+            reads.insert(reads.end(), node->branch_condition->syndrome.begin(), node->branch_condition->syndrome.end());
+        for (auto &table : node->correction_tables)
+            reads.insert(reads.end(), table.syndrome.begin(), table.syndrome.end());
+        for (auto &ref : reads) {
+            auto it = frame.randoms.find({ref.qubit, ref.tag});
+            if (it != frame.randoms.end())
+                check.random_measurements[found[{it->second, ref.qubit, ref.tag}]].read_by.insert(node->name);
+        }
+        // The noiseless branch is pushed last, so that it is run first
+        for (size_t i=node->childs.size(); i-- > 0; ) {
+            if ((int)i == noiseless_branch)
+                continue;
+            auto child = node->get_child(i);
+            if (child != nullptr)
+                stack.push_back({child, state, frame.randoms, false, frame.depth+1});
+        }
+        if (noiseless_branch >= 0 && noiseless_branch < (int)node->childs.size()) {
+            auto child = node->get_child(noiseless_branch);
+            if (child != nullptr)
+                stack.push_back({child, std::move(state), std::move(frame.randoms), frame.noiseless, frame.depth+1});
+        }
+    }
+    return check;
+}
@@ -0,0 +1,87 @@
+#pragma once
+#include "circuit.h"
+struct CliffordTable;
+// Noiseless stabilizer simulator (Aaronson-Gottesman tableau), to check the reference of frame simulations
+// Rows hold the destabilizers and stabilizers of the state as Pauli strings packed in 64-bit words,
+// so gates take time linear in the number of qubits, and measurements quadratic over 64.
+// Noise instructions are ignored, and random measurement outcomes are taken as 0
+class TableauSimulator
+{
+    public:
+    struct Measurement
+    {
+        int qubit;
+        MeasurementTag tag;
+        bool outcome;
+        // Whether the outcome is random instead of determined by the previous instructions
+        bool random;
+    };
+    // Measurements made since the last clear
+    std::vector<Measurement> measurements;
+    TableauSimulator(int num_qubits);
+    int get_num_qubits() const
+    {
+        return num_qubits;
+    }
+    void run(const InstructionRef &instruction);
+    void run(const Circuit &circ);
+    // Measures a qubit in the Z basis, returning the outcome
+    bool measure_z(int qubit, bool &random);
+    void reset_z(int qubit);
+    // X bits, Z bits and signs of the stabilizers in a canonical form, equal for equal states
+    // however they have been reached
+    std::vector<uint64_t> canonical_stabilizers() const;
+    private:
+    int num_qubits;
+    // Words per row
+    size_t words;
+    // Rows 0 to n-1 are destabilizers, n to 2n-1 stabilizers, 2n is scratch space
+    std::vector<uint64_t> xs;
+    std::vector<uint64_t> zs;
+    std::vector<uint8_t> signs;
+    uint64_t *x_row(size_t row)
+    {
+        return xs.data()+row*words;
+    }
+    uint64_t *z_row(size_t row)
+    {
+        return zs.data()+row*words;
+    }
+    bool x_bit(size_t row, int qubit) const
+    {
+        return (xs[row*words+(qubit>>6)]>>(qubit&63)) & 1;
+    }
+    // Multiplies row h by row i
+    void rowsum(size_t h, size_t i);
+    void apply(int qubit, const CliffordTable &table);
+    void apply(int q1, int q2, const CliffordTable &table);
+};
+// Result of check_reference()
+struct ReferenceCheck
+{
+    // Measurement whose outcome is random in the noiseless circuit. Frame simulations are only
+    // correct if shots don't depend on them, see FrameSimulator
+    struct RandomMeasurement
+    {
+        // Node whose circuit makes the measurement
+        std::string node;
+        MeasurementRef measurement;
+        // Nodes whose callbacks, branch conditions or correction tables read it
+        std::set<std::string> read_by;
+    };
+    std::vector<RandomMeasurement> random_measurements;
+    // Outcome of every measurement in the path of the shots without errors, random ones taken as 0
+    std::vector<TableauSimulator::Measurement> reference;
+    // Number of nodes run, and whether the check stopped after max_node_runs of them
+    uint64_t node_runs=0;
+    bool truncated=false;
+    // Whether no random measurement is read by the nodes
+    bool ok() const;
+};
+// Runs the noiseless circuits of every branch of a tree with a tableau simulator, to find measurements
+// with random outcomes. Every child of a node is run from the state at the end of the node, as errors
+// in the branches don't change which measurements are random. The measurements read by next_node_index()
+// and error_corrections() are those they read for shots without flipped measurements.
+// Nodes reached again with the same state and random measurements are not run again, and
+// paths end at nodes already in the path, as in analysis.h
+ReferenceCheck check_reference(std::shared_ptr<CircuitNode> root, uint64_t max_node_runs=100000);
@@ -0,0 +1,103 @@
+// Checks that the multithreaded code paths give the same results as running in a single thread
+// Without FRAMESIM_THREADS both paths run in the calling thread, and the results must match too
+#include "simulator.h"
+#include "nonsparsesim.h"
+#include "fault_enumeration.h"
+#include "sweep.h"
+#include <iostream>
+#include <sstream>
+static int failures = 0;
+static void check(bool ok, const std::string &name)
+{
+    std::cout<<(ok ? "ok   " : "FAIL ")<<name<<std::endl;
+    if (!ok)
+        failures++;
+}
+// Noisy tree which splits the shots by a measurement, and discards some of them
+static std::shared_ptr<CircuitNode> branching_tree()
+{
+    auto root = std::make_shared<CircuitNode>("root");
+    auto left = std::make_shared<CircuitNode>("left");
+    auto right = std::make_shared<CircuitNode>("right");
+    root->circuit.append(Instruction(InstructionType::H, {0}));
+    root->circuit.append(Instruction(InstructionType::CX, {0, 1}));
+    root->circuit.append(Instruction(InstructionType::DEPOLARIZE2, {0, 1}, 0.05));
+    root->circuit.append(Instruction(InstructionType::TICK, {}));
+    root->circuit.append(Instruction(InstructionType::DEPOLARIZE1, {0, 1, 2}, 0.02));
+    root->circuit.append(Instruction(InstructionType::MZ, {1}, {}, MeasurementTag{0, "m"}));
+    root->childs = {left, right};
+    root->next_node_index = [](MeasurementResults &res) { return res.is_flipped(1, MeasurementTag{0, "m"}) ? 1 : 0; };
+    left->circuit.append(Instruction(InstructionType::X_ERROR, {2}, 0.1));
+    left->circuit.append(Instruction(InstructionType::MZ, {2}, {}, MeasurementTag{0, "l"}));
+    left->next_node_index = [](MeasurementResults &res) { return res.is_flipped(2, MeasurementTag{0, "l"}) ? -1 : 0; };
+    right->circuit.append(Instruction(InstructionType::PAULI1, {0}, {0.01, 0.02, 0.03}));
+    right->circuit.append(Instruction(InstructionType::MX, {0}, {}, MeasurementTag{0, "r"}));
+    return root;
+}
+// Global index and flipped measurements of every shot
+static std::string shot_results(const BaseFrameSimulator &sim)
+{
+    std::map<uint64_t, std::string> shots;
+    auto &ids = sim.get_shot_ids();
+    for (size_t shot=0; shot<ids.size(); shot++)
+        shots[ids.global(shot)];
+    sim.for_each_flip([&](size_t shot, int qubit, const MeasurementTag &tag) {
+        shots[ids.global(shot)] += std::to_string(qubit)+tag.name+" ";
+    });
+    std::ostringstream os;
+    for (auto &[id, flips] : shots)
+        os<<id<<":"<<flips<<"\n";
+    return os.str();
+}
+template<typename Simulator>
+static std::string run_tree(bool pipelined)
+{
+    std::mt19937_64 rng(1);
+    Simulator sim(5000, rng);
+    sim.use_counter_rng(42);
+    if (pipelined)
+        sim.enable_pipelined_sampling(3);
+    sim.run(branching_tree());
+    return shot_results(sim);
+}
+static std::string enumeration_results(int num_threads)
+{
+    auto result = enumerate_logical_errors(branching_tree(), 2, [](MeasurementResults &res) {
+        return res.is_flipped(0, MeasurementTag{0, "r"}) != res.is_flipped(1, MeasurementTag{0, "m"});
+    }, num_threads);
+    std::ostringstream os;
+    os<<result.configurations<<"\n";
+    for (auto &faults : result.logical_errors) {
+        for (auto &fault : faults)
+            os<<fault<<", ";
+        os<<"\n";
+    }
+    return os.str();
+}
+static std::string sweep_results(int num_threads, bool dense)
+{
+    auto points = sweep_grid({{"p", {0.001, 0.01, 0.03}}, {"q", {0.01, 0.02}}});
+    SweepOptions options;
+    options.shots = 2000;
+    options.seed = 3;
+    options.num_threads = num_threads;
+    options.dense = dense;
+    auto results = run_sweep(branching_tree(), points, [](const SweepPoint &point) {
+        return std::make_unique<DepolarizingModel>(point.at("p"), point.at("q"));
+    }, [](MeasurementResults &res) {
+        return res.is_flipped(0, MeasurementTag{0, "r"});
+    }, options);
+    std::ostringstream os;
+    for (auto &result : results)
+        os<<result.point.at("p")<<" "<<result.point.at("q")<<": "<<result.shots<<" "<<result.kept_shots<<" "<<result.logical_errors<<"\n";
+    return os.str();
+}
+int main()
+{
+    check(run_tree<FrameSimulator>(true) == run_tree<FrameSimulator>(false), "pipelined sampling, FrameSimulator");
+    check(run_tree<DenseFrameSimulator>(true) == run_tree<DenseFrameSimulator>(false), "pipelined sampling, DenseFrameSimulator");
+    check(enumeration_results(4) == enumeration_results(1), "fault enumeration");
+    check(sweep_results(4, false) == sweep_results(1, false), "parameter sweep, FrameSimulator");
+    check(sweep_results(4, true) == sweep_results(1, true), "parameter sweep, DenseFrameSimulator");
+    return failures > 0;
+}
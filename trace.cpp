@@ -0,0 +1,235 @@
+#include "trace.h"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#ifndef NO_THREADS
+#include <mutex>
+#endif
+std::atomic<bool> trace_enabled;
+struct TraceEvent
+{
+    uint64_t start;
+    uint64_t duration;
+    uint32_t name;
+    // 'X' for spans, 'C' for counters
+    char phase;
+    const char *arg_names[2];
+    int64_t arg_values[2];
+};
+// Events recorded by a thread, and the names they refer to
+struct TraceBuffer
+{
+    int thread;
+    // Trace the events belong to
+    uint64_t generation=0;
+    std::vector<TraceEvent> events;
+    // Position of the next event, which overwrites the oldest one once the buffer is full
+    size_t next=0;
+    bool wrapped=false;
+    std::vector<std::string> names;
+    std::unordered_map<std::string, uint32_t> name_index;
+};
+static std::chrono::steady_clock::time_point trace_start;
+static std::atomic<uint64_t> trace_generation;
+static size_t events_per_thread;
+// Buffers of the running threads
+static std::vector<TraceBuffer*> buffers;
+// Events of the threads which have exited during the current trace, without the unused part of their buffers
+static std::vector<TraceBuffer> retired;
+// Buffers of exited threads, reused by new threads
+static std::vector<std::unique_ptr<TraceBuffer>> free_buffers;
+static int next_thread=0;
+#ifndef NO_THREADS
+static std::mutex buffers_mutex;
+#endif
+// Owner of the buffer of a thread, which retires its events and frees the buffer when the thread exits
+struct LocalBuffer
+{
+    std::unique_ptr<TraceBuffer> buffer;
+    ~LocalBuffer()
+    {
+        if (buffer == nullptr)
+            return;
+#ifndef NO_THREADS
+        std::lock_guard<std::mutex> lock(buffers_mutex);
+#endif
+        buffers.erase(std::find(buffers.begin(), buffers.end(), buffer.get()));
+        size_t count = buffer->wrapped ? buffer->events.size() : buffer->next;
+        if (buffer->generation == trace_generation.load() && count > 0) {
+            TraceBuffer events;
+            events.thread = buffer->thread;
+            events.generation = buffer->generation;
+            size_t begin = buffer->wrapped ? buffer->next : 0;
+            events.events.reserve(count);
+            for (size_t i=0; i<count; i++)
+                events.events.push_back(buffer->events[(begin+i)%buffer->events.size()]);
+            events.next = count;
+            events.names = std::move(buffer->names);
+            retired.push_back(std::move(events));
+        }
+        free_buffers.push_back(std::move(buffer));
+    }
+};
+// Buffer of the calling thread, cleared when a new trace has started
+static TraceBuffer &local_buffer()
+{
+    thread_local LocalBuffer local;
+    auto &buffer = local.buffer;
+    uint64_t generation = trace_generation.load();
+    if (buffer == nullptr) {
+#ifndef NO_THREADS
+        std::lock_guard<std::mutex> lock(buffers_mutex);
+#endif
+        if (free_buffers.empty()) {
+            buffer = std::make_unique<TraceBuffer>();
+        } else {
+            buffer = std::move(free_buffers.back());
+            free_buffers.pop_back();
+            // Cleared below, as if it belonged to a previous trace
+            buffer->generation = generation-1;
+        }
+        buffer->thread = next_thread++;
+        buffers.push_back(buffer.get());
+    }
+    if (buffer->generation != generation) {
+        buffer->generation = generation;
+        buffer->events.assign(events_per_thread, TraceEvent());
+        buffer->next = 0;
+        buffer->wrapped = false;
+        buffer->names.clear();
+        buffer->name_index.clear();
+    }
+    return *buffer;
+}
+static uint32_t intern_name(TraceBuffer &buffer, const std::string &name)
+{
+    auto [it, inserted] = buffer.name_index.try_emplace(name, buffer.names.size());
+    if (inserted)
+        buffer.names.push_back(name);
+    return it->second;
+}
+static void add_event(TraceBuffer &buffer, const TraceEvent &event)
+{
+    if (buffer.events.empty())
+        return;
+    buffer.events[buffer.next] = event;
+    if (++buffer.next == buffer.events.size()) {
+        buffer.next = 0;
+        buffer.wrapped = true;
+    }
+}
+void start_trace(size_t num_events)
+{
+    trace_enabled = false;
+    events_per_thread = num_events;
+    trace_start = std::chrono::steady_clock::now();
+    trace_generation++;
+    {
+#ifndef NO_THREADS
+        std::lock_guard<std::mutex> lock(buffers_mutex);
+#endif
+        retired.clear();
+    }
+    trace_enabled = true;
+}
+void stop_trace()
+{
+    trace_enabled = false;
+}
+uint64_t trace_time()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-trace_start).count();
+}
+void TraceSpan::begin(const char *category, const std::string &detail)
+{
+    auto &buffer = local_buffer();
+    generation = buffer.generation;
+    name = intern_name(buffer, detail.empty() ? std::string(category) : std::string(category)+" "+detail);
+    start = trace_time();
+}
+void TraceSpan::finish()
+{
+    active = false;
+    // Spans started in a previous trace are dropped
+    auto &buffer = local_buffer();
+    uint64_t now = trace_time();
+    if (buffer.generation != generation)
+        return;
+    add_event(buffer, {start, now-start, name, 'X', {arg_names[0], arg_names[1]}, {arg_values[0], arg_values[1]}});
+}
+void trace_complete(const char *name, uint64_t start, uint64_t duration)
+{
+    if (!tracing())
+        return;
+    auto &buffer = local_buffer();
+    add_event(buffer, {start, duration, intern_name(buffer, name), 'X', {nullptr, nullptr}, {0, 0}});
+}
+void trace_counter(const char *name, int64_t value)
+{
+    if (!tracing())
+        return;
+    auto &buffer = local_buffer();
+    add_event(buffer, {trace_time(), 0, intern_name(buffer, name), 'C', {"value", nullptr}, {value, 0}});
+}
+static void write_string(std::ostream &os, const std::string &str)
+{
+    os<<'"';
+    for (char c : str) {
+        if (c == '"' || c == '\\')
+            os<<'\\'<<c;
+        else if ((unsigned char)c < 0x20)
+            os<<' ';
+        else
+            os<<c;
+    }
+    os<<'"';
+}
+void write_trace(std::ostream &os)
+{
+#ifndef NO_THREADS
+    std::lock_guard<std::mutex> lock(buffers_mutex);
+#endif
+    os<<"{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    bool first = true;
+    std::vector<const TraceBuffer*> all(buffers.begin(), buffers.end());
+    for (auto &events : retired)
+        all.push_back(&events);
+    for (auto *buffer : all) {
+        if (buffer->generation != trace_generation.load())
+            continue;
+        size_t begin = buffer->wrapped ? buffer->next : 0;
+        size_t count = buffer->wrapped ? buffer->events.size() : buffer->next;
+        for (size_t i=0; i<count; i++) {
+            auto &event = buffer->events[(begin+i)%buffer->events.size()];
+            os<<(first ? "\n" : ",\n");
+            first = false;
+            // Timestamps are in microseconds
+            os<<"{\"name\":";
+            write_string(os, buffer->names[event.name]);
+            os<<",\"ph\":\""<<event.phase<<"\",\"pid\":1,\"tid\":"<<buffer->thread<<",\"ts\":"<<event.start/1000<<"."<<event.start%1000/100;
+            if (event.phase == 'X')
+                os<<",\"dur\":"<<event.duration/1000<<"."<<event.duration%1000/100;
+            if (event.arg_names[0] != nullptr) {
+                os<<",\"args\":{";
+                for (int j=0; j<2 && event.arg_names[j] != nullptr; j++)
+                    os<<(j > 0 ? "," : "")<<"\""<<event.arg_names[j]<<"\":"<<event.arg_values[j];
+                os<<"}";
+            }
+            os<<"}";
+        }
+    }
+    os<<"\n]}\n";
+}
+void save_trace(const std::string &path)
+{
+    std::ofstream file(path);
+    write_trace(file);
+    if (!file) {
+        std::cerr<<"Cannot write trace "<<path<<std::endl;
+        abort();
+    }
+}
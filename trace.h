@@ -0,0 +1,71 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <string>
+// Timeline of simulation runs, written in the Chrome trace event format (chrome://tracing, ui.perfetto.dev)
+// Simulators record spans for the nodes they run, the error corrections of every node, the split of shots
+// into branches and the noise sampling of every layer, and FrameSimulator the number of faulty shots at every TICK.
+// Events are stored in a ring buffer per thread, so only the last events are kept if a buffer fills up.
+// When a thread exits, its events are kept without the rest of its buffer, which is reused by the next new thread.
+// Recording is switched at runtime: when it is off, every recording point is a single flag check
+extern std::atomic<bool> trace_enabled;
+inline bool tracing()
+{
+    return trace_enabled.load(std::memory_order_relaxed);
+}
+// Starts recording, discarding previous events. Every thread keeps up to events_per_thread events
+// Must not be called while simulations are running
+void start_trace(size_t events_per_thread=size_t(1)<<20);
+void stop_trace();
+// Writes the recorded events. Threads must not be recording while the trace is written
+void write_trace(std::ostream &os);
+void save_trace(const std::string &path);
+// Span from construction to destruction, if recording when it is constructed
+class TraceSpan
+{
+    uint64_t start;
+    uint64_t generation;
+    uint32_t name;
+    bool active;
+    const char *arg_names[2] = {nullptr, nullptr};
+    int64_t arg_values[2] = {0, 0};
+    public:
+    TraceSpan(const char *category, const std::string &detail="") : active(tracing())
+    {
+        if (active)
+            begin(category, detail);
+    }
+    ~TraceSpan()
+    {
+        end();
+    }
+    // Adds a numeric argument shown with the span, up to two
+    void arg(const char *name, int64_t value)
+    {
+        if (!active)
+            return;
+        for (int i=0; i<2; i++) {
+            if (arg_names[i] == nullptr || arg_names[i] == name) {
+                arg_names[i] = name;
+                arg_values[i] = value;
+                return;
+            }
+        }
+    }
+    // Ends the span before its destruction
+    void end()
+    {
+        if (active)
+            finish();
+    }
+    private:
+    void begin(const char *category, const std::string &detail);
+    void finish();
+};
+// Nanoseconds since the start of the trace
+uint64_t trace_time();
+// Span with a given start and duration, for time accumulated by the caller
+void trace_complete(const char *name, uint64_t start, uint64_t duration);
+// Value of a counter, shown as a graph over time
+void trace_counter(const char *name, int64_t value);